@@ -0,0 +1,57 @@
+#!/bin/bash -e
+#
+# Create a loopback btrfs image containing a synthetic root file system as
+# snapshot 1, laid out for tukit's "subvolume" snapshot backend
+#
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2022 SUSE LLC
+#
+# Usage: mkimage.sh <image> <mount point>
+#
+# The size of the synthetic tree is controlled by the environment:
+#   BENCH_IMAGE_SIZE  size of the image file (default 2G)
+#   BENCH_DIRS        number of directories below /usr (default 100)
+#   BENCH_FILES       number of files per directory (default 100)
+#   BENCH_FILE_SIZE   size of each file in bytes (default 4096)
+#   BENCH_ETC_FILES   number of files in /etc (default 500)
+
+IMAGE="$1"
+MNT="$2"
+if [ -z "${IMAGE}" -o -z "${MNT}" ]; then
+    echo "Usage: $0 <image> <mount point>" >&2
+    exit 1
+fi
+
+: ${BENCH_IMAGE_SIZE:=2G}
+: ${BENCH_DIRS:=100}
+: ${BENCH_FILES:=100}
+: ${BENCH_FILE_SIZE:=4096}
+: ${BENCH_ETC_FILES:=500}
+
+truncate -s "${BENCH_IMAGE_SIZE}" "${IMAGE}"
+mkfs.btrfs -q -f "${IMAGE}"
+mkdir -p "${MNT}"
+mount -o loop "${IMAGE}" "${MNT}"
+
+mkdir "${MNT}/1"
+btrfs -q subvolume create "${MNT}/1/snapshot"
+ROOT="${MNT}/1/snapshot"
+for dir in dev etc proc root run sys tmp usr/lib var/cache var/lib var/log var/tmp; do
+    mkdir -p "${ROOT}/${dir}"
+done
+touch "${ROOT}/etc/fstab"
+
+for ((d = 0; d < BENCH_DIRS; d++)); do
+    mkdir "${ROOT}/usr/lib/bench${d}"
+    for ((f = 0; f < BENCH_FILES; f++)); do
+        head -c "${BENCH_FILE_SIZE}" /dev/urandom > "${ROOT}/usr/lib/bench${d}/file${f}"
+    done
+done
+for ((f = 0; f < BENCH_ETC_FILES; f++)); do
+    echo "setting${f}=${RANDOM}" > "${ROOT}/etc/bench${f}.conf"
+done
+
+echo "transactional-update-in-progress=no" > "${MNT}/1/info"
+echo 1 > "${MNT}/default"
+mkdir -p "${MNT}/overlay/1/etc" "${MNT}/locks"
+sync -f "${MNT}"
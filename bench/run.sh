@@ -0,0 +1,30 @@
+#!/bin/bash -e
+#
+# Run the transaction benchmarks on a temporary loopback btrfs image; needs
+# root permissions. Additional arguments are passed to tukit-bench.
+#
+# SPDX-License-Identifier: GPL-2.0-or-later
+# SPDX-FileCopyrightText: 2022 SUSE LLC
+#
+# Usage: run.sh <tukit-bench> [option...]
+
+BENCH="$1"
+shift || true
+if [ ! -x "${BENCH}" ]; then
+    echo "Usage: $0 <tukit-bench> [option...]" >&2
+    exit 1
+fi
+if [ "$(id -u)" != 0 ]; then
+    echo "The benchmarks have to be run as root." >&2
+    exit 1
+fi
+
+WORKDIR="$(mktemp -d /var/tmp/tukit-bench.XXXXXX)"
+cleanup() {
+    umount -R "${WORKDIR}/mnt" 2>/dev/null || true
+    rm -rf "${WORKDIR}"
+}
+trap cleanup EXIT
+
+"$(dirname "$0")/mkimage.sh" "${WORKDIR}/image" "${WORKDIR}/mnt"
+"${BENCH}" "$@" "${WORKDIR}/mnt"
@@ -0,0 +1,227 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Benchmark of the transaction lifecycle: Repeatedly runs transactions against
+  a snapshot directory (see mkimage.sh) using the "subvolume" snapshot backend
+  and reports latency percentiles of the phases measured by TUStats.
+ */
+
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Mount.hpp"
+#include "SnapshotManager.hpp"
+#include "Stats.hpp"
+#include "Transaction.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <getopt.h>
+#include <iostream>
+#include <map>
+#include <sched.h>
+#include <string>
+#include <sys/mount.h>
+#include <vector>
+
+using namespace std;
+using namespace TransactionalUpdate;
+
+// Samples in seconds, indexed by scenario and phase
+using Samples = map<string, map<string, vector<double>>>;
+
+static void displayHelp() {
+    cout << "Syntax: tukit-bench [option...] <snapshot directory>\n";
+    cout << "\n";
+    cout << "Scenarios:\n";
+    cout << "execute       init, callext, finalize\n";
+    cout << "keep-resume   init, keep; resume, callext, finalize\n";
+    cout << "discard       init with --discard, callext without changes, finalize\n";
+    cout << "\n";
+    cout << "Options:\n";
+    cout << "--iterations=<n>, -n <n>  Iterations per scenario (default 20)\n";
+    cout << "--depth=<n>, -d <n>       Number of old snapshots to keep, i.e. depth of\n";
+    cout << "                          the /etc overlay stack (default 0)\n";
+    cout << "--scenario=<name>, -s <name>  Only run the given scenario\n";
+    cout << "--verbose, -v             Show tukit's log messages\n";
+    cout << "--help, -h                Display this help and exit\n" << endl;
+}
+
+static int callExt(Transaction &transaction, vector<string> args) {
+    vector<char*> argv;
+    for (auto &arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    return transaction.callExt(argv.data());
+}
+
+static void runExecute() {
+    Transaction transaction{};
+    transaction.init("default");
+    callExt(transaction, {"touch", "{}/usr/lib/tukit-bench-stamp"});
+    transaction.finalize();
+}
+
+static void runKeepResume() {
+    string id;
+    {
+        Transaction transaction{};
+        transaction.init("default");
+        id = transaction.getSnapshot();
+        transaction.keep();
+    }
+    Transaction transaction{};
+    transaction.resume(id);
+    callExt(transaction, {"touch", "{}/usr/lib/tukit-bench-stamp"});
+    transaction.finalize();
+}
+
+static void runDiscard() {
+    Transaction transaction{};
+    transaction.setDiscardIfUnchanged(true);
+    transaction.init("default");
+    callExt(transaction, {"true"});
+    transaction.finalize();
+}
+
+// Transactions mount file systems of the running system, and discarding a transaction
+// merges its /etc back into the running system's /etc overlay: all of this has to stay
+// in a private mount namespace, with a throwaway upper layer on top of the host's /etc
+static void isolate(const filesystem::path &dir) {
+    if (unshare(CLONE_NEWNS) < 0)
+        throw runtime_error{"Creating a private mount namespace failed: " + string(strerror(errno))};
+    if (mount(nullptr, "/", nullptr, MS_REC | MS_PRIVATE, nullptr) < 0)
+        throw runtime_error{"Making the mounts private failed: " + string(strerror(errno))};
+
+    Mount mntEtc{"/etc"};
+    if (!mntEtc.isMount() || mntEtc.getFilesystem() != "overlay")
+        return;
+    filesystem::path upper = dir / "host-etc" / "upper";
+    filesystem::path work = dir / "host-etc" / "work";
+    filesystem::create_directories(upper);
+    filesystem::create_directories(work);
+    string options = "lowerdir=/etc,upperdir=" + upper.string() + ",workdir=" + work.string();
+    if (mount("overlay", "/etc", "overlay", 0, options.c_str()) < 0)
+        throw runtime_error{"Mounting a private /etc failed: " + string(strerror(errno))};
+}
+
+// Delete all but the newest `depth` snapshots besides the default snapshot
+static void cleanup(unsigned long depth) {
+    unique_ptr<SnapshotManager> mgr = SnapshotFactory::get();
+    string defaultId = mgr->getDefault();
+    vector<unsigned long> ids;
+    for (auto &[id, info] : mgr->list()) {
+        if (id != defaultId)
+            ids.push_back(stoul(id));
+    }
+    sort(ids.rbegin(), ids.rend());
+    for (size_t i = depth; i < ids.size(); i++) {
+        mgr->open(to_string(ids[i]))->abort();
+        filesystem::remove_all(filesystem::path{config.get("OVERLAY_DIR")} / to_string(ids[i]));
+    }
+}
+
+static double percentile(vector<double> values, double p) {
+    sort(values.begin(), values.end());
+    size_t rank = static_cast<size_t>(p / 100 * values.size() + 0.5);
+    return values[min(max(rank, size_t{1}), values.size()) - 1];
+}
+
+static void report(const Samples &samples) {
+    for (auto &[scenario, phases] : samples) {
+        cout << "\n" << scenario << ":\n";
+        printf("%-20s %10s %10s %10s %10s %10s\n", "phase [ms]", "p50", "p90", "p99", "max", "samples");
+        for (auto &[phase, values] : phases) {
+            printf("%-20s %10.2f %10.2f %10.2f %10.2f %10zu\n", phase.c_str(),
+                   percentile(values, 50) * 1000, percentile(values, 90) * 1000,
+                   percentile(values, 99) * 1000, percentile(values, 100) * 1000, values.size());
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    static const char optstring[] = "d:hn:s:v";
+    static const struct option longopts[] = {
+        { "depth", required_argument, nullptr, 'd' },
+        { "help", no_argument, nullptr, 'h' },
+        { "iterations", required_argument, nullptr, 'n' },
+        { "scenario", required_argument, nullptr, 's' },
+        { "verbose", no_argument, nullptr, 'v' },
+        { 0, 0, 0, 0 }
+    };
+    map<string, void(*)()> scenarios = {
+        {"discard", runDiscard},
+        {"execute", runExecute},
+        {"keep-resume", runKeepResume}
+    };
+
+    unsigned long iterations = 20;
+    unsigned long depth = 0;
+    string only;
+    tulog.level = TULogLevel::Error;
+    int c;
+    while ((c = getopt_long(argc, argv, optstring, longopts, nullptr)) != -1) {
+        switch (c) {
+        case 'd':
+            depth = stoul(optarg);
+            break;
+        case 'h':
+            displayHelp();
+            return 0;
+        case 'n':
+            iterations = stoul(optarg);
+            break;
+        case 's':
+            only = optarg;
+            break;
+        case 'v':
+            tulog.level = TULogLevel::Info;
+            break;
+        default:
+            displayHelp();
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || (!only.empty() && scenarios.count(only) == 0)) {
+        displayHelp();
+        return 1;
+    }
+
+    try {
+        filesystem::path dir = filesystem::absolute(argv[optind]);
+        config.set("SNAPSHOT_MANAGER", "subvolume");
+        config.set("SUBVOLUME_DIR", dir);
+        config.set("OVERLAY_DIR", dir / "overlay");
+        config.set("LOCKDIR", dir / "locks");
+        config.set("LOCKFILE", dir / "tukit.lock");
+        config.set("SESSION_DIR", dir / "sessions");
+        config.set("SPARE_SNAPSHOT", "no");
+        isolate(dir);
+
+        Samples samples;
+        for (auto &[name, run] : scenarios) {
+            if (!only.empty() && name != only)
+                continue;
+            for (unsigned long i = 0; i < iterations; i++) {
+                tustats.reset();
+                auto start = chrono::steady_clock::now();
+                run();
+                tustats.addTime("total", chrono::steady_clock::now() - start);
+                for (auto &[phase, p] : tustats.getPhases()) {
+                    samples[name][phase].push_back(chrono::duration<double>(p.time).count());
+                }
+                cleanup(depth);
+            }
+        }
+        report(samples);
+    } catch (const exception &e) {
+        tulog.flush();
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
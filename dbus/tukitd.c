@@ -1,360 +1,660 @@
+#define _GNU_SOURCE
 #include "Bindings/libtukit.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <systemd/sd-bus.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
 #include <wordexp.h>
 
-enum transactionstates { queued, running, finished };
+enum jobtypes { job_open, job_call, job_callext, job_close, job_abort };
 
-typedef struct t_entry {
+typedef struct job {
+    enum jobtypes type;
+    char* transaction; // base snapshot for job_open
+    char* command;
+    sd_bus_message* message;
+    int ret;
+    int exec_ret;
+    char* result; // ID of the new snapshot or output of the command
+    char* errmsg;
+    int counted; // included in the pending requests of the state index entry
+    struct job *next;
+} Job;
+
+// In-memory index of the snapshots and the transactions handled by this service. It is
+// seeded once on startup and then kept up to date from the results of our own jobs, so
+// clients can query it (or subscribe to StateChanged) without any snapshot manager calls.
+// Only accessed by the main event loop.
+typedef struct {
     char* id;
-    struct t_entry *next;
-    enum transactionstates state;
-} TransactionEntry;
-
-// Even though userdata / activeTransaction is shared between several threads, due to
-// systemd's serial event loop processing it's always guaranteed that no parallel
-// access will be happen: lockSnapshot will be called in the event functions before
-// starting the new thread, and unlockSnapshot is triggered by the signal when a
-// thread has finished.
-// Any method which does write the variable must do so from the main event loop.
-int lockSnapshot(void* userdata, const char* transaction, sd_bus_error *ret_error) {
-    fprintf(stdout, "Locking further invocations for snapshot %s...\n", transaction);
-    TransactionEntry* activeTransaction = userdata;
-    TransactionEntry* newTransaction;
-    while (activeTransaction->id != NULL) {
-        if (strcmp(activeTransaction->id, transaction) == 0) {
-            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "The transaction is currently in use by another thread.");
-            return -EBUSY;
-        }
-        activeTransaction = activeTransaction->next;
-    }
-    if ((newTransaction = malloc(sizeof(TransactionEntry))) == NULL) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error while allocating space for transaction.");
-        return -ENOMEM;
+    char* base;
+    const char* state; // "open", "closed" or "aborted"
+    char* command; // last command executed in the transaction
+    int exit_status;
+    int pending; // queued or running requests
+} SnapshotState;
+
+typedef struct {
+    SnapshotState* entries;
+    size_t count;
+    size_t size;
+    char* active_id;
+    char* default_id;
+} StateIndex;
+
+// Requests are executed by a fixed number of worker threads. All D-Bus
+// communication is done by the main event loop on its single bus connection:
+// finished jobs are put on the done list and the main loop is woken up via
+// the eventfd to send the replies and signals.
+// Jobs for the same transaction are never executed in parallel: a worker
+// will only pick the first queued job whose transaction isn't currently
+// processed by another worker, so jobs for a transaction are run in the order
+// they were received.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Job* queue;
+    Job* queue_tail;
+    Job* done;
+    Job* done_tail;
+    const char** active; // transaction processed by each worker
+    int workers;
+    int queued;
+    int max_queued;
+    int running;
+    int efd;
+    int stopping; // no new requests are accepted any more
+    int shutdown; // workers have to terminate
+    sd_bus* bus;
+    StateIndex states;
+} WorkQueue;
+
+typedef struct {
+    WorkQueue* wq;
+    int index;
+    pthread_t thread;
+} Worker;
+
+static int get_config_int(const char* key, int fallback) {
+    const char* value = tukit_get_config(key);
+    if (value == NULL) {
+        return fallback;
+    }
+    char* end;
+    long num = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || num < 1 || num > 1024) {
+        fprintf(stderr, "Invalid value '%s' for %s, using %d.\n", value, key, fallback);
+        num = fallback;
+    }
+    free((void*)value);
+    return (int)num;
+}
+
+static const char* tukit_description = "Snapshot Update of #";
+
+static const char* get_state(const SnapshotState* entry) {
+    return entry->pending > 0 ? "busy" : entry->state;
+}
+
+static SnapshotState* find_state(StateIndex* index, const char* id) {
+    for (size_t i = 0; i < index->count; i++) {
+        if (strcmp(index->entries[i].id, id) == 0) {
+            return &index->entries[i];
+        }
     }
-    newTransaction->id = NULL;
-    activeTransaction->id = strdup(transaction);
-    if (activeTransaction->id == NULL) {
-        free(newTransaction);
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error during strdup.");
-        return -ENOMEM;
+    return NULL;
+}
+
+static SnapshotState* add_state(StateIndex* index, const char* id, const char* base, const char* state) {
+    if (index->count == index->size) {
+        size_t size = index->size ? index->size * 2 : 64;
+        SnapshotState* entries = realloc(index->entries, size * sizeof(SnapshotState));
+        if (entries == NULL) {
+            return NULL;
+        }
+        index->entries = entries;
+        index->size = size;
+    }
+    SnapshotState* entry = &index->entries[index->count];
+    memset(entry, 0, sizeof(SnapshotState));
+    if ((entry->id = strdup(id)) == NULL || (entry->base = strdup(base)) == NULL) {
+        free(entry->id);
+        return NULL;
+    }
+    entry->state = state;
+    index->count++;
+    return entry;
+}
+
+static void remove_state(StateIndex* index, SnapshotState* entry) {
+    free(entry->id);
+    free(entry->base);
+    free(entry->command);
+    *entry = index->entries[--index->count];
+}
+
+static void free_states(StateIndex* index) {
+    while (index->count > 0) {
+        remove_state(index, &index->entries[index->count - 1]);
     }
-    activeTransaction->state = queued;
-    activeTransaction->next = newTransaction;
-    return 0;
+    free(index->entries);
+    free(index->active_id);
+    free(index->default_id);
 }
 
-void unlockSnapshot(void* userdata, const char* transaction) {
-    TransactionEntry* activeTransaction = userdata;
-    TransactionEntry* prevNext = NULL;
-
-    while (activeTransaction->id != NULL) {
-        // The entry point can't be changed, so just set the data of the to be deleted
-        // transaction to the next entry's data (also for later matches to have just one code
-        // path).
-        if (strcmp(activeTransaction->id, transaction) == 0) {
-            fprintf(stdout, "Unlocking snapshot %s...\n", transaction);
-            free(activeTransaction->id);
-            activeTransaction->id = activeTransaction->next->id;
-            prevNext = activeTransaction->next;
-            if (activeTransaction->id != NULL) {
-                activeTransaction->next = activeTransaction->next->next;
-            }
-            free(prevNext);
-            return;
+// The snapshot manager is only asked once; afterwards the index only follows our own changes
+static int seed_states(StateIndex* index) {
+    tukit_snapshot_info* list;
+    int count = tukit_list_snapshots(&list);
+    if (count < 0) {
+        return -1;
+    }
+    int ret = 0;
+    for (int i = 0; i < count && ret == 0; i++) {
+        // Spares only become transactions when they are claimed by Open
+        if (list[i].is_spare) {
+            continue;
+        }
+        const char* base = "";
+        if (strncmp(list[i].description, tukit_description, strlen(tukit_description)) == 0) {
+            base = list[i].description + strlen(tukit_description);
+        }
+        if (add_state(index, list[i].id, base, list[i].in_progress ? "open" : "closed") == NULL
+                || (list[i].active && (index->active_id = strdup(list[i].id)) == NULL)
+                || (list[i].is_default && (index->default_id = strdup(list[i].id)) == NULL)) {
+            ret = -ENOMEM;
         }
-        activeTransaction = activeTransaction->next;
     }
+    tukit_free_snapshot_list(list, count);
+    return ret;
 }
 
-sd_bus* get_bus() {
-    sd_bus *bus = NULL;
-    if (sd_bus_default_system(&bus) < 0) {
-        // When opening a new bus connection fails there aren't a lot of options to present this
-        // error to the user here. Maybe add some synchronization with the main thread and exit
-        // on error in the future?
-        fprintf(stderr, "Failed to connect to system bus.");
+static void emit_state_changed(sd_bus *bus, const SnapshotState* entry) {
+    int ret = sd_bus_emit_signal(bus, "/org/opensuse/tukit", "org.opensuse.tukit.Transaction", "StateChanged", "ss",
+                                 entry->id, get_state(entry));
+    if (ret < 0) {
+        fprintf(stderr, "Cannot send signal 'StateChanged' for %s: %s\n", entry->id, strerror(-ret));
     }
-    return bus;
 }
 
-int send_error_signal(sd_bus *bus, const char *transaction, const char *message, int error) {
-    if (bus == NULL) {
-        bus = get_bus();
+// Updates the index after a finished job; snapshots unknown so far (e.g. created with the
+// command line tool in the meantime) are added once a job succeeded on them
+static void update_state(WorkQueue* wq, Job* job) {
+    StateIndex* index = &wq->states;
+    SnapshotState* entry;
+
+    if (job->type == job_open) {
+        if (job->ret != 0) {
+            return;
+        }
+        const char* base = job->transaction;
+        if ((*base == '\0' || strcmp(base, "active") == 0) && index->active_id != NULL) {
+            base = index->active_id;
+        } else if (strcmp(base, "default") == 0 && index->default_id != NULL) {
+            base = index->default_id;
+        }
+        if ((entry = add_state(index, job->result, base, "open")) == NULL) {
+            fprintf(stderr, "Cannot add snapshot %s to the state index.\n", job->result);
+            return;
+        }
+        emit_state_changed(wq->bus, entry);
+        return;
     }
-    int ret = sd_bus_emit_signal(bus, "/org/opensuse/tukit", "org.opensuse.tukit", "Error", "ssi", transaction, message, error);
-    if (ret < 0) {
-        // Something is seriously broken when even an error message can't be sent any more...
-        fprintf(stderr, "Cannot reach D-Bus any more: %s\n", strerror(ret));
+
+    entry = find_state(index, job->transaction);
+    if (entry != NULL) {
+        if (job->counted) {
+            entry->pending--;
+        }
+    } else if (job->ret == 0 && (entry = add_state(index, job->transaction, "", "open")) == NULL) {
+        fprintf(stderr, "Cannot add snapshot %s to the state index.\n", job->transaction);
+    }
+    if (entry == NULL) {
+        return;
+    }
+    if (job->ret == 0) {
+        switch (job->type) {
+        case job_call:
+        case job_callext:
+            free(entry->command);
+            entry->command = strdup(job->command);
+            entry->exit_status = job->exec_ret;
+            break;
+        case job_close:
+            entry->state = "closed";
+            free(index->default_id);
+            index->default_id = strdup(entry->id);
+            break;
+        case job_abort:
+            entry->state = "aborted";
+            break;
+        default:
+            break;
+        }
+    }
+    emit_state_changed(wq->bus, entry);
+    if (strcmp(entry->state, "aborted") == 0 && entry->pending == 0) {
+        remove_state(index, entry);
     }
-    sd_bus_flush_close_unref(bus);
-    return ret;
 }
 
-static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    char *base;
-    const char *snapid;
-    int ret = 0;
+static void free_job(Job* job) {
+    if (job->message) {
+        sd_bus_message_unref(job->message);
+    }
+    free(job->transaction);
+    free(job->command);
+    free(job->result);
+    free(job->errmsg);
+    free(job);
+}
 
-    if (sd_bus_message_read(m, "s", &base) < 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read base snapshot identifier.");
-        return -1;
+static void fail_job(Job* job, const char* message, int ret) {
+    job->ret = ret;
+    if (job->errmsg == NULL) {
+        job->errmsg = strdup(message);
     }
+}
+
+static void run_job(Job* job) {
+    wordexp_t p;
+    const char* output = NULL;
+
     struct tukit_tx* tx = tukit_new_tx();
     if (tx == NULL) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        return -1;
-    }
-    if ((ret = tukit_tx_init(tx, base)) != 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+        fail_job(job, tukit_get_errmsg(), -1);
+        return;
     }
-    if (!ret) {
-        snapid = tukit_tx_get_snapshot(tx);
-        if (snapid == NULL) {
-            sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-            ret = -1;
+
+    if (job->type == job_open) {
+        if ((job->ret = tukit_tx_init(tx, job->transaction)) != 0) {
+            fail_job(job, tukit_get_errmsg(), job->ret);
+            goto finish_job;
         }
-    }
-    if (!ret && (ret = tukit_tx_keep(tx)) != 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
+        if ((job->result = (char*)tukit_tx_get_snapshot(tx)) == NULL) {
+            fail_job(job, tukit_get_errmsg(), -1);
+            goto finish_job;
+        }
+        if ((job->ret = tukit_tx_keep(tx)) != 0) {
+            fail_job(job, tukit_get_errmsg(), job->ret);
+        }
+        goto finish_job;
     }
 
-    tukit_free_tx(tx);
-    if (ret) {
-        return ret;
+    if ((job->ret = tukit_tx_resume(tx, job->transaction)) != 0) {
+        fail_job(job, tukit_get_errmsg(), job->ret);
+        goto finish_job;
     }
 
-    if (sd_bus_emit_signal(sd_bus_message_get_bus(m), "/org/opensuse/tukit", "org.opensuse.tukit.Transaction", "TransactionOpened", "s", snapid) < 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Sending signal 'TransactionOpened' failed.");
-        return -1;
+    switch (job->type) {
+    case job_call:
+    case job_callext:
+        fprintf(stdout, "Executing command `%s` in snapshot %s...\n", job->command, job->transaction);
+        job->ret = wordexp(job->command, &p, 0);
+        if (job->ret != 0) {
+            if (job->ret == WRDE_NOSPACE) {
+                wordfree(&p);
+            }
+            fail_job(job, "Command could not be processed.", job->ret);
+            goto finish_job;
+        }
+        if (job->type == job_call) {
+            job->exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
+        } else {
+            job->exec_ret = tukit_tx_call_ext(tx, p.we_wordv, &output);
+        }
+        wordfree(&p);
+        job->result = (char*)output;
+        if ((job->ret = tukit_tx_keep(tx)) != 0) {
+            fail_job(job, tukit_get_errmsg(), -1);
+        }
+        break;
+    case job_close:
+        if ((job->ret = tukit_tx_finalize(tx)) != 0) {
+            fail_job(job, tukit_get_errmsg(), job->ret);
+            break;
+        }
+        fprintf(stdout, "Snapshot %s closed.\n", job->transaction);
+        break;
+    case job_abort:
+        fprintf(stdout, "Snapshot %s aborted.\n", job->transaction);
+        break;
+    default:
+        break;
     }
 
-    fprintf(stdout, "Snapshot %s created.\n", snapid);
-
-    ret = sd_bus_reply_method_return(m, "s", snapid);
-    free((void*)snapid);
-    return ret;
+finish_job:
+    tukit_free_tx(tx);
 }
 
-struct execution_args {
-    char *transaction;
-    char *command;
-    int chrooted;
-    enum transactionstates *state;
-};
+static int is_active(WorkQueue* wq, const char* transaction) {
+    for (int i = 0; i < wq->workers; i++) {
+        if (wq->active[i] != NULL && strcmp(wq->active[i], transaction) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-static void *execution_func(void *args) {
-    int ret = 0;
-    int exec_ret = 0;
-    wordexp_t p;
+// Must be called with the mutex held
+static Job* take_job(WorkQueue* wq) {
+    Job* prev = NULL;
+    for (Job* job = wq->queue; job != NULL; prev = job, job = job->next) {
+        if (job->type != job_open && is_active(wq, job->transaction)) {
+            continue;
+        }
+        if (prev == NULL) {
+            wq->queue = job->next;
+        } else {
+            prev->next = job->next;
+        }
+        if (wq->queue_tail == job) {
+            wq->queue_tail = prev;
+        }
+        job->next = NULL;
+        return job;
+    }
+    return NULL;
+}
 
-    struct execution_args* ea = (struct execution_args*)args;
-    char transaction[strlen(ea->transaction) + 1]; // SIGSEGV
-    strcpy(transaction, ea->transaction);
-    char command[strlen(ea->command) + 1];
-    strcpy(command, ea->command);
-    int chrooted = ea->chrooted;
+static void* worker_func(void* args) {
+    Worker* worker = args;
+    WorkQueue* wq = worker->wq;
+    int ns = -1;
+    Job* job;
 
-    enum transactionstates *state = ea->state;
-    *state = running;
+    // Each transaction enters its own mount namespace; to be able to return
+    // to the original namespace after the job the file system information
+    // must not be shared with the other threads.
+    if (unshare(CLONE_FS) < 0 || (ns = open("/proc/thread-self/ns/mnt", O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Worker %d cannot preserve its mount namespace: %s\n", worker->index, strerror(errno));
+    }
 
-    fprintf(stdout, "Executing command `%s` in snapshot %s...\n", command, transaction);
+    pthread_mutex_lock(&wq->mutex);
+    while (!wq->shutdown) {
+        if ((job = take_job(wq)) == NULL) {
+            pthread_cond_wait(&wq->cond, &wq->mutex);
+            continue;
+        }
+        wq->queued--;
+        wq->running++;
+        wq->active[worker->index] = job->type == job_open ? NULL : job->transaction;
+        pthread_mutex_unlock(&wq->mutex);
+
+        run_job(job);
+        if (ns >= 0 && setns(ns, CLONE_NEWNS) < 0) {
+            fprintf(stderr, "Worker %d cannot return to its mount namespace: %s\n", worker->index, strerror(errno));
+        }
 
-    // The bus connection has been allocated in a parent process and is being now reused in the
-    // child process, so a new dbus connection has to be established (D-Bus doesn't support
-    // connection sharing between several threads). The bus will only be initialized directly
-    // before it is used to avoid timeouts.
-    sd_bus *bus = NULL;
+        pthread_mutex_lock(&wq->mutex);
+        wq->active[worker->index] = NULL;
+        wq->running--;
+        if (wq->done_tail == NULL) {
+            wq->done = job;
+        } else {
+            wq->done_tail->next = job;
+        }
+        wq->done_tail = job;
+        uint64_t one = 1;
+        if (write(wq->efd, &one, sizeof(one)) < 0) {
+            fprintf(stderr, "Cannot wake up the main loop: %s\n", strerror(errno));
+        }
+        // Jobs for this transaction may have been waiting
+        pthread_cond_broadcast(&wq->cond);
+    }
+    pthread_mutex_unlock(&wq->mutex);
 
-    struct tukit_tx* tx = tukit_new_tx();
-    if (tx == NULL) {
-        send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
-        goto finish_execute;
+    if (ns >= 0) {
+        close(ns);
     }
-    ret = tukit_tx_resume(tx, transaction);
-    if (ret != 0) {
-        send_error_signal(bus, transaction, tukit_get_errmsg(), ret);
-        goto finish_execute;
+    return NULL;
+}
+
+static int send_error_signal(sd_bus *bus, const char *transaction, const char *message, int error) {
+    int ret = sd_bus_emit_signal(bus, "/org/opensuse/tukit", "org.opensuse.tukit", "Error", "ssi", transaction, message, error);
+    if (ret < 0) {
+        // Something is seriously broken when even an error message can't be sent any more...
+        fprintf(stderr, "Cannot reach D-Bus any more: %s\n", strerror(-ret));
     }
+    return ret;
+}
 
-    ret = wordexp(command, &p, 0);
-    if (ret != 0) {
-        if (ret == WRDE_NOSPACE) {
-            wordfree(&p);
+static void finish_job(sd_bus *bus, Job* job) {
+    int ret = 0;
+    switch (job->type) {
+    case job_open:
+        if (job->ret != 0) {
+            ret = sd_bus_reply_method_errorf(job->message, "org.opensuse.tukit.Error", "%s", job->errmsg);
+            break;
+        }
+        fprintf(stdout, "Snapshot %s created.\n", job->result);
+        if (sd_bus_emit_signal(bus, "/org/opensuse/tukit", "org.opensuse.tukit.Transaction", "TransactionOpened", "s", job->result) < 0) {
+            ret = sd_bus_reply_method_errorf(job->message, "org.opensuse.tukit.Error", "Sending signal 'TransactionOpened' failed.");
+            break;
+        }
+        ret = sd_bus_reply_method_return(job->message, "s", job->result);
+        break;
+    case job_call:
+    case job_callext:
+        // The method call itself has already been answered
+        if (job->ret != 0) {
+            send_error_signal(bus, job->transaction, job->errmsg, job->ret);
+            break;
+        }
+        ret = sd_bus_emit_signal(bus, "/org/opensuse/tukit", "org.opensuse.tukit.Transaction", "CommandExecuted", "sis",
+                                 job->transaction, job->exec_ret, job->result ? job->result : "");
+        if (ret < 0) {
+            send_error_signal(bus, job->transaction, "Cannot send signal 'CommandExecuted'.", ret);
+        }
+        ret = 0;
+        break;
+    case job_close:
+    case job_abort:
+        if (job->ret != 0) {
+            ret = sd_bus_reply_method_errorf(job->message, "org.opensuse.tukit.Error", "%s", job->errmsg);
+            break;
         }
-        send_error_signal(bus, transaction, "Command could not be processed.", ret);
-        goto finish_execute;
+        ret = sd_bus_reply_method_return(job->message, "i", job->ret);
+        break;
     }
-
-    const char* output;
-    if (chrooted) {
-        exec_ret = tukit_tx_execute(tx, p.we_wordv, &output);
-    } else {
-        exec_ret = tukit_tx_call_ext(tx, p.we_wordv, &output);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot reply to request for %s: %s\n", job->transaction, strerror(-ret));
     }
+}
 
-    wordfree(&p);
-
-    ret = tukit_tx_keep(tx);
-    if (ret != 0) {
-        free((void*)output);
-        send_error_signal(bus, transaction, tukit_get_errmsg(), -1);
-        goto finish_execute;
-    }
+static int jobs_done_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+    WorkQueue* wq = userdata;
+    uint64_t count;
+    Job* job;
+    int idle;
 
-    bus = get_bus();
-    ret = sd_bus_emit_signal(bus, "/org/opensuse/tukit", "org.opensuse.tukit.Transaction", "CommandExecuted", "sis", transaction, exec_ret, output);
-    if (ret < 0) {
-        send_error_signal(bus, transaction, "Cannot send signal 'CommandExecuted'.", ret);
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "Cannot read from eventfd: %s\n", strerror(errno));
     }
 
-    free((void*)output);
+    pthread_mutex_lock(&wq->mutex);
+    job = wq->done;
+    wq->done = wq->done_tail = NULL;
+    pthread_mutex_unlock(&wq->mutex);
 
-finish_execute:
-    sd_bus_flush_close_unref(bus);
-    tukit_free_tx(tx);
+    while (job != NULL) {
+        Job* next = job->next;
+        update_state(wq, job);
+        finish_job(wq->bus, job);
+        free_job(job);
+        job = next;
+    }
 
-    return (void*)(intptr_t) ret;
+    pthread_mutex_lock(&wq->mutex);
+    idle = wq->queued == 0 && wq->running == 0 && wq->done == NULL;
+    pthread_mutex_unlock(&wq->mutex);
+    if (wq->stopping && idle) {
+        fprintf(stdout, "Terminating.\n");
+        int ret;
+        if ((ret = sd_event_exit(sd_event_source_get_event(s), 0)) < 0) {
+            fprintf(stderr, "Cannot exit the main loop! %s\n", strerror(-ret));
+            exit(1);
+        }
+    }
+    return 0;
 }
 
-static int execute(sd_bus_message *m, void *userdata,
-           sd_bus_error *ret_error, const int chrooted) {
+static int submit_job(WorkQueue* wq, sd_bus_message *m, sd_bus_error *ret_error, enum jobtypes type) {
+    const char *transaction;
+    const char *command = NULL;
     int ret;
-    pthread_t execute_thread;
-    struct execution_args exec_args;
-    TransactionEntry* activeTransaction = userdata;
 
-    if (sd_bus_message_read(m, "ss", &exec_args.transaction, &exec_args.command) < 0) {
+    if (type == job_call || type == job_callext) {
+        ret = sd_bus_message_read(m, "ss", &transaction, &command);
+    } else {
+        ret = sd_bus_message_read(m, "s", &transaction);
+    }
+    if (ret < 0) {
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
         return -1;
     }
 
-    ret = lockSnapshot(userdata, exec_args.transaction, ret_error);
-    if (ret != 0) {
-        return ret;
+    Job* job = calloc(1, sizeof(Job));
+    if (job == NULL || (job->transaction = strdup(transaction)) == NULL
+            || (command != NULL && (job->command = strdup(command)) == NULL)) {
+        if (job != NULL) {
+            free_job(job);
+        }
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Error while allocating space for request.");
+        return -ENOMEM;
     }
-
-    while (activeTransaction->next->id != NULL) {
-        activeTransaction = activeTransaction->next;
+    job->type = type;
+    // The state index is only touched by the main loop, which also finishes the job
+    SnapshotState* entry = type == job_open ? NULL : find_state(&wq->states, transaction);
+    job->counted = entry != NULL;
+
+    pthread_mutex_lock(&wq->mutex);
+    if (wq->stopping) {
+        pthread_mutex_unlock(&wq->mutex);
+        free_job(job);
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "The service is shutting down.");
+        return -ESHUTDOWN;
+    }
+    if (wq->queued >= wq->max_queued) {
+        pthread_mutex_unlock(&wq->mutex);
+        free_job(job);
+        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Too many queued requests.");
+        return -EBUSY;
+    }
+    job->message = sd_bus_message_ref(m);
+    if (wq->queue_tail == NULL) {
+        wq->queue = job;
+    } else {
+        wq->queue_tail->next = job;
     }
-    exec_args.chrooted = chrooted;
-    exec_args.state = &activeTransaction->state;
+    wq->queue_tail = job;
+    wq->queued++;
+    pthread_cond_signal(&wq->cond);
+    pthread_mutex_unlock(&wq->mutex);
 
-    ret = pthread_create(&execute_thread, NULL, execution_func, &exec_args);
-    while (activeTransaction->state != running) {
-        usleep(500);
+    if (type != job_open) {
+        fprintf(stdout, "Queued request for snapshot %s.\n", transaction);
+        if (entry != NULL && entry->pending++ == 0) {
+            emit_state_changed(wq->bus, entry);
+        }
     }
+    return 0;
+}
 
-    pthread_detach(execute_thread);
-
-    return ret;
+// Open, Close and Abort are answered by finish_job once the job is done
+static int transaction_open(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    int ret = submit_job(userdata, m, ret_error, job_open);
+    return ret ? ret : 1;
 }
 
 static int transaction_call(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int ret = execute(m, userdata, ret_error, 1);
+    int ret = submit_job(userdata, m, ret_error, job_call);
     if (ret)
         return ret;
     return sd_bus_reply_method_return(m, "");
 }
 
 static int transaction_callext(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    int ret = execute(m, userdata, ret_error, 0);
+    int ret = submit_job(userdata, m, ret_error, job_callext);
     if (ret)
         return ret;
     return sd_bus_reply_method_return(m, "");
 }
 
-static int signalCallback(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    char *transaction;
+static int transaction_close(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    int ret = submit_job(userdata, m, ret_error, job_close);
+    return ret ? ret : 1;
+}
 
-    if (sd_bus_message_read(m, "s", &transaction) < 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read transaction ID.");
-        return -1;
-    }
+static int transaction_abort(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    int ret = submit_job(userdata, m, ret_error, job_abort);
+    return ret ? ret : 1;
+}
 
-    unlockSnapshot(userdata, transaction);
-    return 0;
+static int append_state(sd_bus_message *reply, const SnapshotState* entry) {
+    return sd_bus_message_append(reply, "(ssssi)", entry->id, entry->base, get_state(entry),
+                                 entry->command ? entry->command : "", entry->exit_status);
 }
 
-static int transaction_close(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    char *transaction;
-    int ret = 0;
+static int transaction_list(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    WorkQueue* wq = userdata;
+    sd_bus_message *reply = NULL;
+    int ret;
 
-    if (sd_bus_message_read(m, "s", &transaction) < 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
-        return -1;
-    }
-    ret = lockSnapshot(userdata, transaction, ret_error);
-    if (ret != 0) {
+    if ((ret = sd_bus_message_new_method_return(m, &reply)) < 0)
         return ret;
+    if ((ret = sd_bus_message_open_container(reply, 'a', "(ssssi)")) < 0)
+        goto finish;
+    for (size_t i = 0; i < wq->states.count; i++) {
+        if ((ret = append_state(reply, &wq->states.entries[i])) < 0)
+            goto finish;
     }
-    struct tukit_tx* tx = tukit_new_tx();
-    if (tx == NULL) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        goto finish_close;
-    }
-    if ((ret = tukit_tx_resume(tx, transaction)) != 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        goto finish_close;
-    }
-    if ((ret = tukit_tx_finalize(tx)) != 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        goto finish_close;
-    }
-
-    fprintf(stdout, "Snapshot %s closed.\n", transaction);
-    sd_bus_reply_method_return(m, "i", ret);
-
-finish_close:
-    tukit_free_tx(tx);
-    unlockSnapshot(userdata, transaction);
+    if ((ret = sd_bus_message_close_container(reply)) < 0)
+        goto finish;
+    ret = sd_bus_send(NULL, reply, NULL);
 
+finish:
+    sd_bus_message_unref(reply);
     return ret;
 }
 
-static int transaction_abort(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-    char *transaction;
-    int ret = 0;
+static int transaction_get_state(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    WorkQueue* wq = userdata;
+    const char *transaction;
 
     if (sd_bus_message_read(m, "s", &transaction) < 0) {
         sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", "Could not read D-Bus parameters.");
         return -1;
     }
-    ret = lockSnapshot(userdata, transaction, ret_error);
-    if (ret != 0) {
-        return ret;
-    }
-    struct tukit_tx* tx = tukit_new_tx();
-    if (tx == NULL) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-	goto finish_abort;
-    }
-    if ((ret = tukit_tx_resume(tx, transaction)) != 0) {
-        sd_bus_error_set_const(ret_error, "org.opensuse.tukit.Error", tukit_get_errmsg());
-        goto finish_abort;
+    SnapshotState* entry = find_state(&wq->states, transaction);
+    if (entry == NULL) {
+        return sd_bus_error_setf(ret_error, "org.opensuse.tukit.Error", "Unknown snapshot %s.", transaction);
     }
-    fprintf(stdout, "Snapshot %s aborted.\n", transaction);
-    sd_bus_reply_method_return(m, "i", ret);
-
-finish_abort:
-    tukit_free_tx(tx);
-    unlockSnapshot(userdata, transaction);
-
-    return ret;
+    return sd_bus_reply_method_return(m, "sssi", entry->base, get_state(entry),
+                                      entry->command ? entry->command : "", entry->exit_status);
 }
 
 int event_handler(sd_event_source *s, const struct signalfd_siginfo *si, void *userdata) {
-    TransactionEntry* activeTransaction = userdata;
-    if (activeTransaction->id != NULL) {
+    WorkQueue* wq = userdata;
+    int idle;
+
+    pthread_mutex_lock(&wq->mutex);
+    wq->stopping = 1;
+    idle = wq->queued == 0 && wq->running == 0 && wq->done == NULL;
+    pthread_mutex_unlock(&wq->mutex);
+
+    if (!idle) {
+        // Terminating is done by jobs_done_handler after the last job
         fprintf(stdout, "Waiting for remaining transactions to finish...\n");
-        sleep(1);
-        kill(si->ssi_pid, si->ssi_signo);
-        // TODO: New requests should probably be rejected from here, but unlocking is an event itself...
     } else {
         fprintf(stdout, "Terminating.\n");
         int ret;
@@ -373,8 +673,12 @@ static const sd_bus_vtable tukit_transaction_vtable[] = {
     SD_BUS_METHOD_WITH_ARGS("CallExt", SD_BUS_ARGS("s", transaction, "s", command), SD_BUS_NO_RESULT, transaction_callext, 0),
     SD_BUS_METHOD_WITH_ARGS("Close", SD_BUS_ARGS("s", transaction), SD_BUS_RESULT("i", ret), transaction_close, 0),
     SD_BUS_METHOD_WITH_ARGS("Abort", SD_BUS_ARGS("s", transaction), SD_BUS_RESULT("i", ret), transaction_abort, 0),
+    SD_BUS_METHOD_WITH_ARGS("List", SD_BUS_NO_ARGS, SD_BUS_RESULT("a(ssssi)", snapshots), transaction_list, 0),
+    SD_BUS_METHOD_WITH_ARGS("GetState", SD_BUS_ARGS("s", transaction),
+                            SD_BUS_RESULT("s", base, "s", state, "s", command, "i", returncode), transaction_get_state, 0),
     SD_BUS_SIGNAL_WITH_ARGS("TransactionOpened", SD_BUS_ARGS("s", snapshot), 0),
     SD_BUS_SIGNAL_WITH_ARGS("CommandExecuted", SD_BUS_ARGS("s", snapshot, "i", returncode, "s", output), 0),
+    SD_BUS_SIGNAL_WITH_ARGS("StateChanged", SD_BUS_ARGS("s", snapshot, "s", state), 0),
     SD_BUS_VTABLE_END
 };
 
@@ -384,28 +688,52 @@ int main() {
     sd_bus_slot *slot = NULL;
     sd_bus *bus = NULL;
     sd_event *event = NULL;
+    Worker* workers = NULL;
+    int started = 0;
     int ret = 1;
 
-    TransactionEntry* activeTransactions = (TransactionEntry*) malloc(sizeof(TransactionEntry));
-    if (activeTransactions == NULL) {
-        fprintf(stderr, "malloc failed for TransactionEntry.\n");
+    WorkQueue wq = {
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .efd = -1
+    };
+    wq.workers = get_config_int("TUKITD_MAX_WORKERS", 4);
+    wq.max_queued = get_config_int("TUKITD_MAX_QUEUED", 64);
+
+    wq.active = calloc(wq.workers, sizeof(char*));
+    workers = calloc(wq.workers, sizeof(Worker));
+    if (wq.active == NULL || workers == NULL) {
+        fprintf(stderr, "malloc failed for worker pool.\n");
+        ret = -ENOMEM;
+        goto finish;
+    }
+
+    wq.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wq.efd < 0) {
+        ret = -errno;
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(-ret));
         goto finish;
     }
-    activeTransactions->id = NULL;
-    activeTransactions->state = queued;
 
     ret = sd_bus_open_system(&bus);
     if (ret < 0) {
         fprintf(stderr, "Failed to connect to system bus: %s\n", strerror(-ret));
         goto finish;
     }
+    wq.bus = bus;
+
+    ret = seed_states(&wq.states);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to read the list of snapshots: %s\n", ret == -ENOMEM ? strerror(-ret) : tukit_get_errmsg());
+        goto finish;
+    }
 
     ret = sd_bus_add_object_vtable(bus,
                                    &slot,
                                    "/org/opensuse/tukit/Transaction",
                                    "org.opensuse.tukit.Transaction",
                                    tukit_transaction_vtable,
-                                   activeTransactions);
+                                   &wq);
     if (ret < 0) {
         fprintf(stderr, "Failed to issue method call: %s\n", strerror(-ret));
         goto finish;
@@ -418,19 +746,6 @@ int main() {
         goto finish;
     }
 
-    ret = sd_bus_match_signal(bus,
-                NULL,
-                NULL,
-                "/org/opensuse/tukit",
-                NULL,
-                NULL,
-                signalCallback,
-                activeTransactions);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to register DBus signal listener: %s\n", strerror(-ret));
-        goto finish;
-    }
-
     ret = sd_event_default(&event);
     if (ret < 0) {
         fprintf(stderr, "Failed to create default event loop: %s\n", strerror(-ret));
@@ -441,28 +756,45 @@ int main() {
         fprintf(stderr, "Failed to set the signal set: %s\n", strerror(-ret));
         goto finish;
     }
-    /* Block SIGTERM first, so that the event loop can handle it */
+    /* Block SIGTERM first, so that the event loop can handle it; the worker
+       threads inherit the signal mask */
     if (sigprocmask(SIG_BLOCK, &ss, NULL) < 0) {
         fprintf(stderr, "Failed to block the signals: %s\n", strerror(-ret));
         goto finish;
     }
     /* Let's make use of the default handler and "floating" reference features of sd_event_add_signal() */
-    ret = sd_event_add_signal(event, NULL, SIGTERM, event_handler, activeTransactions);
+    ret = sd_event_add_signal(event, NULL, SIGTERM, event_handler, &wq);
     if (ret < 0) {
         fprintf(stderr, "Could not add signal handler for SIGTERM to event loop: %s\n", strerror(-ret));
         goto finish;
     }
-    ret = sd_event_add_signal(event, NULL, SIGINT, event_handler, activeTransactions);
+    ret = sd_event_add_signal(event, NULL, SIGINT, event_handler, &wq);
     if (ret < 0) {
         fprintf(stderr, "Could not add signal handler for SIGINT to event loop: %s\n", strerror(-ret));
         goto finish;
     }
+    ret = sd_event_add_io(event, NULL, wq.efd, EPOLLIN, jobs_done_handler, &wq);
+    if (ret < 0) {
+        fprintf(stderr, "Could not add worker notifications to event loop: %s\n", strerror(-ret));
+        goto finish;
+    }
     ret = sd_bus_attach_event(bus, event, 0);
     if (ret < 0) {
         fprintf(stderr, "Could not add sd-bus handling to event bus: %s\n", strerror(-ret));
         goto finish;
     }
 
+    for (; started < wq.workers; started++) {
+        workers[started].wq = &wq;
+        workers[started].index = started;
+        ret = -pthread_create(&workers[started].thread, NULL, worker_func, &workers[started]);
+        if (ret < 0) {
+            fprintf(stderr, "Could not start worker thread: %s\n", strerror(-ret));
+            goto finish;
+        }
+    }
+    fprintf(stdout, "Using %d workers, queuing up to %d requests.\n", wq.workers, wq.max_queued);
+
     ret = sd_event_loop(event);
     if (ret < 0) {
         fprintf(stderr, "Error while running event loop: %s\n", strerror(-ret));
@@ -470,13 +802,30 @@ int main() {
     }
 
 finish:
-    while (activeTransactions && activeTransactions->id != NULL) {
-        TransactionEntry* nextTransaction = activeTransactions->next;
-        free(activeTransactions->id);
-        free(activeTransactions);
-        activeTransactions = nextTransaction;
+    pthread_mutex_lock(&wq.mutex);
+    wq.stopping = 1;
+    wq.shutdown = 1;
+    pthread_cond_broadcast(&wq.cond);
+    pthread_mutex_unlock(&wq.mutex);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (Job* job = wq.queue; job != NULL;) {
+        Job* next = job->next;
+        free_job(job);
+        job = next;
+    }
+    for (Job* job = wq.done; job != NULL;) {
+        Job* next = job->next;
+        free_job(job);
+        job = next;
+    }
+    free(workers);
+    free(wq.active);
+    free_states(&wq.states);
+    if (wq.efd >= 0) {
+        close(wq.efd);
     }
-    free(activeTransactions);
     sd_event_unref(event);
     sd_bus_slot_unref(slot);
     sd_bus_unref(bus);
@@ -3,10 +3,15 @@
 /* SPDX-FileCopyrightText: SUSE LLC */
 
 #include "libtukit.h"
+#include "Configuration.hpp"
 #include "Log.hpp"
+#include "SnapshotManager.hpp"
+#include "Spare.hpp"
+#include "Stats.hpp"
 #include "Transaction.hpp"
 #include <exception>
 #include <thread>
+#include <vector>
 #include <string.h>
 
 using namespace TransactionalUpdate;
@@ -18,6 +23,67 @@ const char* tukit_get_errmsg() {
 void tukit_set_loglevel(loglevel lv) {
     tulog.level = static_cast<TULogLevel>(lv);
 }
+/* Free return string with free() */
+const char* tukit_get_config(const char* key) {
+    try {
+        return strdup(config.get(key).c_str());
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return nullptr;
+    }
+}
+/* Free return string with free() */
+const char* tukit_get_stats() {
+    try {
+        return strdup(tustats.toJson().c_str());
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return nullptr;
+    }
+}
+void tukit_reset_stats() {
+    tustats.reset();
+}
+int tukit_list_snapshots(tukit_snapshot_info* list[]) {
+    tukit_snapshot_info* snapshots = nullptr;
+    int count = 0;
+    try {
+        std::unique_ptr<SnapshotManager> mgr = SnapshotFactory::get();
+        SnapshotIndex index = mgr->list();
+        snapshots = static_cast<tukit_snapshot_info*>(calloc(index.size() + 1, sizeof(tukit_snapshot_info)));
+        if (snapshots == nullptr)
+            throw std::bad_alloc();
+        for (auto &[id, info] : index) {
+            tukit_snapshot_info& entry = snapshots[count++];
+            entry.id = strdup(id.c_str());
+            entry.description = strdup(info.description.c_str());
+            if (entry.id == nullptr || entry.description == nullptr)
+                throw std::bad_alloc();
+            entry.active = info.active;
+            entry.is_default = info.isDefault;
+            entry.in_progress = info.inProgress;
+            entry.is_spare = info.inProgress && Spare::isSpare(*mgr->open(id));
+        }
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        tukit_free_snapshot_list(snapshots, count);
+        return -1;
+    }
+    *list = snapshots;
+    return count;
+}
+void tukit_free_snapshot_list(tukit_snapshot_info list[], int count) {
+    if (list == nullptr)
+        return;
+    for (int i = 0; i < count; i++) {
+        free(list[i].id);
+        free(list[i].description);
+    }
+    free(list);
+}
 tukit_tx tukit_new_tx() {
     Transaction* transaction = nullptr;
     try {
@@ -99,6 +165,101 @@ int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]) {
         return -1;
     }
 }
+int tukit_tx_execute_stream(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        // Without a callback the output is passed through to the caller's streams
+        Transaction::OutputCallback cb;
+        if (callback) {
+            cb = [callback, userdata](int stream, const char* data, size_t len) {
+                callback(stream, data, len, userdata);
+            };
+        }
+        return transaction->executeStream(argv, cb);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_call_ext_stream(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        // Without a callback the output is passed through to the caller's streams
+        Transaction::OutputCallback cb;
+        if (callback) {
+            cb = [callback, userdata](int stream, const char* data, size_t len) {
+                callback(stream, data, len, userdata);
+            };
+        }
+        return transaction->callExtStream(argv, cb);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_execute_async(tukit_tx tx, char* argv[]) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return transaction->executeAsync(argv);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_call_ext_async(tukit_tx tx, char* argv[]) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        return transaction->callExtAsync(argv);
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_complete(tukit_tx tx, const char* output[]) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    std::string buffer;
+    try {
+        int ret = transaction->complete(output ? &buffer : nullptr);
+        if (output) {
+            *output = strdup(buffer.c_str());
+        }
+        return ret;
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
+int tukit_tx_execute_many(tukit_tx tx, char** argv[], const int external[], size_t count, int stop_on_error, int status[], const char* output[]) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    try {
+        std::vector<Transaction::Command> commands;
+        for (size_t i = 0; i < count; i++) {
+            Transaction::Command command;
+            for (int j = 0; argv[i][j] != nullptr; j++) {
+                command.argv.push_back(argv[i][j]);
+            }
+            command.external = external && external[i];
+            commands.push_back(std::move(command));
+        }
+        std::vector<Transaction::CommandResult> results = transaction->executeMany(commands, stop_on_error, output != nullptr);
+        for (size_t i = 0; i < results.size(); i++) {
+            if (status)
+                status[i] = results[i].status;
+            if (output)
+                output[i] = strdup(results[i].output.c_str());
+        }
+        return results.size();
+    } catch (const std::exception &e) {
+        fprintf(stderr, "ERROR: %s\n", e.what());
+        errmsg = e.what();
+        return -1;
+    }
+}
 int tukit_tx_finalize(tukit_tx tx) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     try {
@@ -121,6 +282,11 @@ int tukit_tx_keep(tukit_tx tx) {
     }
     return 0;
 }
+int tukit_tx_set_timeout(tukit_tx tx, unsigned int seconds) {
+    Transaction* transaction = reinterpret_cast<Transaction*>(tx);
+    transaction->setTimeout(seconds);
+    return 0;
+}
 int tukit_tx_send_signal(tukit_tx tx, int signal) {
     Transaction* transaction = reinterpret_cast<Transaction*>(tx);
     try {
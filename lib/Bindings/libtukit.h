@@ -11,6 +11,7 @@
 
 #ifndef T_U_TUKIT_H
 #define T_U_TUKIT_H
+#include <stddef.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -21,6 +22,23 @@ typedef enum {
 
 const char* tukit_get_errmsg();
 void tukit_set_loglevel(loglevel lv);
+const char* tukit_get_config(const char* key);
+/* Timings and counters of all transactions of the calling thread since the last reset
+   as a JSON object; free return string with free() */
+const char* tukit_get_stats();
+void tukit_reset_stats();
+typedef struct {
+    char* id;
+    int active;
+    int is_default;
+    int in_progress;
+    int is_spare; // prepared spare snapshot (see SPARE_SNAPSHOT), not a transaction
+    char* description;
+} tukit_snapshot_info;
+/* Stores one entry per existing snapshot in list and returns the number of entries, -1 on
+   error; free the list with tukit_free_snapshot_list() */
+int tukit_list_snapshots(tukit_snapshot_info* list[]);
+void tukit_free_snapshot_list(tukit_snapshot_info list[], int count);
 typedef void* tukit_tx;
 tukit_tx tukit_new_tx();
 void tukit_free_tx(tukit_tx tx);
@@ -29,8 +47,25 @@ int tukit_tx_discard_if_unchanged(tukit_tx tx, int discard);
 int tukit_tx_resume(tukit_tx tx, char* id);
 int tukit_tx_execute(tukit_tx tx, char* argv[], const char* output[]);
 int tukit_tx_call_ext(tukit_tx tx, char* argv[], const char* output[]);
+/* stream is 1 for stdout and 2 for stderr; data is not null terminated. The
+   order of output is only kept within each stream, unlike the combined output
+   of tukit_tx_execute() and tukit_tx_call_ext(). */
+typedef void (*tukit_output_cb)(int stream, const char* data, size_t len, void* userdata);
+int tukit_tx_execute_stream(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata);
+int tukit_tx_call_ext_stream(tukit_tx tx, char* argv[], tukit_output_cb callback, void* userdata);
+/* Runs count commands; for external[i] != 0 argv[i] is run like with tukit_tx_call_ext.
+   Returns the number of commands executed; status and output (free each string with
+   free()) may be NULL, if output is NULL the commands' output is not captured. */
+int tukit_tx_execute_many(tukit_tx tx, char** argv[], const int external[], size_t count, int stop_on_error, int status[], const char* output[]);
+/* Start the command without waiting for it; the returned file descriptor becomes readable
+   (e.g. for poll()) when the command terminated. Collect the result with tukit_tx_complete(). */
+int tukit_tx_execute_async(tukit_tx tx, char* argv[]);
+int tukit_tx_call_ext_async(tukit_tx tx, char* argv[]);
+/* Returns the exit status of the started command; output may be NULL, otherwise free it with free() */
+int tukit_tx_complete(tukit_tx tx, const char* output[]);
 int tukit_tx_finalize(tukit_tx tx);
 int tukit_tx_keep(tukit_tx tx);
+int tukit_tx_set_timeout(tukit_tx tx, unsigned int seconds);
 int tukit_tx_send_signal(tukit_tx tx, int signal);
 int tukit_tx_is_initialized(tukit_tx tx);
 const char* tukit_tx_get_snapshot(tukit_tx tx);
@@ -0,0 +1,213 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Helper functions for direct btrfs ioctl access
+ */
+
+#include "Btrfs.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/magic.h>
+#include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+namespace {
+// Minimal RAII wrapper to make sure the descriptor is closed on exceptions
+struct DirFd {
+    DirFd(const std::filesystem::path &path) {
+        fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error{"Could not open " + path.string() + ": " + std::string(strerror(errno))};
+    }
+    ~DirFd() { close(fd); }
+    int fd;
+};
+} // anonymous namespace
+
+bool Btrfs::isBtrfs(const std::filesystem::path &path) {
+    struct statfs sfs;
+    if (statfs(path.c_str(), &sfs) != 0)
+        throw std::runtime_error{"Could not stat file system of " + path.string() + ": " + std::string(strerror(errno))};
+    return sfs.f_type == BTRFS_SUPER_MAGIC;
+}
+
+uint64_t Btrfs::getGeneration(const std::filesystem::path &path) {
+    DirFd dir{path};
+    struct btrfs_ioctl_get_subvol_info_args args = {};
+    if (ioctl(dir.fd, BTRFS_IOC_GET_SUBVOL_INFO, &args) < 0)
+        throw std::runtime_error{"Could not read subvolume information of " + path.string() + ": " + std::string(strerror(errno))};
+    return args.generation;
+}
+
+uint64_t Btrfs::getCreationGeneration(const std::filesystem::path &path) {
+    DirFd dir{path};
+    struct btrfs_ioctl_get_subvol_info_args args = {};
+    if (ioctl(dir.fd, BTRFS_IOC_GET_SUBVOL_INFO, &args) < 0)
+        throw std::runtime_error{"Could not read subvolume information of " + path.string() + ": " + std::string(strerror(errno))};
+    return args.otransid;
+}
+
+uint64_t Btrfs::getSubvolumeId(const std::filesystem::path &path) {
+    DirFd dir{path};
+    struct btrfs_ioctl_ino_lookup_args args = {};
+    args.treeid = 0;
+    args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+    if (ioctl(dir.fd, BTRFS_IOC_INO_LOOKUP, &args) < 0)
+        throw std::runtime_error{"Could not determine subvolume id of " + path.string() + ": " + std::string(strerror(errno))};
+    return args.treeid;
+}
+
+bool Btrfs::isReadOnly(const std::filesystem::path &path) {
+    DirFd dir{path};
+    uint64_t flags;
+    if (ioctl(dir.fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0)
+        throw std::runtime_error{"Could not read subvolume flags of " + path.string() + ": " + std::string(strerror(errno))};
+    return flags & BTRFS_SUBVOL_RDONLY;
+}
+
+void Btrfs::setReadOnly(const std::filesystem::path &path, bool readonly) {
+    DirFd dir{path};
+    uint64_t flags;
+    if (ioctl(dir.fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0)
+        throw std::runtime_error{"Could not read subvolume flags of " + path.string() + ": " + std::string(strerror(errno))};
+    uint64_t newFlags = readonly ? flags | BTRFS_SUBVOL_RDONLY : flags & ~BTRFS_SUBVOL_RDONLY;
+    if (newFlags == flags)
+        return;
+    if (ioctl(dir.fd, BTRFS_IOC_SUBVOL_SETFLAGS, &newFlags) < 0)
+        throw std::runtime_error{"Could not set subvolume " + path.string() + (readonly ? " read-only: " : " read-write: ") + std::string(strerror(errno))};
+}
+
+void Btrfs::clearReceivedUuid(const std::filesystem::path &path) {
+    DirFd dir{path};
+    struct btrfs_ioctl_received_subvol_args args = {};
+    if (ioctl(dir.fd, BTRFS_IOC_SET_RECEIVED_SUBVOL, &args) < 0)
+        throw std::runtime_error{"Could not clear the received UUID of " + path.string() + ": " + std::string(strerror(errno))};
+}
+
+void Btrfs::setDefault(const std::filesystem::path &path) {
+    uint64_t id = getSubvolumeId(path);
+    DirFd dir{path};
+    if (ioctl(dir.fd, BTRFS_IOC_DEFAULT_SUBVOL, &id) < 0)
+        throw std::runtime_error{"Could not set subvolume " + std::to_string(id) + " (" + path.string() + ") as default: " + std::string(strerror(errno))};
+}
+
+void Btrfs::createSnapshot(const std::filesystem::path &source, const std::filesystem::path &target, bool readonly) {
+    std::string name = target.filename();
+    struct btrfs_ioctl_vol_args_v2 args = {};
+    if (name.empty() || name.size() >= sizeof(args.name))
+        throw std::invalid_argument{"Invalid snapshot name '" + target.string() + "'."};
+    DirFd src{source};
+    DirFd dst{target.parent_path()};
+    args.fd = src.fd;
+    if (readonly)
+        args.flags = BTRFS_SUBVOL_RDONLY;
+    strncpy(args.name, name.c_str(), sizeof(args.name) - 1);
+    if (ioctl(dst.fd, BTRFS_IOC_SNAP_CREATE_V2, &args) < 0)
+        throw std::runtime_error{"Could not create snapshot " + target.string() + " of " + source.string() + ": " + std::string(strerror(errno))};
+}
+
+void Btrfs::deleteSubvolume(const std::filesystem::path &path) {
+    std::string name = path.filename();
+    struct btrfs_ioctl_vol_args args = {};
+    if (name.empty() || name.size() >= sizeof(args.name))
+        throw std::invalid_argument{"Invalid subvolume name '" + path.string() + "'."};
+    // Read-only subvolumes can only be deleted by root if they are writable again
+    if (isReadOnly(path))
+        setReadOnly(path, false);
+    DirFd parent{path.parent_path()};
+    strncpy(args.name, name.c_str(), sizeof(args.name) - 1);
+    if (ioctl(parent.fd, BTRFS_IOC_SNAP_DESTROY, &args) < 0)
+        throw std::runtime_error{"Could not delete subvolume " + path.string() + ": " + std::string(strerror(errno))};
+}
+
+void Btrfs::sync(const std::filesystem::path &path) {
+    DirFd dir{path};
+    if (ioctl(dir.fd, BTRFS_IOC_SYNC, nullptr) < 0)
+        throw std::runtime_error{"Could not commit file system of " + path.string() + ": " + std::string(strerror(errno))};
+}
+
+std::vector<std::filesystem::path> Btrfs::findChanged(const std::filesystem::path &path, uint64_t generation) {
+    DirFd dir{path};
+    std::vector<uint64_t> inodes;
+    struct btrfs_ioctl_search_args args = {};
+    struct btrfs_ioctl_search_key &key = args.key;
+    key.tree_id = 0; // subvolume of the descriptor
+    key.min_objectid = BTRFS_FIRST_FREE_OBJECTID + 1; // the subvolume's root directory itself is skipped
+    key.max_objectid = BTRFS_LAST_FREE_OBJECTID;
+    key.min_type = BTRFS_INODE_ITEM_KEY;
+    key.max_type = BTRFS_INODE_ITEM_KEY;
+    key.max_offset = UINT64_MAX;
+    key.min_transid = generation + 1;
+    key.max_transid = UINT64_MAX;
+    while (true) {
+        key.nr_items = 4096;
+        if (ioctl(dir.fd, BTRFS_IOC_TREE_SEARCH, &args) < 0)
+            throw std::runtime_error{"Could not search subvolume of " + path.string() + ": " + std::string(strerror(errno))};
+        if (key.nr_items == 0)
+            break;
+        // The key range is a range of (objectid, type, offset) tuples, so items of other
+        // types are returned as well
+        size_t pos = 0;
+        struct btrfs_ioctl_search_header header;
+        for (uint32_t i = 0; i < key.nr_items; i++) {
+            memcpy(&header, args.buf + pos, sizeof(header));
+            pos += sizeof(header);
+            if (header.type == BTRFS_INODE_ITEM_KEY) {
+                struct btrfs_inode_item item;
+                memcpy(&item, args.buf + pos, sizeof(item));
+                // Tree blocks are written as a whole; the inode's own transid tells whether it was modified
+                if (le64toh(item.transid) > generation)
+                    inodes.push_back(header.objectid);
+            }
+            pos += header.len;
+        }
+        key.min_objectid = header.objectid;
+        key.min_type = header.type;
+        key.min_offset = header.offset;
+        if (key.min_offset < UINT64_MAX) {
+            key.min_offset++;
+        } else if (key.min_type < UINT8_MAX) {
+            key.min_type++;
+            key.min_offset = 0;
+        } else if (key.min_objectid < BTRFS_LAST_FREE_OBJECTID) {
+            key.min_objectid++;
+            key.min_type = 0;
+            key.min_offset = 0;
+        } else {
+            break;
+        }
+    }
+
+    std::vector<std::filesystem::path> paths;
+    for (uint64_t inode: inodes) {
+        struct btrfs_ioctl_ino_lookup_args lookup = {};
+        lookup.treeid = 0;
+        lookup.objectid = inode;
+        if (ioctl(dir.fd, BTRFS_IOC_INO_LOOKUP, &lookup) < 0) {
+            // Deleted after the search
+            if (errno == ENOENT)
+                continue;
+            throw std::runtime_error{"Could not resolve inode " + std::to_string(inode) + " of " + path.string() + ": " + std::string(strerror(errno))};
+        }
+        // The kernel terminates each path component with a slash
+        std::string name = lookup.name;
+        if (!name.empty() && name.back() == '/')
+            name.pop_back();
+        paths.push_back(name);
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Helper functions for direct btrfs ioctl access
+ */
+
+#ifndef T_U_BTRFS_H
+#define T_U_BTRFS_H
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+struct Btrfs {
+    static bool isBtrfs(const std::filesystem::path &path);
+    static uint64_t getGeneration(const std::filesystem::path &path);
+    // Generation of the file system in which the subvolume (or snapshot) was created
+    static uint64_t getCreationGeneration(const std::filesystem::path &path);
+    static uint64_t getSubvolumeId(const std::filesystem::path &path);
+    static bool isReadOnly(const std::filesystem::path &path);
+    static void setReadOnly(const std::filesystem::path &path, bool readonly);
+    // Remove the received UUID of a writable subvolume created by `btrfs receive`, so it
+    // isn't mistaken for an unmodified copy of the sent subvolume any more
+    static void clearReceivedUuid(const std::filesystem::path &path);
+    // Set the subvolume containing path as default subvolume of its file system
+    static void setDefault(const std::filesystem::path &path);
+    // Create a snapshot of the subvolume source as target, whose parent directory must exist
+    static void createSnapshot(const std::filesystem::path &source, const std::filesystem::path &target, bool readonly = false);
+    static void deleteSubvolume(const std::filesystem::path &path);
+    // Write out all delayed allocations and commit the file system's current transaction
+    static void sync(const std::filesystem::path &path);
+    // Paths (relative to the subvolume's root) of all inodes of the subvolume containing path
+    // which were modified after the given generation, similar to `btrfs subvolume find-new`;
+    // only the tree blocks written since then are read. Pending changes have to be committed
+    // before. Deleted entries are only visible as a modification of their parent directory.
+    static std::vector<std::filesystem::path> findChanged(const std::filesystem::path &path, uint64_t generation);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_BTRFS_H
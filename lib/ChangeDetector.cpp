@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Factory / interface class for detecting changes in the snapshot's root file
+  system; implementations can be found in the "ChangeDetector" directory
+ */
+
+#include "ChangeDetector.hpp"
+#include "ChangeDetector/BtrfsGeneration.hpp"
+#include "ChangeDetector/Fanotify.hpp"
+#include "ChangeDetector/Inotify.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include <vector>
+using namespace std;
+
+namespace TransactionalUpdate {
+
+unique_ptr<ChangeDetector> ChangeDetectorFactory::get(filesystem::path root) {
+    string backend = config.get("CHANGE_DETECTOR");
+
+    vector<unique_ptr<ChangeDetector>> candidates;
+    if (backend == "auto" || backend == "fanotify")
+        candidates.push_back(make_unique<FanotifyDetector>(root));
+    if (backend == "auto" || backend == "btrfs")
+        candidates.push_back(make_unique<BtrfsDetector>(root));
+    if (backend == "auto" || backend == "inotify")
+        candidates.push_back(make_unique<InotifyDetector>(root));
+    if (candidates.empty())
+        throw invalid_argument{"Unknown change detector '" + backend + "'."};
+
+    // Only fall back to the next mechanism in auto mode; an explicitly configured backend
+    // should fail loudly instead of silently degrading
+    for (auto it = candidates.begin(); it != candidates.end(); ++it) {
+        try {
+            (*it)->start();
+            tulog.debug("Using ", (*it)->getName(), " for change detection.");
+            return std::move(*it);
+        } catch (const exception &e) {
+            if (backend != "auto")
+                throw;
+            tulog.debug("Change detection via ", (*it)->getName(), " not available: ", e.what());
+        }
+    }
+    throw runtime_error{"No change detection mechanism available."};
+}
+
+} // namespace TransactionalUpdate
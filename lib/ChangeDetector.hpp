@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Factory / interface class for detecting changes in the snapshot's root file
+  system; implementations can be found in the "ChangeDetector" directory
+ */
+
+#ifndef T_U_CHANGEDETECTOR_H
+#define T_U_CHANGEDETECTOR_H
+
+#include <filesystem>
+#include <memory>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class ChangeDetector {
+public:
+    ChangeDetector(std::filesystem::path root): root{root} {};
+    virtual ~ChangeDetector() = default;
+    virtual std::string getName() = 0;
+    // Start listening for changes; throws if the mechanism is not available
+    virtual void start() = 0;
+    // True if changes have been detected (or cannot be ruled out) since start()
+    virtual bool hasChanged() = 0;
+    // Descriptor becoming readable when events are pending (hasChanged() will
+    // process them without blocking), -1 if the mechanism can't be polled
+    virtual int getFd() { return -1; };
+protected:
+    std::filesystem::path root;
+};
+
+class ChangeDetectorFactory {
+public:
+    static std::unique_ptr<ChangeDetector> get(std::filesystem::path root);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_CHANGEDETECTOR_H
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  btrfs backend for change detection; compares the generation of the
+  snapshot's subvolume before and after running commands
+ */
+
+#include "BtrfsGeneration.hpp"
+#include "Btrfs.hpp"
+#include "Log.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+// The subvolume's generation is only updated when the btrfs transaction is committed, so
+// pending changes have to be written out before the value is meaningful.
+// Note that atime updates will be detected as changes, too.
+uint64_t BtrfsDetector::commitAndGetGeneration() {
+    int fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        throw std::runtime_error{"Could not open " + root.string() + ": " + std::string(strerror(errno))};
+    int ret = syncfs(fd);
+    int err = errno;
+    close(fd);
+    if (ret != 0)
+        throw std::runtime_error{"Could not sync file system of " + root.string() + ": " + std::string(strerror(err))};
+    return Btrfs::getGeneration(root);
+}
+
+void BtrfsDetector::start() {
+    if (!Btrfs::isBtrfs(root))
+        throw std::runtime_error{"Root file system is not a btrfs file system."};
+    generation = commitAndGetGeneration();
+    tulog.debug("btrfs: Generation of ", root, " is ", generation);
+}
+
+bool BtrfsDetector::hasChanged() {
+    if (!changed) {
+        uint64_t current = commitAndGetGeneration();
+        tulog.debug("btrfs: Generation of ", root, " is ", current, " (was ", generation, ")");
+        changed = current != generation;
+    }
+    return changed;
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  btrfs backend for change detection; compares the generation of the
+  snapshot's subvolume before and after running commands
+ */
+
+#ifndef T_U_BTRFSGENERATION_H
+#define T_U_BTRFSGENERATION_H
+
+#include "ChangeDetector.hpp"
+#include <cstdint>
+
+namespace TransactionalUpdate {
+
+class BtrfsDetector: public ChangeDetector {
+public:
+    BtrfsDetector(std::filesystem::path root): ChangeDetector(root) {};
+    std::string getName() override { return "btrfs generation"; };
+    void start() override;
+    bool hasChanged() override;
+private:
+    uint64_t commitAndGetGeneration();
+    uint64_t generation = 0;
+    bool changed = false;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_BTRFSGENERATION_H
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  fanotify backend for change detection; watches the whole file system with a
+  single mark and filters the events by the snapshot's btrfs subvolume
+ */
+
+#include "Fanotify.hpp"
+#include "Btrfs.hpp"
+#include "Log.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+// btrfs file handles start with the inode's objectid, followed by the id of the subvolume
+// (FILEID_BTRFS_WITHOUT_PARENT, FILEID_BTRFS_WITH_PARENT and FILEID_BTRFS_WITH_PARENT_ROOT)
+static const int btrfsHandleTypeMin = 0x4d;
+static const int btrfsHandleTypeMax = 0x4f;
+static const size_t btrfsHandleRootOffset = sizeof(uint64_t);
+
+FanotifyDetector::~FanotifyDetector() {
+    if (fanotifyFd >= 0)
+        close(fanotifyFd);
+}
+
+void FanotifyDetector::start() {
+    // All subvolumes of a btrfs file system share the same superblock, so the subvolume id is
+    // required to tell changes in the snapshot from changes anywhere else
+    if (!Btrfs::isBtrfs(root))
+        throw std::runtime_error{"Root file system is not a btrfs file system."};
+    subvolumeId = Btrfs::getSubvolumeId(root);
+
+    fanotifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_FID | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+    if (fanotifyFd < 0)
+        throw std::runtime_error{"Couldn't initialize fanotify: " + std::string(strerror(errno))};
+    if (fanotify_mark(fanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+            FAN_MODIFY | FAN_ATTRIB | FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MOVE_SELF | FAN_ONDIR,
+            AT_FDCWD, root.c_str()) < 0) {
+        int err = errno;
+        close(fanotifyFd);
+        fanotifyFd = -1;
+        throw std::runtime_error{"Couldn't register fanotify mark for " + root.string() + ": " + std::string(strerror(err))};
+    }
+    tulog.debug("fanotify: Watching subvolume ", subvolumeId, " (", root, ")");
+}
+
+void FanotifyDetector::readEvents() {
+    char buf[8192] __attribute__((aligned(8)));
+    ssize_t len;
+
+    while (!changed && (len = read(fanotifyFd, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *metadata = (struct fanotify_event_metadata *)buf;
+        for (; FAN_EVENT_OK(metadata, len); metadata = FAN_EVENT_NEXT(metadata, len)) {
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                tulog.info("WARNING: fanotify event queue overflowed; the snapshot will be treated as changed.");
+                changed = true;
+                break;
+            }
+            if (metadata->event_len < metadata->metadata_len + sizeof(struct fanotify_event_info_fid))
+                continue;
+            struct fanotify_event_info_fid *fid = (struct fanotify_event_info_fid *)(metadata + 1);
+            struct file_handle *handle = (struct file_handle *)fid->handle;
+            if (handle->handle_type < btrfsHandleTypeMin || handle->handle_type > btrfsHandleTypeMax
+                    || handle->handle_bytes < btrfsHandleRootOffset + sizeof(uint64_t))
+                continue;
+            uint64_t eventSubvolume;
+            memcpy(&eventSubvolume, handle->f_handle + btrfsHandleRootOffset, sizeof(eventSubvolume));
+            if (eventSubvolume == subvolumeId) {
+                tulog.debug("fanotify: Change detected in snapshot (event mask ", metadata->mask, ")");
+                changed = true;
+                break;
+            }
+        }
+    }
+    if (!changed && len < 0 && errno != EAGAIN)
+        throw std::runtime_error{"Reading from fanotify fd failed: " + std::string(strerror(errno))};
+
+    // Stop receiving events for the whole file system as soon as the result is known
+    if (changed) {
+        close(fanotifyFd);
+        fanotifyFd = -1;
+    }
+}
+
+bool FanotifyDetector::hasChanged() {
+    // Events are queued synchronously, so there's no need to wait for late events here
+    if (!changed && fanotifyFd >= 0)
+        readEvents();
+    return changed;
+}
+
+} // namespace TransactionalUpdate
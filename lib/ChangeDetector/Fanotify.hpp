@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  fanotify backend for change detection; watches the whole file system with a
+  single mark and filters the events by the snapshot's btrfs subvolume
+ */
+
+#ifndef T_U_FANOTIFY_H
+#define T_U_FANOTIFY_H
+
+#include "ChangeDetector.hpp"
+#include <cstdint>
+
+namespace TransactionalUpdate {
+
+class FanotifyDetector: public ChangeDetector {
+public:
+    FanotifyDetector(std::filesystem::path root): ChangeDetector(root) {};
+    ~FanotifyDetector();
+    std::string getName() override { return "fanotify"; };
+    void start() override;
+    bool hasChanged() override;
+    int getFd() override { return fanotifyFd; };
+private:
+    void readEvents();
+    int fanotifyFd = -1;
+    uint64_t subvolumeId = 0;
+    bool changed = false;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_FANOTIFY_H
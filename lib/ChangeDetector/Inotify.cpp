@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  inotify backend for change detection; requires one watch per directory, so
+  it's only used if no other mechanism is available
+ */
+
+#include "Inotify.hpp"
+#include "Log.hpp"
+#include "Mount.hpp"
+#include <cerrno>
+#include <cstring>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+// nftw doesn't support passing user data to the callback function
+static int inotifyFd;
+static bool inotifyIncomplete;
+static std::vector<std::filesystem::path> inotifyExcludes;
+
+InotifyDetector::~InotifyDetector() {
+    if (inotifyFd > 0) {
+        close(inotifyFd);
+        inotifyFd = 0;
+    }
+}
+
+// Callback function for nftw to register all directories for inotify
+int InotifyDetector::inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb) {
+    if (!(type == FTW_D))
+        return 0;
+    std::vector<std::filesystem::path>::iterator it;
+    for (it = inotifyExcludes.begin(); it != inotifyExcludes.end(); it++) {
+        if (std::string(pathname).find(*it) == 0)
+            return 0;
+    }
+    int num;
+    if ((num = inotify_add_watch(inotifyFd, pathname, IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_ATTRIB | IN_ONESHOT | IN_ONLYDIR | IN_DONT_FOLLOW)) == -1) {
+        tulog.info("WARNING: Cannot register inotify watch for ", pathname, ": ", std::string(strerror(errno)));
+        inotifyIncomplete = true;
+        // Once the watch limit has been reached all further registrations will fail, too
+        if (errno == ENOSPC)
+            return 1;
+    } else {
+        tulog.debug("Watching ", pathname, " with descriptor number ", num);
+    }
+    return 0;
+}
+
+void InotifyDetector::start() {
+    if (inotifyFd > 0)
+        throw std::logic_error{"Only one inotify change detector may be active at a time."};
+    inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotifyFd == -1) {
+        inotifyFd = 0;
+        throw std::runtime_error{"Couldn't initialize inotify: " + std::string(strerror(errno))};
+    }
+
+    // Recursively register all directories of the root file system
+    inotifyIncomplete = false;
+    inotifyExcludes = MountList::getList(root);
+    nftw(root.c_str(), inotifyAdd, 20, FTW_MOUNT | FTW_PHYS);
+    if (inotifyIncomplete)
+        tulog.info("WARNING: Not all directories could be watched; the snapshot will be treated as changed.");
+}
+
+// Events are queued synchronously, so there's no need to wait for late events
+int InotifyDetector::inotifyRead() {
+    size_t bufLen = sizeof(struct inotify_event) + NAME_MAX + 1;
+    char buf[bufLen] __attribute__((aligned(8)));
+    ssize_t numRead;
+
+    numRead = read(inotifyFd, buf, bufLen);
+    if (numRead == 0)
+        throw std::runtime_error{"Read() from inotify fd returned 0!"};
+    if (numRead == -1) {
+        if (errno == EAGAIN)
+            return 0;
+        throw std::runtime_error{"Reading from inotify fd failed: " + std::string(strerror(errno))};
+    }
+    tulog.debug("inotify: Exiting after event on descriptor number ", ((struct inotify_event *)buf)->wd, " in ", ((struct inotify_event *)buf)->name);
+    return 1;
+}
+
+int InotifyDetector::getFd() {
+    return inotifyFd > 0 ? inotifyFd : -1;
+}
+
+bool InotifyDetector::hasChanged() {
+    // Missing watches may have hidden changes, so don't risk discarding the snapshot
+    if (inotifyIncomplete)
+        return true;
+    if (!changed)
+        changed = inotifyRead() > 0;
+    return changed;
+}
+
+} // namespace TransactionalUpdate
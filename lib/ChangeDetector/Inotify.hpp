@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  inotify backend for change detection; requires one watch per directory, so
+  it's only used if no other mechanism is available
+ */
+
+#ifndef T_U_INOTIFY_H
+#define T_U_INOTIFY_H
+
+#include "ChangeDetector.hpp"
+#include <sys/stat.h>
+#include <ftw.h>
+
+namespace TransactionalUpdate {
+
+class InotifyDetector: public ChangeDetector {
+public:
+    InotifyDetector(std::filesystem::path root): ChangeDetector(root) {};
+    ~InotifyDetector();
+    std::string getName() override { return "inotify"; };
+    void start() override;
+    bool hasChanged() override;
+    int getFd() override;
+private:
+    static int inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb);
+    int inotifyRead();
+    bool changed = false;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_INOTIFY_H
@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Removal of leftovers: aborted transactions, superseded snapshots and /etc
+  overlay directories which aren't used by any snapshot any more
+ */
+
+#include "Cleanup.hpp"
+#include "Configuration.hpp"
+#include "Lock.hpp"
+#include "Log.hpp"
+#include "Mount.hpp"
+#include "Overlay.hpp"
+#include "Spare.hpp"
+#include "Stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace TransactionalUpdate {
+
+namespace {
+// Maintained by the transactional-update script
+const fs::path stateFile = "/var/lib/misc/transactional-update.state";
+
+bool isSnapshotId(const std::string &name) {
+    return !name.empty() && name.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// Snapshots which were the running system when a newer snapshot was set as the
+// default (LAST_WORKING_SNAPSHOTS of the state file); unknown variables are kept
+std::vector<std::string> readStateFile(std::vector<std::pair<std::string, std::string>> &variables) {
+    std::vector<std::string> ids;
+    std::ifstream input(stateFile);
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t pos = line.find('=');
+        if (pos == std::string::npos)
+            continue;
+        std::string value = line.substr(pos + 1);
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+            value = value.substr(1, value.size() - 2);
+        variables.push_back({line.substr(0, pos), value});
+        if (variables.back().first != "LAST_WORKING_SNAPSHOTS")
+            continue;
+        std::istringstream list{value};
+        for (std::string id; list >> id;) {
+            if (isSnapshotId(id))
+                ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+void writeStateFile(const std::vector<std::pair<std::string, std::string>> &variables) {
+    fs::path tmp = stateFile.string() + ".tukit";
+    std::ofstream output(tmp, std::ios::trunc);
+    for (auto &[name, value] : variables) {
+        output << name << "=\"" << value << "\"\n";
+    }
+    output.close();
+    if (!output)
+        throw std::runtime_error{"Writing " + tmp.string() + " failed."};
+    fs::rename(tmp, stateFile);
+}
+
+// Only snapshots whose transaction was never kept still have the flag file written by
+// Transaction::init(); without a session or mount plan nobody can be working on them
+// any more. Transactions of older versions don't have the flag at all, they can't be
+// told apart from kept ones.
+bool isAbandoned(Snapshot &snapshot) {
+    fs::path session = fs::path{config.get("SESSION_DIR")} / snapshot.getUid();
+    return fs::exists(snapshot.getRoot() / "transactionIncomplete")
+            && !fs::exists(session) && !fs::exists(session.string() + ".mounts");
+}
+
+bool isReferenced(const fs::path &dir, const std::set<fs::path> &referenced) {
+    for (auto &path : referenced) {
+        auto mismatch = std::mismatch(dir.begin(), dir.end(), path.begin(), path.end());
+        if (mismatch.first == dir.end())
+            return true;
+    }
+    return false;
+}
+
+// Deleting is dominated by waiting for metadata I/O, so remove several directories at once
+void removeParallel(const std::vector<fs::path> &dirs) {
+    unsigned int workers = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), dirs.size());
+    std::atomic<size_t> next{0};
+    std::mutex errorsMutex;
+    std::vector<std::string> errors;
+    std::vector<std::future<void>> futures;
+    for (unsigned int i = 0; i < workers; i++) {
+        futures.push_back(std::async(std::launch::async, [&]() {
+            for (size_t n; (n = next++) < dirs.size();) {
+                try {
+                    fs::remove_all(dirs[n]);
+                } catch (const std::exception &e) {
+                    std::lock_guard<std::mutex> lock{errorsMutex};
+                    errors.push_back(e.what());
+                }
+            }
+        }));
+    }
+    for (auto &future : futures) {
+        future.get();
+    }
+    for (auto &error : errors) {
+        tulog.error("Error removing overlay: ", error);
+    }
+    if (!errors.empty())
+        throw std::runtime_error{"Removing " + std::to_string(errors.size()) + " overlay directories failed."};
+}
+} // anonymous namespace
+
+void Cleanup::snapshots(SnapshotManager &mgr) {
+    // The default snapshot must not change while deciding what to keep
+    Lock defaultLock{Lock::getGlobal(), Lock::Mode::Shared};
+    std::string current = mgr.getCurrent();
+    std::string defaultSnap = mgr.getDefault();
+
+    std::vector<std::pair<std::string, std::string>> variables;
+    std::vector<std::string> lastWorking = readStateFile(variables);
+    std::vector<std::string> keptWorking;
+
+    std::vector<std::string> aborted;
+    std::vector<std::string> superseded;
+    std::vector<std::string> unused;
+    // Held until the snapshots are deleted, so no other instance can resume them meanwhile
+    std::vector<std::unique_ptr<Lock>> locks;
+    SnapshotIndex snapshots = mgr.list();
+    for (auto &[id, info] : snapshots) {
+        if (id == current || id == defaultSnap || !info.inProgress)
+            continue;
+        std::unique_ptr<Snapshot> snapshot = mgr.open(id);
+        if (Spare::isSpare(*snapshot))
+            continue;
+        std::unique_ptr<Lock> lock;
+        try {
+            lock = std::make_unique<Lock>(Lock::getSnapshot(id), Lock::Mode::Exclusive, false);
+        } catch (const std::runtime_error &e) {
+            tulog.debug("Keeping snapshot ", id, ": ", e.what());
+            continue;
+        }
+        if (isAbandoned(*snapshot)) {
+            aborted.push_back(id);
+            locks.push_back(std::move(lock));
+        } else if (info.cleanup.empty()) {
+            unused.push_back(id);
+        }
+    }
+    for (auto &id : lastWorking) {
+        if (id == current || id == defaultSnap)
+            keptWorking.push_back(id);
+        else if (snapshots.count(id) && snapshots[id].cleanup.empty())
+            superseded.push_back(id);
+    }
+
+    if (!unused.empty()) {
+        tulog.info("Marking ", unused.size(), " unused transactions for cleanup.");
+        mgr.modify(unused, "number", {});
+    }
+    if (!superseded.empty()) {
+        // Snapshots of a read-only root are the only way back, so keep them a little longer
+        std::map<std::string, std::string> userdata;
+        if (mgr.open(current)->isReadOnly())
+            userdata["important"] = "yes";
+        tulog.info("Marking ", superseded.size(), " superseded snapshots for cleanup.");
+        mgr.modify(superseded, "number", userdata);
+    }
+    if (keptWorking.size() != lastWorking.size()) {
+        for (auto &[name, value] : variables) {
+            if (name != "LAST_WORKING_SNAPSHOTS")
+                continue;
+            value.clear();
+            for (auto &id : keptWorking)
+                value += (value.empty() ? "" : " ") + id;
+        }
+        writeStateFile(variables);
+    }
+    if (!aborted.empty()) {
+        tulog.info("Deleting ", aborted.size(), " aborted transactions.");
+        mgr.remove(aborted);
+        for (auto &lock : locks) {
+            lock->removeOnRelease();
+        }
+    }
+    tustats.count("snapshots_deleted", aborted.size());
+}
+
+void Cleanup::overlays(SnapshotManager &mgr) {
+    fs::path overlayDir = config.get("OVERLAY_DIR");
+    Mount mntEtc{"/etc"};
+    if (!fs::is_directory(overlayDir) || !mntEtc.isMount() || mntEtc.getFilesystem() != "overlay")
+        return;
+
+    // The keep set has to be complete: if any snapshot's layers can't be
+    // determined the Overlay constructor throws and nothing is deleted
+    SnapshotIndex snapshots = mgr.list();
+    std::set<fs::path> referenced;
+    for (auto &[id, info] : snapshots) {
+        // e.g. snapper's pseudo snapshot 0 for the current system
+        try {
+            mgr.open(id);
+        } catch (const std::invalid_argument &e) {
+            continue;
+        }
+        Overlay overlay{id};
+        referenced.insert(overlay.upperdir.lexically_normal());
+        for (auto &lowerdir : overlay.lowerdirs) {
+            referenced.insert(lowerdir.lexically_normal());
+        }
+    }
+
+    std::vector<fs::path> unused;
+    std::vector<std::unique_ptr<Lock>> locks;
+    for (auto &entry : fs::directory_iterator(overlayDir)) {
+        std::string name = entry.path().filename();
+        if (!isSnapshotId(name) || !entry.is_directory())
+            continue;
+        if (snapshots.count(name)) {
+            // Merged layers of stack compaction are only used by later snapshots; a
+            // transaction in progress may just be creating them and not reference them yet
+            if (snapshots[name].inProgress)
+                continue;
+            for (auto &layer : fs::directory_iterator(entry.path())) {
+                if (layer.path().filename().string().compare(0, 8, "compact-") == 0
+                        && !isReferenced(layer.path().lexically_normal(), referenced))
+                    unused.push_back(layer.path());
+            }
+            continue;
+        }
+        if (isReferenced(entry.path().lexically_normal(), referenced))
+            continue;
+        // A transaction may just be creating the snapshot and its overlay
+        try {
+            locks.push_back(std::make_unique<Lock>(Lock::getSnapshot(name), Lock::Mode::Exclusive, false));
+        } catch (const std::runtime_error &e) {
+            continue;
+        }
+        try {
+            mgr.open(name);
+            locks.pop_back();
+            continue;
+        } catch (const std::invalid_argument &e) {}
+        unused.push_back(entry.path());
+    }
+    if (unused.empty())
+        return;
+
+    tulog.info("Deleting ", unused.size(), " unused overlay directories.");
+    for (auto &dir : unused) {
+        tulog.debug("Deleting unused overlay ", dir);
+    }
+    removeParallel(unused);
+    for (auto &lock : locks) {
+        lock->removeOnRelease();
+    }
+    tustats.count("overlays_deleted", unused.size());
+}
+
+} // namespace TransactionalUpdate
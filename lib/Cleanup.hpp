@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Removal of leftovers: aborted transactions, superseded snapshots and /etc
+  overlay directories which aren't used by any snapshot any more
+ */
+
+#ifndef T_U_CLEANUP_H
+#define T_U_CLEANUP_H
+
+#include "SnapshotManager.hpp"
+
+namespace TransactionalUpdate {
+
+struct Cleanup {
+    // Delete abandoned transactions and hand other unused transactions and the superseded
+    // snapshots of the transactional-update state file over to snapper's "number" cleanup
+    // algorithm; the current and the default snapshot are always kept
+    static void snapshots(SnapshotManager &mgr);
+    // Delete overlay directories in OVERLAY_DIR not referenced by any snapshot
+    static void overlays(SnapshotManager &mgr);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_CLEANUP_H
@@ -21,9 +21,23 @@ Configuration::Configuration() {
     if (error)
         throw std::runtime_error{"Could not create default configuration."};
     std::map<const char*, const char*> defaults = {
+        {"CHANGE_DETECTOR", "auto"},
+        {"COMMAND_TIMEOUT", "0"},
         {"DRACUT_SYSROOT", "/sysroot"},
+        {"FLUSH_MODE", "syncfs"},
+        {"LOCKDIR", "/var/run/tukit/locks"},
         {"LOCKFILE", "/var/run/tukit.lock"},
-        {"OVERLAY_DIR", "/var/lib/overlay"}
+        {"METRICS_FILE", ""},
+        {"OVERLAY_DIR", "/var/lib/overlay"},
+        {"OVERLAY_MAX_DEPTH", "10"},
+        {"PIPELINED_INIT", "no"},
+        {"PREFETCH_COMMAND", ""},
+        {"SESSION_DIR", "/var/run/tukit/sessions"},
+        {"SNAPSHOT_MANAGER", "auto"},
+        {"SPARE_SNAPSHOT", "no"},
+        {"SUBVOLUME_DIR", "/var/lib/tukit/snapshots"},
+        {"TUKITD_MAX_QUEUED", "64"},
+        {"TUKITD_MAX_WORKERS", "4"}
     };
     for(auto &[key, value] : defaults) {
         error = econf_setStringValue(kf_defaults, "", key, value);
@@ -66,6 +80,12 @@ std::string Configuration::get(const std::string &key) {
     return std::string(val);
 }
 
+void Configuration::set(const std::string &key, const std::string &value) {
+    econf_err error = econf_setStringValue(key_file, "", key.c_str(), value.c_str());
+    if (error)
+        throw std::runtime_error{"Could not set configuration setting '" + key + "': " + std::string(econf_errString(error))};
+}
+
 std::vector<std::string> Configuration::getArray(const std::string &key) {
     std::vector<std::string> ret;
     econf_err error;
@@ -24,6 +24,8 @@ public:
     void operator=(const Configuration&) = delete;
     std::string get(const std::string &key);
     std::vector<std::string> getArray(const std::string &key);
+    // Override a setting for this process only, e.g. for test environments
+    void set(const std::string &key, const std::string &value);
 private:
     econf_file *key_file;
 };
@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Transfer of finished transactions to other systems: a btrfs send stream of
+  the snapshot (optionally incremental to a parent snapshot present on the
+  target system), followed by a tar archive of its /etc overlay layer
+ */
+
+#include "Export.hpp"
+#include "Btrfs.hpp"
+#include "Configuration.hpp"
+#include "Lock.hpp"
+#include "Log.hpp"
+#include "Stats.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdexcept>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace TransactionalUpdate {
+
+namespace {
+const std::string magic = "tukit-export 1\n";
+const size_t chunkSize = 1024 * 1024;
+
+void writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = ::write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error{"Writing export stream failed: " + std::string(strerror(errno))};
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+void writeSection(int fd, const std::string &name, const char* data, size_t len) {
+    std::string header = name + " " + std::to_string(len) + "\n";
+    writeAll(fd, header.data(), header.size());
+    writeAll(fd, data, len);
+}
+
+// Copy the output of a helper into sections of the given name
+void pumpSection(int fd, const std::string &name, int in) {
+    std::string buf(chunkSize, '\0');
+    ssize_t len;
+    while ((len = read(in, buf.data(), buf.size())) != 0) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error{"Reading " + name + " data failed: " + std::string(strerror(errno))};
+        }
+        writeSection(fd, name, buf.data(), len);
+        tustats.count("export_bytes", len);
+    }
+}
+
+void pumpHelper(int fd, const std::string &name, const std::vector<std::string> &args) {
+    int out;
+    pid_t pid = Export::start(args, out, false);
+    try {
+        pumpSection(fd, name, out);
+    } catch (const std::exception &e) {
+        close(out);
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+        throw;
+    }
+    close(out);
+    Export::finish(pid, args[0] + " " + args[1]);
+}
+
+// btrfs send only accepts read-only subvolumes; the received subvolume gets the
+// name of the sent one, so the temporary snapshot keeps the name in a separate directory
+struct ReadOnlyCopy {
+    ReadOnlyCopy(const fs::path &root) {
+        if (Btrfs::isReadOnly(root)) {
+            path = root;
+            return;
+        }
+        dir = root.parent_path() / "export";
+        path = dir / root.filename();
+        if (fs::exists(path))
+            Btrfs::deleteSubvolume(path);
+        fs::create_directories(dir);
+        Btrfs::createSnapshot(root, path, true);
+    }
+    ~ReadOnlyCopy() {
+        if (dir.empty())
+            return;
+        try {
+            Btrfs::deleteSubvolume(path);
+            fs::remove(dir);
+        } catch (const std::exception &e) {
+            tulog.error("ERROR: ", e.what());
+        }
+    }
+    fs::path dir;
+    fs::path path;
+};
+} // anonymous namespace
+
+Export::Reader::Reader(int fd): fd{fd} {
+    std::string line = readLine();
+    if (line + "\n" != magic)
+        throw std::invalid_argument{"Input is not a tukit export stream."};
+    readHeader();
+    std::string meta;
+    consume("meta", [&meta](const char* data, size_t len) { meta.append(data, len); });
+    size_t pos = 0;
+    while (pos < meta.size()) {
+        size_t end = meta.find('\n', pos);
+        if (end == std::string::npos)
+            end = meta.size();
+        std::string entry = meta.substr(pos, end - pos);
+        size_t sep = entry.find('=');
+        if (sep != std::string::npos)
+            metadata[entry.substr(0, sep)] = entry.substr(sep + 1);
+        pos = end + 1;
+    }
+}
+
+const std::map<std::string, std::string>& Export::Reader::getMetadata() {
+    return metadata;
+}
+
+const std::string& Export::Reader::peek() {
+    return name;
+}
+
+void Export::Reader::copySection(const std::string &section, int out) {
+    consume(section, [out](const char* data, size_t len) { writeAll(out, data, len); });
+}
+
+// Headers are short, so reading them byte by byte doesn't matter
+std::string Export::Reader::readLine() {
+    std::string line;
+    char c;
+    while (true) {
+        ssize_t len = read(fd, &c, 1);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            throw std::runtime_error{"Reading export stream failed: " + std::string(strerror(errno))};
+        if (len == 0)
+            throw std::runtime_error{"Export stream is truncated."};
+        if (c == '\n')
+            return line;
+        line += c;
+        if (line.size() > 256)
+            throw std::runtime_error{"Export stream is corrupt."};
+    }
+}
+
+void Export::Reader::readHeader() {
+    std::string line = readLine();
+    size_t sep = line.find(' ');
+    if (sep == std::string::npos || sep + 1 >= line.size()
+            || line.find_first_not_of("0123456789", sep + 1) != std::string::npos)
+        throw std::runtime_error{"Export stream is corrupt."};
+    name = line.substr(0, sep);
+    remaining = std::stoull(line.substr(sep + 1));
+}
+
+void Export::Reader::consume(const std::string &section, const std::function<void(const char*, size_t)> &sink) {
+    if (name != section)
+        throw std::runtime_error{"Expected " + section + " data in export stream, got " + name + "."};
+    std::string buf(chunkSize, '\0');
+    while (name == section && name != "end") {
+        while (remaining > 0) {
+            ssize_t len = read(fd, buf.data(), std::min(remaining, buf.size()));
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0)
+                throw std::runtime_error{"Reading export stream failed: " + std::string(strerror(errno))};
+            if (len == 0)
+                throw std::runtime_error{"Export stream is truncated."};
+            sink(buf.data(), len);
+            remaining -= len;
+        }
+        readHeader();
+    }
+}
+
+void Export::write(SnapshotManager &mgr, const std::string &id, const std::string &parent, int fd) {
+    TUStats::Timer timer{"export"};
+    Lock snapshotLock{Lock::getSnapshot(id), Lock::Mode::Shared, false};
+    snapshotLock.removeIfUnused();
+    std::unique_ptr<Snapshot> snapshot = mgr.open(id);
+    if (snapshot->isInProgress())
+        throw std::invalid_argument{"Snapshot " + id + " is still an open transaction."};
+    fs::path root = snapshot->getRoot();
+    std::vector<std::string> args = {"btrfs", "send", "-q"};
+    if (!parent.empty()) {
+        fs::path parentRoot = mgr.open(parent)->getRoot();
+        if (!Btrfs::isReadOnly(parentRoot))
+            throw std::invalid_argument{"Parent snapshot " + parent + " has to be read-only."};
+        args.push_back("-p");
+        args.push_back(parentRoot);
+    }
+    fs::path upper = fs::path{config.get("OVERLAY_DIR")} / id / "etc";
+    bool hasOverlay = fs::is_directory(upper);
+
+    writeAll(fd, magic.data(), magic.size());
+    std::string meta = "id=" + id + "\nparent=" + parent + "\netc=" + (hasOverlay ? "yes" : "no") + "\n";
+    writeSection(fd, "meta", meta.data(), meta.size());
+
+    {
+        ReadOnlyCopy copy{root};
+        args.push_back(copy.path);
+        tulog.info("Exporting snapshot ", id, parent.empty() ? "" : " incrementally to snapshot " + parent, "...");
+        pumpHelper(fd, "send", args);
+    }
+    if (hasOverlay) {
+        pumpHelper(fd, "etc", {"tar", "--create", "--file=-", "--xattrs", "--xattrs-include=*", "--acls",
+                               "--numeric-owner", "--directory", upper, "."});
+    }
+    writeSection(fd, "end", nullptr, 0);
+}
+
+pid_t Export::start(const std::vector<std::string> &args, int &fd, bool toChild) {
+    std::vector<char*> argv;
+    for (auto &arg: args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0)
+        throw std::runtime_error{"Creating pipe for " + args[0] + " failed: " + std::string(strerror(errno))};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (toChild)
+        posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+    else
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+
+    tulog.flush();
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(toChild ? pipefd[0] : pipefd[1]);
+    fd = toChild ? pipefd[1] : pipefd[0];
+    if (rc != 0) {
+        close(fd);
+        throw std::runtime_error{"Executing " + args[0] + " failed: " + std::string(strerror(rc))};
+    }
+    tustats.count("spawns");
+    return pid;
+}
+
+void Export::finish(pid_t pid, const std::string &name) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            throw std::runtime_error{"Waiting for `" + name + "` failed: " + std::string(strerror(errno))};
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error{"`" + name + "` failed."};
+}
+
+} // namespace TransactionalUpdate
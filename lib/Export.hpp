@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Transfer of finished transactions to other systems: a btrfs send stream of
+  the snapshot (optionally incremental to a parent snapshot present on the
+  target system), followed by a tar archive of its /etc overlay layer
+ */
+
+#ifndef T_U_EXPORT_H
+#define T_U_EXPORT_H
+
+#include "SnapshotManager.hpp"
+#include <functional>
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+struct Export {
+    /*
+      The stream starts with a magic line, followed by sections of a header
+      line "<name> <length>\n" and <length> bytes of data each. Consecutive
+      sections of the same name belong together; "end" terminates the stream.
+      Names are "meta" (key=value lines), "send" (btrfs send stream) and "etc"
+      (tar archive of the /etc overlay layer).
+     */
+    class Reader {
+    public:
+        Reader(int fd);
+        const std::map<std::string, std::string>& getMetadata();
+        // Name of the next section, "end" at the end of the stream
+        const std::string& peek();
+        // Copy the data of all consecutive sections with the given name to fd
+        void copySection(const std::string &name, int fd);
+    private:
+        std::string readLine();
+        void readHeader();
+        void consume(const std::string &name, const std::function<void(const char*, size_t)> &sink);
+        int fd;
+        std::string name;
+        size_t remaining = 0;
+        std::map<std::string, std::string> metadata;
+    };
+    // Write the closed transaction id to fd; with a parent the btrfs stream only contains
+    // the differences to the parent snapshot, which has to be read-only and also has to
+    // be available on the importing system
+    static void write(SnapshotManager &mgr, const std::string &id, const std::string &parent, int fd);
+    // Start a helper program with a pipe connected to its stdin (toChild) or its stdout
+    static pid_t start(const std::vector<std::string> &args, int &fd, bool toChild);
+    static void finish(pid_t pid, const std::string &name);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_EXPORT_H
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Advisory file locks synchronizing tukit instances
+ */
+
+#include "Lock.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace TransactionalUpdate {
+
+Lock::Lock(std::filesystem::path file, Mode mode, bool wait)
+    : file{std::move(file)}
+{
+    std::filesystem::create_directories(this->file.parent_path());
+    int operation = (mode == Mode::Shared ? LOCK_SH : LOCK_EX) | (wait ? 0 : LOCK_NB);
+    // Lock files are removed by their last user, so make sure the locked file
+    // is still the one in the file system
+    for (;;) {
+        fd = open(this->file.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+        if (fd < 0)
+            throw std::runtime_error{"Could not create lock file '" + this->file.string() + "': " + strerror(errno)};
+        int ret;
+        while ((ret = flock(fd, operation)) < 0 && errno == EINTR);
+        if (ret < 0) {
+            int err = errno;
+            close(fd);
+            if (err == EWOULDBLOCK)
+                throw std::runtime_error{"Another instance of tukit is already using '" + this->file.string() + "'."};
+            throw std::runtime_error{"Could not lock '" + this->file.string() + "': " + strerror(err)};
+        }
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(this->file.c_str(), &current) == 0
+                && locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+            break;
+        close(fd);
+    }
+    tulog.debug("Locked ", this->file, mode == Mode::Shared ? " (shared)." : ".");
+}
+
+Lock::~Lock() {
+    // Whoever opened the file in the meantime notices the unlink after getting
+    // the lock and retries with a new file, see above
+    if (remove || (removeUnused && flock(fd, LOCK_EX | LOCK_NB) == 0))
+        unlink(file.c_str());
+    close(fd);
+}
+
+void Lock::removeOnRelease() {
+    remove = true;
+}
+
+void Lock::removeIfUnused() {
+    removeUnused = true;
+}
+
+std::filesystem::path Lock::getGlobal() {
+    return config.get("LOCKFILE");
+}
+
+std::filesystem::path Lock::getSnapshot(const std::string &id) {
+    return std::filesystem::path{config.get("LOCKDIR")} / (id + ".lock");
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Advisory file locks synchronizing tukit instances: every snapshot has its own
+  lock file, so independent transactions can run in parallel; only switching
+  the default snapshot needs the global lock exclusively.
+ */
+
+#ifndef T_U_LOCK_H
+#define T_U_LOCK_H
+
+#include <filesystem>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class Lock
+{
+public:
+    enum class Mode { Shared, Exclusive };
+    // Throws if the lock is held by someone else and wait is false
+    Lock(std::filesystem::path file, Mode mode, bool wait = true);
+    ~Lock();
+    Lock(const Lock&) = delete;
+    void operator=(const Lock&) = delete;
+    // Remove the lock file on release, e.g. when the snapshot doesn't exist any more
+    void removeOnRelease();
+    // Remove the lock file on release if nobody else holds it,
+    // for short lived users of snapshots which continue to exist
+    void removeIfUnused();
+    // Lock of the global default snapshot switch (LOCKFILE)
+    static std::filesystem::path getGlobal();
+    // Lock file of the given snapshot (in LOCKDIR)
+    static std::filesystem::path getSnapshot(const std::string &id);
+private:
+    std::filesystem::path file;
+    int fd = -1;
+    bool remove = false;
+    bool removeUnused = false;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_LOCK_H
@@ -0,0 +1,111 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Buffered logging to stdout or the journal
+ */
+
+#include "Log.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <systemd/sd-journal.h>
+#include <unistd.h>
+
+// Number of messages / bytes collected before the buffer is written anyway
+static const size_t maxJournalEntries = 64;
+static const size_t maxBufferSize = 64 * 1024;
+
+TULog::~TULog() {
+    flush();
+}
+
+void TULog::flush() {
+    std::lock_guard<std::mutex> guard{mutex};
+    flushLocked();
+}
+
+void TULog::setPhase(const std::string &phase) {
+    std::lock_guard<std::mutex> guard{mutex};
+    flushLocked();
+    if (phase.empty())
+        fields.erase("TUKIT_PHASE");
+    else
+        fields["TUKIT_PHASE"] = phase;
+}
+
+void TULog::setField(const std::string &name, const std::string &value) {
+    if (value.empty())
+        fields.erase(name);
+    else
+        fields[name] = value;
+}
+
+// Only use the journal if stdout is the stream set up by systemd, i.e. if
+// stdout would end up in the journal anyway
+bool TULog::toJournal() {
+    if (journal < 0) {
+        journal = 0;
+        const char* stream = getenv("JOURNAL_STREAM");
+        unsigned long long dev, ino;
+        struct stat st;
+        if (stream && sscanf(stream, "%llu:%llu", &dev, &ino) == 2 && fstat(STDOUT_FILENO, &st) == 0
+                && st.st_dev == dev && st.st_ino == ino)
+            journal = 1;
+    }
+    return journal == 1;
+}
+
+void TULog::write(TULogLevel lv, std::string message) {
+    std::lock_guard<std::mutex> guard{mutex};
+    if (toJournal()) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        journalEntries.push_back({lv, std::move(message),
+                                  (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, fields});
+        if (journalEntries.size() >= maxJournalEntries)
+            flushLocked();
+        return;
+    }
+
+    // Formatting the time is comparatively expensive, so do it once per second only
+    std::time_t now = std::time(nullptr);
+    if (now != lastTime || timestamp.empty()) {
+        char buf[32];
+        struct tm tm;
+        localtime_r(&now, &tm);
+        strftime(buf, sizeof(buf), "%F %T ", &tm);
+        timestamp = buf;
+        lastTime = now;
+    }
+    buffer.append(timestamp).append(message).append("\n");
+    if (buffer.size() >= maxBufferSize)
+        flushLocked();
+}
+
+void TULog::flushLocked() {
+    for (auto &entry : journalEntries) {
+        const char* priority = entry.level == TULogLevel::Error ? "PRIORITY=3" :
+                               entry.level == TULogLevel::Info ? "PRIORITY=6" : "PRIORITY=7";
+        std::vector<std::string> strings = {"MESSAGE=" + entry.message, priority, "SYSLOG_IDENTIFIER=tukit",
+                                            "TUKIT_TIMESTAMP=" + std::to_string(entry.usec)};
+        for (auto &[name, value] : entry.fields) {
+            strings.push_back(name + "=" + value);
+        }
+        std::vector<struct iovec> iov;
+        for (auto &s : strings) {
+            iov.push_back({const_cast<char*>(s.data()), s.size()});
+        }
+        if (sd_journal_sendv(iov.data(), iov.size()) < 0) {
+            // Don't lose the message if the journal isn't reachable
+            std::cout << entry.message << "\n";
+        }
+    }
+    journalEntries.clear();
+    if (!buffer.empty()) {
+        std::cout << buffer;
+        buffer.clear();
+    }
+    std::cout.flush();
+}
@@ -8,36 +8,82 @@
 #ifndef T_U_LOG_H
 #define T_U_LOG_H
 
-#include <iomanip>
+#include <ctime>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 
 enum class TULogLevel {
     None=0, Error, Info, Debug
 };
 
-// There's no threading in this application, so no locking is implemented
+// Messages are only formatted if their level is enabled and are collected in a
+// buffer, which is written at phase boundaries (setPhase()), before starting
+// other processes (flush()), for errors and whenever it grows too large.
+// If stdout is connected to the journal (see JOURNAL_STREAM in systemd.exec(5))
+// the messages are sent to the journal directly instead, including the fields
+// set with setField(); as the journal's own timestamp is the time of sending,
+// TUKIT_TIMESTAMP holds the time the message was logged (in microseconds since
+// the epoch like __REALTIME_TIMESTAMP).
 class TULog {
 public:
     TULogLevel level = TULogLevel::Error;
 
+    ~TULog();
+
     template<typename... T> void error(const T&... args) {
-        if (level >=TULogLevel::Error)
-            log(args...);
+        if (level >=TULogLevel::Error) {
+            write(TULogLevel::Error, format(args...));
+            flush();
+        }
     }
     template<typename... T> void info(const T&... args) {
         if (level >= TULogLevel::Info)
-            log(args...);
+            write(TULogLevel::Info, format(args...));
     }
     template<typename... T> void debug(const T&... args) {
         if (level >= TULogLevel::Debug)
-            log(args...);
+            write(TULogLevel::Debug, format(args...));
     }
 
     template<typename... T> void log(const T&... args) {
-        std::time_t now = std::time(0);
-        std::cout << std::put_time(std::localtime(&now), "%F %T ");
-        ((std::cout << args),...) << std::endl;
+        write(TULogLevel::Info, format(args...));
+    }
+
+    void flush();
+    // Marks the start of a new phase (e.g. "init", "execute"); writes the buffer
+    void setPhase(const std::string &phase);
+    // Additional journal field (e.g. "TUKIT_SNAPSHOT"), an empty value removes it;
+    // fields and the phase are per thread, as tukitd runs transactions in parallel
+    void setField(const std::string &name, const std::string &value);
+
+private:
+    struct JournalEntry {
+        TULogLevel level;
+        std::string message;
+        unsigned long long usec;
+        std::map<std::string, std::string> fields;
+    };
+
+    template<typename... T> static std::string format(const T&... args) {
+        std::ostringstream line;
+        ((line << args),...);
+        return line.str();
     }
+    void write(TULogLevel lv, std::string message);
+    void flushLocked();
+    bool toJournal();
+
+    std::mutex mutex;
+    std::string buffer;
+    std::vector<JournalEntry> journalEntries;
+    inline static thread_local std::map<std::string, std::string> fields;
+    std::time_t lastTime = 0;
+    std::string timestamp;
+    int journal = -1;
 };
 
 inline TULog tulog{};
@@ -0,0 +1,139 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Paths changed by a transaction, without walking the complete tree: changes
+  to the root file system are read from the btrfs generations of the
+  snapshot's inodes, changes to /etc from the snapshot's overlay upper layer
+ */
+
+#include "Manifest.hpp"
+#include "Btrfs.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Stats.hpp"
+#include "TreeSync.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <set>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+namespace fs = std::filesystem;
+
+namespace TransactionalUpdate {
+
+namespace {
+bool isWhiteout(const struct stat &st) {
+    return S_ISCHR(st.st_mode) && st.st_rdev == 0;
+}
+
+bool isOpaque(const fs::path &dir) {
+    char value;
+    return lgetxattr(dir.c_str(), "trusted.overlay.opaque", &value, 1) == 1 && value == 'y';
+}
+} // anonymous namespace
+
+std::vector<Manifest::Entry> Manifest::forSnapshot(Snapshot &snapshot) {
+    std::vector<Entry> entries;
+    fs::path root = snapshot.getRoot();
+    if (Btrfs::isBtrfs(root)) {
+        for (auto &entry: forRoot(root)) {
+            // Internal flag files of the transaction
+            if (entry.path == "discardIfNoChange" || entry.path == "transactionIncomplete")
+                continue;
+            entries.push_back({"/" / entry.path, entry.change});
+        }
+    } else {
+        tulog.info("Root file system is not a btrfs file system, skipping changes of the snapshot itself.");
+    }
+
+    fs::path upper = fs::path{config.get("OVERLAY_DIR")} / snapshot.getUid() / "etc";
+    if (fs::is_directory(upper)) {
+        for (auto &entry: forLayer(upper))
+            entries.push_back({"/etc" / entry.path, entry.change});
+    }
+    return entries;
+}
+
+std::vector<Manifest::Entry> Manifest::forRoot(const fs::path &root) {
+    TUStats::Timer timer{"manifest"};
+    // Inode items are only up to date in the tree after a commit
+    Btrfs::sync(root);
+    uint64_t generation = Btrfs::getCreationGeneration(root);
+    std::vector<Entry> entries;
+    for (auto &path: Btrfs::findChanged(root, generation))
+        entries.push_back({path, Change::Modified});
+    tustats.count("manifest_entries", entries.size());
+    return entries;
+}
+
+std::vector<Manifest::Entry> Manifest::forLayer(const fs::path &layer) {
+    TUStats::Timer timer{"manifest"};
+    std::vector<Entry> entries;
+    for (auto it = fs::recursive_directory_iterator(layer); it != fs::recursive_directory_iterator(); ++it) {
+        struct stat st;
+        if (lstat(it->path().c_str(), &st) != 0)
+            throw std::runtime_error{"Reading " + it->path().string() + " failed: " + std::string(strerror(errno))};
+        fs::path rel = it->path().lexically_relative(layer);
+        if (isWhiteout(st)) {
+            entries.push_back({rel, Change::Deleted});
+        } else if (S_ISDIR(st.st_mode) && isOpaque(it->path())) {
+            entries.push_back({rel, Change::Replaced});
+            it.disable_recursion_pending();
+        } else {
+            entries.push_back({rel, Change::Modified});
+        }
+    }
+    tustats.count("manifest_entries", entries.size());
+    return entries;
+}
+
+void Manifest::apply(const std::vector<Entry> &entries, const fs::path &source, const fs::path &target) {
+    // Creating and deleting entries changes the modification time of their directory
+    std::set<fs::path> dirs;
+    for (auto &entry: entries) {
+        if (!entry.path.empty())
+            dirs.insert(entry.path.parent_path());
+        fs::path dst = target / entry.path;
+        switch (entry.change) {
+        case Change::Deleted:
+            fs::remove_all(dst);
+            break;
+        case Change::Modified:
+            TreeSync::copyEntry(source / entry.path, dst);
+            break;
+        case Change::Replaced: {
+            TreeSync::copyEntry(source / entry.path, dst);
+            TreeSync dirSync{source / entry.path, dst};
+            dirSync.setDelete(true);
+            dirSync.run();
+            break;
+        }
+        }
+    }
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        struct stat st;
+        if (lstat((source / *it).c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            continue;
+        const struct timespec times[2] = {{0, UTIME_OMIT}, st.st_mtim};
+        if (utimensat(AT_FDCWD, (target / *it).c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+            throw std::runtime_error{"Setting modification time of " + (target / *it).string() + " failed: " + std::string(strerror(errno))};
+    }
+}
+
+char Manifest::getSymbol(Change change) {
+    switch (change) {
+    case Change::Modified:
+        return 'M';
+    case Change::Deleted:
+        return 'D';
+    case Change::Replaced:
+        return 'R';
+    }
+    return '?';
+}
+
+} // namespace TransactionalUpdate
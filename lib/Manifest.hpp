@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Paths changed by a transaction, without walking the complete tree: changes
+  to the root file system are read from the btrfs generations of the
+  snapshot's inodes, changes to /etc from the snapshot's overlay upper layer
+ */
+
+#ifndef T_U_MANIFEST_H
+#define T_U_MANIFEST_H
+
+#include "Snapshot.hpp"
+#include <filesystem>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+struct Manifest {
+    enum class Change {
+        Modified, // created or changed
+        Deleted,
+        Replaced  // directory replacing everything below it
+    };
+    struct Entry {
+        std::filesystem::path path;
+        Change change;
+    };
+    // All changes of the snapshot since its creation with absolute paths; the /etc
+    // overlay is only included if the snapshot has one
+    static std::vector<Entry> forSnapshot(Snapshot &snapshot);
+    // Paths below root changed since the subvolume was created; root has to be on btrfs
+    static std::vector<Entry> forRoot(const std::filesystem::path &root);
+    // Changes contained in an overlay layer, relative to the layer: whiteouts are deletions,
+    // opaque directories are replacements whose contents are not listed separately
+    static std::vector<Entry> forLayer(const std::filesystem::path &layer);
+    // Apply the changes with paths relative to source and target, parents before their children
+    static void apply(const std::vector<Entry> &entries, const std::filesystem::path &source,
+                      const std::filesystem::path &target);
+    static char getSymbol(Change change);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_MANIFEST_H
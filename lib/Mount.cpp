@@ -7,21 +7,94 @@
 
 #include "Log.hpp"
 #include "Mount.hpp"
+#include "Stats.hpp"
 #include <cstring>
 #include <filesystem>
 #include <stdexcept>
 
 namespace TransactionalUpdate {
 
+MountTableCache::~MountTableCache() {
+    for (auto &[file, cached] : tables) {
+        mnt_unref_table(cached.table);
+    }
+    mnt_unref_table(mtab);
+}
+
+std::shared_ptr<MountTableCache> MountTableCache::get() {
+    std::shared_ptr<MountTableCache> cache = current.lock();
+    if (!cache) {
+        cache = std::make_shared<MountTableCache>();
+        current = cache;
+    }
+    return cache;
+}
+
+struct libmnt_table* MountTableCache::getCachedTable(const std::filesystem::path &file, bool isFstab) {
+    struct stat st = {};
+    // A missing file is not an error here, as the table will just be empty then
+    stat(file.c_str(), &st);
+
+    auto it = tables.find(file);
+    if (it != tables.end()) {
+        const struct stat &old = it->second.st;
+        if (old.st_ino == st.st_ino && old.st_size == st.st_size
+                && old.st_mtim.tv_sec == st.st_mtim.tv_sec && old.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+            return it->second.table;
+        mnt_unref_table(it->second.table);
+        tables.erase(it);
+    }
+
+    int rc;
+    struct libmnt_table* table = mnt_new_table();
+    if (isFstab)
+        rc = mnt_table_parse_fstab(table, nullptr);
+    else
+        rc = mnt_table_parse_file(table, file.c_str());
+    if (rc != 0) {
+        mnt_unref_table(table);
+        throw std::runtime_error{"Error reading mount table " + file.string() + ": " + std::to_string(rc)};
+    }
+    tables[file] = CachedTable{table, st};
+    return table;
+}
+
+struct libmnt_table* MountTableCache::getFstab() {
+    return getCachedTable("/etc/fstab", true);
+}
+
+struct libmnt_table* MountTableCache::getTable(const std::filesystem::path &file) {
+    return getCachedTable(file, false);
+}
+
+struct libmnt_table* MountTableCache::getMtab() {
+    if (mtab == nullptr) {
+        mtab = mnt_new_table();
+        int rc;
+        if ((rc = mnt_table_parse_mtab(mtab, nullptr)) != 0) {
+            mnt_unref_table(mtab);
+            mtab = nullptr;
+            throw std::runtime_error{"Error reading mtab: " + std::to_string(rc)};
+        }
+    }
+    return mtab;
+}
+
+// Users still holding a reference to the old table may continue to use it
+void MountTableCache::invalidateMtab() {
+    mnt_unref_table(mtab);
+    mtab = nullptr;
+}
+
 Mount::Mount(std::string mountpoint, unsigned long flags)
-    : mnt_table{mnt_new_table()}, mountpoint{std::move(mountpoint)},
+    : tableCache{MountTableCache::get()}, mountpoint{std::move(mountpoint)},
       flags{std::move(flags)}
 {
 }
 
 Mount::Mount(Mount&& other) noexcept
 {
-    std::swap(mnt_table, other.mnt_table);
+    std::swap(tableCache, other.tableCache);
     std::swap(mnt_fs, other.mnt_fs);
     std::swap(mnt_cxt, other.mnt_cxt);
     std::swap(mountpoint, other.mountpoint);
@@ -29,14 +102,19 @@ Mount::Mount(Mount&& other) noexcept
 }
 
 Mount::~Mount() {
-    if (mnt_fs) {
-        struct libmnt_table* umount_table = mnt_new_table();
-        if ((mnt_table_parse_mtab(umount_table, nullptr)) != 0)
-            tulog.error("Error reading mtab for umount");
-        struct libmnt_fs* umount_fs = mnt_table_find_target(umount_table,  mnt_fs_get_target(mnt_fs), MNT_ITER_BACKWARD);
-        umountRecursive(umount_table, umount_fs);
-        mnt_free_fs(umount_fs);
-        mnt_free_table(umount_table);
+    // Only unmount file systems mounted by this instance
+    if (mnt_fs && mnt_cxt) {
+        try {
+            struct libmnt_table* umount_table = tableCache->getMtab();
+            mnt_ref_table(umount_table);
+            struct libmnt_fs* umount_fs = mnt_table_find_target(umount_table,  mnt_fs_get_target(mnt_fs), MNT_ITER_BACKWARD);
+            umountRecursive(umount_table, umount_fs);
+            if (umount_fs)
+                tableCache->invalidateMtab();
+            mnt_unref_table(umount_table);
+        } catch (const std::exception &e) {
+            tulog.error("Error reading mtab for umount: ", e.what());
+        }
     }
 
     if (!directoryCreated.empty()) {
@@ -49,22 +127,22 @@ Mount::~Mount() {
 
     mnt_free_context(mnt_cxt);
     mnt_unref_fs(mnt_fs);
-    mnt_free_table(mnt_table);
 }
 
 struct libmnt_fs* Mount::getTabEntry() {
     // Has been found already
     if (mnt_fs != nullptr) return mnt_fs;
 
-    int rc;
-    if (tabsource.empty()) {
-        if ((rc = mnt_table_parse_fstab(mnt_table, nullptr)) != 0)
-            throw std::runtime_error{"Error reading " + mountpoint + " entry from fstab : " + std::to_string(rc)};
-    } else {
-        if ((rc = mnt_table_parse_file(mnt_table, tabsource.c_str())) != 0)
-            throw std::runtime_error{"Error reading " + mountpoint + " entry from " + tabsource + ": " + std::to_string(rc)};
-    }
-    return mnt_table_find_target(mnt_table, mountpoint.c_str(), MNT_ITER_BACKWARD);
+    struct libmnt_table* table;
+    if (tabsource.empty())
+        table = tableCache->getFstab();
+    else
+        table = tableCache->getTable(tabsource);
+    // The table is shared, so work on a private copy of the entry
+    struct libmnt_fs* fs = mnt_table_find_target(table, mountpoint.c_str(), MNT_ITER_BACKWARD);
+    if (fs == nullptr)
+        return nullptr;
+    return mnt_copy_fs(nullptr, fs);
 }
 
 struct libmnt_fs* Mount::findFS() {
@@ -82,6 +160,10 @@ struct libmnt_fs* Mount::newFS() {
     return mnt_fs;
 }
 
+std::string Mount::getMountpoint() {
+    return mountpoint;
+}
+
 std::string Mount::getFilesystem() {
     mnt_fs = findFS();
     return mnt_fs_get_fstype(mnt_fs);
@@ -123,6 +205,18 @@ std::string Mount::getOption(std::string option) {
     return std::string(opt, len);
 }
 
+std::string Mount::getOptions() {
+    mnt_fs = findFS();
+    const char* opts = mnt_fs_get_options(mnt_fs);
+    return opts ? opts : "";
+}
+
+std::string Mount::getSource() {
+    mnt_fs = findFS();
+    const char* source = mnt_fs_get_source(mnt_fs);
+    return source ? source : "";
+}
+
 void Mount::setOption(std::string option, std::string value) {
     mnt_fs = findFS();
 
@@ -144,6 +238,15 @@ void Mount::setOption(std::string option, std::string value) {
     free(new_opts);
 }
 
+void Mount::setOptions(std::string options) {
+    mnt_fs = newFS();
+
+    int rc;
+    if ((rc = mnt_fs_set_options(mnt_fs, options.empty() ? nullptr : options.c_str())) != 0) {
+        throw std::runtime_error{"Could not set options " + options + " for file system " + mountpoint + ": " + std::to_string(rc)};
+    }
+}
+
 void Mount::setTabSource(std::string source) {
     if (mnt_fs != nullptr) {
         throw std::logic_error{"Cannot set tab source for " + mountpoint + ": fs has been initialized already"};
@@ -174,6 +277,24 @@ void Mount::setType(std::string type) {
     }
 }
 
+// The file system has been unmounted by someone else (e.g. a batched unmount
+// of the whole tree), so don't try to unmount it again on destruction
+void Mount::setUnmounted() {
+    mnt_free_context(mnt_cxt);
+    mnt_cxt = nullptr;
+}
+
+// The file system is still in use by a pinned mount namespace, so neither
+// unmount it nor remove the mount point on destruction
+void Mount::release() {
+    setUnmounted();
+    directoryCreated.clear();
+}
+
+std::string Mount::getDirectoryCreated() {
+    return directoryCreated;
+}
+
 void Mount::mount(std::string prefix) {
     tulog.debug("Mounting ", mountpoint, "...");
 
@@ -199,10 +320,12 @@ void Mount::mount(std::string prefix) {
     std::filesystem::create_directories(mounttarget);
 
     rc = mnt_context_mount(mnt_cxt);
+    tableCache->invalidateMtab();
     char buf[BUFSIZ] = { 0 };
     mnt_context_get_excode(mnt_cxt, rc, buf, sizeof(buf));
     if (*buf)
             throw std::runtime_error{"Mounting '" + mountpoint + "': " + buf};
+    tustats.count("mounts");
 }
 
 void Mount::persist(std::filesystem::path file) {
@@ -291,12 +414,12 @@ std::vector<std::filesystem::path> MountList::getList(std::filesystem::path pref
     std::string err;
 
     std::vector<std::filesystem::path> list;
-    struct libmnt_table* mount_table = mnt_new_table();
+    std::shared_ptr<MountTableCache> cache = MountTableCache::get();
+    struct libmnt_table* mount_table = cache->getMtab();
     struct libmnt_iter* mount_iter = mnt_new_iter(MNT_ITER_FORWARD);
     struct libmnt_fs* mount_fs;
 
-    if ((rc = mnt_table_parse_mtab(mount_table, NULL)) != 0)
-        err = "Couldn't read fstab for reading mount points: " + std::to_string(rc);
+    mnt_ref_table(mount_table);
     while (rc == 0) {
         if ((rc = mnt_table_next_fs(mount_table, mount_iter, &mount_fs)) == 0) {
             std::filesystem::path target;
@@ -314,7 +437,7 @@ std::vector<std::filesystem::path> MountList::getList(std::filesystem::path pref
     }
 
     mnt_free_iter(mount_iter);
-    mnt_free_table(mount_table);
+    mnt_unref_table(mount_table);
 
     if (!err.empty()) {
         throw std::runtime_error{err};
@@ -10,30 +10,70 @@
 
 #include <filesystem>
 #include <libmount/libmount.h>
+#include <map>
+#include <memory>
 #include <string>
+#include <sys/stat.h>
 #include <vector>
 
 namespace TransactionalUpdate {
 
+/*
+  Parsed mount tables shared between all Mount instances of a thread; the
+  cache lives as long as any Mount instance (or a Transaction) holds a
+  reference to it. Tables read from files are reparsed when the file
+  changes, mtab is reparsed after mounting or unmounting something.
+ */
+class MountTableCache
+{
+public:
+    MountTableCache() = default;
+    ~MountTableCache();
+    MountTableCache(const MountTableCache&) = delete;
+    void operator=(const MountTableCache&) = delete;
+    static std::shared_ptr<MountTableCache> get();
+    struct libmnt_table* getFstab();
+    struct libmnt_table* getMtab();
+    struct libmnt_table* getTable(const std::filesystem::path &file);
+    void invalidateMtab();
+private:
+    struct CachedTable {
+        struct libmnt_table* table;
+        struct stat st;
+    };
+    struct libmnt_table* getCachedTable(const std::filesystem::path &file, bool isFstab);
+    std::map<std::filesystem::path, CachedTable> tables;
+    struct libmnt_table* mtab = nullptr;
+    inline static thread_local std::weak_ptr<MountTableCache> current;
+};
+
 class Mount
 {
 public:
     Mount(std::string mountpoint, unsigned long flags = 0);
     Mount(Mount&& other) noexcept;
     virtual ~Mount();
+    std::string getDirectoryCreated();
     std::string getFilesystem();
+    std::string getMountpoint();
     std::string getOption(std::string option);
+    std::string getOptions();
+    std::string getSource();
     bool isMount();
     virtual void mount(std::string prefix = "/");
     void persist(std::filesystem::path file);
+    void release();
     void removeOption(std::string option);
     void setOption(std::string option, std::string value);
+    void setOptions(std::string options);
     void setSource(std::string source);
     void setTabSource(std::string source);
     void setType(std::string type);
+    void setUnmounted();
 protected:
+    friend class MountTree;
+    std::shared_ptr<MountTableCache> tableCache;
     struct libmnt_context* mnt_cxt = nullptr;
-    struct libmnt_table* mnt_table = nullptr;
     struct libmnt_fs* mnt_fs = nullptr;
     std::string tabsource;
     std::string mountpoint;
@@ -0,0 +1,360 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Construction of a complete mount tree with the new mount API
+ */
+
+#include "MountTree.hpp"
+#include "Log.hpp"
+#include "Stats.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The wrappers and constants are only available with glibc >= 2.36, and
+// <linux/mount.h> conflicts with <sys/mount.h>, so define what is needed here
+#ifndef __NR_open_tree
+#define __NR_open_tree 428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef __NR_fsopen
+#define __NR_fsopen 430
+#endif
+#ifndef __NR_fsconfig
+#define __NR_fsconfig 431
+#endif
+#ifndef __NR_fsmount
+#define __NR_fsmount 432
+#endif
+#ifndef __NR_mount_setattr
+#define __NR_mount_setattr 442
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG 0
+#endif
+#ifndef FSCONFIG_SET_STRING
+#define FSCONFIG_SET_STRING 1
+#endif
+#ifndef FSCONFIG_CMD_CREATE
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#define MOUNT_ATTR__ATIME 0x00000070
+#define MOUNT_ATTR_RELATIME 0x00000000
+#define MOUNT_ATTR_NOATIME 0x00000010
+#define MOUNT_ATTR_STRICTATIME 0x00000020
+#define MOUNT_ATTR_NODIRATIME 0x00000080
+#endif
+
+namespace TransactionalUpdate {
+
+namespace {
+struct tu_mount_attr {
+    uint64_t attr_set;
+    uint64_t attr_clr;
+    uint64_t propagation;
+    uint64_t userns_fd;
+};
+
+int tu_open_tree(int dfd, const char* path, unsigned int flags) {
+    return syscall(__NR_open_tree, dfd, path, flags);
+}
+int tu_move_mount(int from_dfd, const char* from_path, int to_dfd, const char* to_path, unsigned int flags) {
+    return syscall(__NR_move_mount, from_dfd, from_path, to_dfd, to_path, flags);
+}
+int tu_fsopen(const char* fstype, unsigned int flags) {
+    return syscall(__NR_fsopen, fstype, flags);
+}
+int tu_fsconfig(int fd, unsigned int cmd, const char* key, const void* value, int aux) {
+    return syscall(__NR_fsconfig, fd, cmd, key, value, aux);
+}
+int tu_fsmount(int fd, unsigned int flags, unsigned int attr_flags) {
+    return syscall(__NR_fsmount, fd, flags, attr_flags);
+}
+int tu_mount_setattr(int dfd, const char* path, unsigned int flags, struct tu_mount_attr* attr, size_t size) {
+    return syscall(__NR_mount_setattr, dfd, path, flags, attr, size);
+}
+
+const unsigned long propagationFlags = MS_SHARED | MS_SLAVE | MS_PRIVATE | MS_UNBINDABLE;
+
+// Translate VFS options as used in fstab into mount attributes
+uint64_t getMountAttributes(const char* options) {
+    uint64_t attr = 0;
+    if (options == nullptr)
+        return attr;
+    char* opts = strdup(options);
+    char* pos = opts;
+    char *name, *value;
+    size_t namesz, valuesz;
+    while (mnt_optstr_next_option(&pos, &name, &namesz, &value, &valuesz) == 0) {
+        std::string opt{name, namesz};
+        if (opt == "ro")
+            attr |= MOUNT_ATTR_RDONLY;
+        else if (opt == "nosuid")
+            attr |= MOUNT_ATTR_NOSUID;
+        else if (opt == "nodev")
+            attr |= MOUNT_ATTR_NODEV;
+        else if (opt == "noexec")
+            attr |= MOUNT_ATTR_NOEXEC;
+        else if (opt == "nodiratime")
+            attr |= MOUNT_ATTR_NODIRATIME;
+        else if (opt == "noatime")
+            attr = (attr & ~MOUNT_ATTR__ATIME) | MOUNT_ATTR_NOATIME;
+        else if (opt == "strictatime")
+            attr = (attr & ~MOUNT_ATTR__ATIME) | MOUNT_ATTR_STRICTATIME;
+        else if (opt == "relatime")
+            attr = (attr & ~MOUNT_ATTR__ATIME) | MOUNT_ATTR_RELATIME;
+    }
+    free(opts);
+    return attr;
+}
+} // anonymous namespace
+
+MountTree::MountTree(std::filesystem::path root, unsigned long flags)
+    : tableCache{MountTableCache::get()}, root{std::move(root)}
+{
+    rootFd = cloneTree(this->root, flags);
+}
+
+MountTree::~MountTree() {
+    for (auto &layer : layers) {
+        close(layer.fd);
+    }
+    // Unmounting the root will detach all other mounts of the tree at once;
+    // an unattached tree is freed by the kernel when closing the descriptor.
+    if (attached) {
+        tulog.debug("Unmounting mount tree ", root, "...");
+        if (umount2(root.c_str(), MNT_DETACH) != 0)
+            tulog.error("Error unmounting '", root, "': ", strerror(errno));
+        tableCache->invalidateMtab();
+    }
+    close(rootFd);
+
+    for (auto it = directoriesCreated.rbegin(); it != directoriesCreated.rend(); ++it) {
+        try {
+            std::filesystem::remove_all(*it);
+        }  catch (const std::exception &e) {
+            tulog.error("ERROR: ", e.what());
+        }
+    }
+}
+
+bool MountTree::isSupported() {
+    static const bool supported = [] {
+        // Probing with an invalid descriptor will fail with EBADF if the call is known
+        if (tu_open_tree(-1, "", 0) < 0 && errno == ENOSYS)
+            return false;
+        if (tu_mount_setattr(-1, "", 0, nullptr, 0) < 0 && errno == ENOSYS)
+            return false;
+        return true;
+    }();
+    return supported;
+}
+
+int MountTree::cloneTree(const std::string &source, unsigned long flags) {
+    unsigned int treeFlags = OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC;
+    if (flags & MS_REC)
+        treeFlags |= AT_RECURSIVE;
+    int fd = tu_open_tree(AT_FDCWD, source.c_str(), treeFlags);
+    if (fd < 0)
+        throw std::runtime_error{"Cloning mount tree '" + source + "' failed: " + std::string(strerror(errno))};
+    try {
+        setAttributes(fd, flags, source);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    return fd;
+}
+
+int MountTree::createFs(Mount& mount) {
+    const char* type = mnt_fs_get_fstype(mount.mnt_fs);
+    const char* source = mnt_fs_get_source(mount.mnt_fs);
+    if (type == nullptr)
+        throw std::runtime_error{"No file system type set for '" + mount.mountpoint + "'."};
+
+    int fsfd = tu_fsopen(type, FSOPEN_CLOEXEC);
+    if (fsfd < 0)
+        throw std::runtime_error{"Opening file system '" + std::string(type) + "' for '" + mount.mountpoint + "' failed: " + std::string(strerror(errno))};
+
+    std::string err;
+    auto setString = [&](const std::string &key, const std::string &value) {
+        if (err.empty() && tu_fsconfig(fsfd, FSCONFIG_SET_STRING, key.c_str(), value.c_str(), 0) != 0)
+            err = "Setting option '" + key + "' for '" + mount.mountpoint + "' failed: " + std::string(strerror(errno));
+    };
+
+    if (source != nullptr)
+        setString("source", source);
+
+    // Only file system specific options are passed on, userspace options
+    // such as x-systemd.* are not known to the kernel
+    const char* options = mnt_fs_get_fs_options(mount.mnt_fs);
+    char* opts = options ? strdup(options) : nullptr;
+    char* pos = opts;
+    char *name, *value;
+    size_t namesz, valuesz;
+    while (err.empty() && pos && mnt_optstr_next_option(&pos, &name, &namesz, &value, &valuesz) == 0) {
+        std::string key{name, namesz};
+        if (value == nullptr) {
+            if (tu_fsconfig(fsfd, FSCONFIG_SET_FLAG, key.c_str(), nullptr, 0) != 0)
+                err = "Setting option '" + key + "' for '" + mount.mountpoint + "' failed: " + std::string(strerror(errno));
+            continue;
+        }
+        std::string val{value, valuesz};
+        // The kernel limits single values to 256 bytes; overlay layers
+        // may be added one by one instead (Linux >= 6.5)
+        if (key == "lowerdir" && val.length() >= 256) {
+            size_t start = 0, end;
+            do {
+                end = val.find(':', start);
+                setString("lowerdir+", val.substr(start, end - start));
+                start = end + 1;
+            } while (end != std::string::npos);
+        } else {
+            setString(key, val);
+        }
+    }
+    free(opts);
+
+    if (err.empty() && tu_fsconfig(fsfd, FSCONFIG_CMD_CREATE, nullptr, nullptr, 0) != 0)
+        err = "Creating file system for '" + mount.mountpoint + "' failed: " + std::string(strerror(errno));
+
+    int fd = -1;
+    if (err.empty()) {
+        fd = tu_fsmount(fsfd, FSMOUNT_CLOEXEC, getMountAttributes(mnt_fs_get_vfs_options(mount.mnt_fs)));
+        if (fd < 0)
+            err = "Mounting '" + mount.mountpoint + "' failed: " + std::string(strerror(errno));
+    }
+    close(fsfd);
+    if (!err.empty())
+        throw std::runtime_error{err};
+
+    try {
+        setAttributes(fd, mount.flags, mount.mountpoint);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    return fd;
+}
+
+void MountTree::setAttributes(int fd, unsigned long flags, const std::string &name) {
+    struct tu_mount_attr attr = {};
+    if (flags & MS_RDONLY)
+        attr.attr_set |= MOUNT_ATTR_RDONLY;
+    if (flags & MS_NOSUID)
+        attr.attr_set |= MOUNT_ATTR_NOSUID;
+    if (flags & MS_NODEV)
+        attr.attr_set |= MOUNT_ATTR_NODEV;
+    if (flags & MS_NOEXEC)
+        attr.attr_set |= MOUNT_ATTR_NOEXEC;
+    attr.propagation = flags & propagationFlags;
+    if (attr.attr_set == 0 && attr.propagation == 0)
+        return;
+
+    unsigned int atFlags = AT_EMPTY_PATH;
+    if (flags & MS_REC)
+        atFlags |= AT_RECURSIVE;
+    if (tu_mount_setattr(fd, "", atFlags, &attr, sizeof(attr)) != 0)
+        throw std::runtime_error{"Setting mount attributes for '" + name + "' failed: " + std::string(strerror(errno))};
+}
+
+void MountTree::add(Mount& mount) {
+    tulog.debug("Preparing mount ", mount.mountpoint, "...");
+
+    int fd;
+    if (mount.flags & MS_BIND) {
+        const char* source = mount.mnt_fs ? mnt_fs_get_source(mount.mnt_fs) : nullptr;
+        fd = cloneTree(source ? source : mount.mountpoint, mount.flags);
+    } else {
+        if (mount.mnt_fs == nullptr)
+            throw std::runtime_error{"File system " + mount.mountpoint + " has not been initialized."};
+        fd = createFs(mount);
+    }
+    layers.push_back(Layer{fd, mount.mountpoint});
+
+    std::filesystem::path target = root / std::filesystem::path{mount.mountpoint}.relative_path();
+    if (! std::filesystem::is_directory(target)) {
+        tulog.debug("Mount target ", target, " does not exist - creating...");
+        directoriesCreated.push_back(target);
+        std::filesystem::create_directories(target);
+    }
+}
+
+void MountTree::moveMount(int fd, int dirfd, const std::filesystem::path &target) {
+    if (tu_move_mount(fd, "", dirfd, target.c_str(), MOVE_MOUNT_F_EMPTY_PATH) != 0)
+        throw std::runtime_error{"Attaching mount '" + target.string() + "' failed: " + std::string(strerror(errno))};
+}
+
+void MountTree::attach() {
+    // Attaching mounts to a detached tree requires Linux >= 6.15; on older
+    // kernels the root has to be attached first and will be visible in an
+    // incomplete state until all layers have been mounted.
+    bool detachedTarget = true;
+    for (auto &layer : layers) {
+        std::filesystem::path relTarget = layer.target.relative_path();
+        if (detachedTarget) {
+            if (tu_move_mount(layer.fd, "", rootFd, relTarget.c_str(), MOVE_MOUNT_F_EMPTY_PATH) == 0)
+                continue;
+            if (errno != EINVAL)
+                throw std::runtime_error{"Attaching mount '" + layer.target.string() + "' failed: " + std::string(strerror(errno))};
+            tulog.debug("Kernel can't attach to detached mount trees - attaching root first.");
+            detachedTarget = false;
+            moveMount(rootFd, AT_FDCWD, root);
+            attached = true;
+        }
+        moveMount(layer.fd, AT_FDCWD, root / relTarget);
+    }
+    if (!attached) {
+        moveMount(rootFd, AT_FDCWD, root);
+        attached = true;
+    }
+    tableCache->invalidateMtab();
+    tustats.count("mounts", layers.size() + 1);
+
+    for (auto &layer : layers) {
+        close(layer.fd);
+    }
+    layers.clear();
+}
+
+std::vector<std::filesystem::path> MountTree::getDirectoriesCreated() {
+    return directoriesCreated;
+}
+
+// Keep the attached tree and its mount points, e.g. for a pinned mount namespace
+void MountTree::release() {
+    attached = false;
+    directoriesCreated.clear();
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Construction of a complete mount tree with the new mount API
+  (open_tree / fsopen / move_mount): All mounts are prepared detached from
+  the file system and then attached to the target directory, so a failure
+  while preparing the tree doesn't leave any partial mounts behind.
+ */
+
+#ifndef T_U_MOUNTTREE_H
+#define T_U_MOUNTTREE_H
+
+#include "Mount.hpp"
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class MountTree
+{
+public:
+    MountTree(std::filesystem::path root, unsigned long flags = 0);
+    ~MountTree();
+    MountTree(const MountTree&) = delete;
+    void operator=(const MountTree&) = delete;
+    static bool isSupported();
+    void add(Mount& mount);
+    void attach();
+    std::vector<std::filesystem::path> getDirectoriesCreated();
+    void release();
+private:
+    struct Layer {
+        int fd;
+        std::filesystem::path target;
+    };
+    int cloneTree(const std::string &source, unsigned long flags);
+    int createFs(Mount& mount);
+    void setAttributes(int fd, unsigned long flags, const std::string &name);
+    void moveMount(int fd, int dirfd, const std::filesystem::path &target);
+    std::shared_ptr<MountTableCache> tableCache;
+    std::filesystem::path root;
+    int rootFd = -1;
+    bool attached = false;
+    std::vector<Layer> layers;
+    std::vector<std::filesystem::path> directoriesCreated;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_MOUNTTREE_H
@@ -10,13 +10,17 @@
 #include "Configuration.hpp"
 #include "Log.hpp"
 #include "Mount.hpp"
-#include "Util.hpp"
+#include "Stats.hpp"
+#include "TreeSync.hpp"
 #include <cstring>
 #include <filesystem>
 #include <regex>
 #include <selinux/selinux.h>
 #include <selinux/context.h>
 #include <sstream>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
 #include <unistd.h>
 
 using std::exception;
@@ -28,6 +32,53 @@ namespace fs = std::filesystem;
 
 namespace TransactionalUpdate {
 
+namespace {
+const string opaqueXattr = "trusted.overlay.opaque";
+
+bool isOpaque(const fs::path &dir) {
+    char value;
+    return lgetxattr(dir.c_str(), opaqueXattr.c_str(), &value, 1) == 1 && value == 'y';
+}
+
+void setOpaque(const fs::path &dir) {
+    if (lsetxattr(dir.c_str(), opaqueXattr.c_str(), "y", 1, 0) != 0)
+        throw std::runtime_error{"Marking " + dir.string() + " as opaque failed: " + std::string(strerror(errno))};
+}
+
+// Apply an overlay layer on top of the merged layer with the semantics of overlayfs:
+// entries of the layer replace merged entries and directories are merged unless the
+// layer's directory is opaque. Whiteouts are kept, as they have to hide the entries
+// of the layers below the merged layer as well.
+void mergeLayer(const fs::path &layer, const fs::path &merged) {
+    for (auto &entry : fs::directory_iterator(layer)) {
+        fs::path target = merged / entry.path().filename();
+        struct stat st;
+        if (lstat(entry.path().c_str(), &st) != 0)
+            throw std::runtime_error{"Reading " + entry.path().string() + " failed: " + std::string(strerror(errno))};
+        if (!S_ISDIR(st.st_mode)) {
+            TreeSync::copyEntry(entry.path(), target);
+            continue;
+        }
+
+        struct stat old;
+        bool exists = lstat(target.c_str(), &old) == 0;
+        bool opaque = isOpaque(entry.path());
+        if (exists && (opaque || !S_ISDIR(old.st_mode))) {
+            // A directory replacing a file or whiteout hides the layers below, too
+            fs::remove_all(target);
+            opaque = true;
+            exists = false;
+        }
+        // Copying the metadata drops an opaque flag of the merged directory
+        opaque = opaque || (exists && isOpaque(target));
+        TreeSync::copyEntry(entry.path(), target);
+        if (opaque)
+            setOpaque(target);
+        mergeLayer(entry.path(), target);
+    }
+}
+} // anonymous namespace
+
 /*
  * Create a new overlay instance for the given snapshot number.
  * For existing overlays the lowerdirs are read automatically from the given snapshot overlay;
@@ -89,20 +140,23 @@ bool Overlay::references(string snapshot) {
     return false;
 }
 
-void Overlay::sync(string base, fs::path snapRoot) {
+// Mount the /etc of base's previous snapshot read-only; the result has no mount
+// if there's nothing to synchronize
+unique_ptr<Overlay::PreparedSync> Overlay::mountPrevious(SnapshotManager &mgr, const string &base) {
+    unique_ptr<PreparedSync> prepared{new PreparedSync{base, nullptr, {}, {}}};
     Overlay baseOverlay = Overlay{base};
     auto previousSnapId = baseOverlay.getPreviousSnapshotOvlId();
     if (previousSnapId.empty()) {
         tulog.info("No previous snapshot to sync with - skipping");
-        return;
+        return prepared;
     }
 
     unique_ptr<Snapshot> previousSnapshot;
     try {
-        previousSnapshot = snapMgr->open(previousSnapId);
+        previousSnapshot = mgr.open(previousSnapId);
     } catch (std::invalid_argument &e) {
-        tulog.info("Parent snapshot ", previousSnapId, " does not exist any more - skipping rsync");
-        return;
+        tulog.info("Parent snapshot ", previousSnapId, " does not exist any more - skipping sync");
+        return prepared;
     }
     unique_ptr<Mount> previousEtc{new Mount("/etc")};
     previousEtc->setTabSource(previousSnapshot->getRoot() / "etc" / "fstab");
@@ -114,23 +168,58 @@ void Overlay::sync(string base, fs::path snapRoot) {
     previousEtc->removeOption("upperdir");
     previousEtc->removeOption("workdir");
 
-    string syncSource = string(previousOvl.upperdir.parent_path() / "sync" / "etc") + "/";
-    string rsyncExtraArgs;
+    prepared->source = previousOvl.upperdir.parent_path() / "sync" / "etc";
     previousEtc->mount(previousOvl.upperdir.parent_path() / "sync");
-    tulog.info("Syncing /etc of previous snapshot ", previousSnapId, " as base into new snapshot ", snapRoot);
+    prepared->previousEtc = std::move(previousEtc);
+    tulog.info("Syncing /etc of previous snapshot ", previousSnapId, " as base into new snapshot of ", base);
 
     if (is_selinux_enabled()) {
         tulog.info("SELinux is enabled.");
     }
+    return prepared;
+}
 
-    try {
-        Util::exec("rsync --quiet --archive --inplace --xattrs --exclude='/fstab' --acls --delete " + syncSource + " " + string(snapRoot) + "/etc 2>&1");
-    } catch (exception &e) {
-        // rsync will fail when synchronizing pre-SELinux snapshots as soon as SELinux enabled,
-        // so try again without the SELinux xattrs.
-        tulog.info("Retrying rsync without SELinux xattrs...");
-        Util::exec("rsync --quiet --archive --inplace --xattrs --filter='-x security.selinux' --exclude='/fstab' --acls --delete " + syncSource + " " + string(snapRoot) + "/etc");
+// The new snapshot is created from base, so its /etc will be identical to base's
+// /etc; comparing with the latter can be done while the snapshot is being created.
+unique_ptr<Overlay::PreparedSync> Overlay::prepareSync(string base) {
+    unique_ptr<SnapshotManager> mgr = SnapshotFactory::get();
+    Overlay parent{base};
+    Mount currentEtc{"/etc"};
+    if (parent.references(getIdOfOverlayDir(currentEtc.getOption("upperdir"))))
+        return nullptr;
+
+    unique_ptr<PreparedSync> prepared = mountPrevious(*mgr, base);
+    if (!prepared->previousEtc)
+        return prepared;
+    TreeSync etcSync{prepared->source, mgr->open(base)->getRoot() / "etc"};
+    etcSync.addExclude("/fstab");
+    etcSync.setDelete(true);
+    etcSync.setDryRun(true);
+    etcSync.run();
+    prepared->changes = etcSync.getChanges();
+    return prepared;
+}
+
+void Overlay::sync(string base, fs::path snapRoot, unique_ptr<PreparedSync> prepared) {
+    TUStats::Timer timer{"overlay-sync"};
+    if (prepared && prepared->base == base) {
+        if (prepared->previousEtc) {
+            tulog.debug("Applying ", prepared->changes.size(), " prepared changes to ", snapRoot / "etc");
+            Manifest::apply(prepared->changes, prepared->source, snapRoot / "etc");
+            tustats.count("sync_entries", prepared->changes.size());
+        }
+        return;
     }
+
+    prepared = mountPrevious(*snapMgr, base);
+    if (!prepared->previousEtc)
+        return;
+    // Labels of pre-SELinux snapshots which can't be applied any more are skipped
+    // by TreeSync, so no second run without SELinux xattrs is necessary.
+    TreeSync etcSync{prepared->source, snapRoot / "etc"};
+    etcSync.addExclude("/fstab");
+    etcSync.setDelete(true);
+    etcSync.run();
 }
 
 void Overlay::setMountOptions(unique_ptr<Mount>& mount) {
@@ -180,7 +269,8 @@ void Overlay::setMountOptionsForMount(unique_ptr<Mount>& mount) {
     mount->setOption("workdir", workdir);
 }
 
-void Overlay::create(string base, string snapshot, fs::path snapRoot) {
+void Overlay::create(string base, string snapshot, fs::path snapRoot, unique_ptr<PreparedSync> prepared) {
+    TUStats::Timer timer{"overlay-create"};
     upperdir = fs::path{config.get("OVERLAY_DIR")} / snapshot / "etc";
     Overlay parent = Overlay{base};
 
@@ -213,10 +303,67 @@ void Overlay::create(string base, string snapshot, fs::path snapRoot) {
         for (auto it = parent.lowerdirs.begin(); it != parent.lowerdirs.end(); it++) {
             lowerdirs.push_back(*it);
         }
+        compact(snapshot, getIdOfOverlayDir(currentUpper));
     } else {
         lowerdirs.push_back(parent.lowerdirs.back());
-        sync(base, snapRoot);
+        sync(base, snapRoot, std::move(prepared));
+    }
+}
+
+/*
+ * Keep the depth of the lowerdir stack bounded: Each stacked transaction adds
+ * another layer, slowing down every lookup in /etc, until the mount options
+ * exceed their maximum length. Layers which can't change any more are squashed
+ * into layers owned by the new snapshot; the layers themselves are left
+ * untouched, as they are still referenced by the older snapshots.
+ * Not squashed are the parent's upper directory (used to find the previous
+ * snapshot), the running system's upper directory (still writable) and the
+ * root file system's /etc at the bottom of the stack.
+ */
+void Overlay::compact(const string &snapshot, const string &current) {
+    unsigned long maxDepth = std::stoul(config.get("OVERLAY_MAX_DEPTH"));
+    if (maxDepth == 0 || lowerdirs.size() <= maxDepth)
+        return;
+
+    size_t currentPos = 0;
+    while (currentPos < lowerdirs.size() && getIdOfOverlayDir(lowerdirs[currentPos]) != current)
+        currentPos++;
+    if (currentPos == 0 || currentPos >= lowerdirs.size() - 1)
+        return;
+    // Layers of open transactions may still change
+    for (size_t i = 1; i < lowerdirs.size() - 1; i++) {
+        string id = getIdOfOverlayDir(lowerdirs[i]);
+        if (i == currentPos || id.empty())
+            continue;
+        try {
+            if (snapMgr->open(id)->isInProgress()) {
+                tulog.debug("Not compacting /etc overlay stack: snapshot ", id, " is still in progress.");
+                return;
+            }
+        } catch (std::invalid_argument &e) {}
+    }
+
+    TUStats::Timer timer{"overlay-compact"};
+    size_t depth = lowerdirs.size();
+    fs::path dir = fs::path{config.get("OVERLAY_DIR")} / snapshot;
+    // Squash the lower group first, so the positions of the upper group stay valid
+    if (lowerdirs.size() - 1 - (currentPos + 1) >= 2)
+        squash(currentPos + 1, lowerdirs.size() - 1, dir / "compact-lower");
+    if (currentPos - 1 >= 2)
+        squash(1, currentPos, dir / "compact-upper");
+    tulog.info("Compacted /etc overlay stack from ", depth, " to ", lowerdirs.size(), " layers.");
+}
+
+// Replace lowerdirs [first, last) by a single merged layer
+void Overlay::squash(size_t first, size_t last, const fs::path &merged) {
+    tulog.debug("Squashing ", last - first, " /etc overlay layers into ", merged);
+    fs::remove_all(merged);
+    TreeSync::copyEntry(lowerdirs[last - 1], merged);
+    for (size_t i = last; i-- > first;) {
+        mergeLayer(lowerdirs[i], merged);
     }
+    lowerdirs.erase(lowerdirs.begin() + first, lowerdirs.begin() + last);
+    lowerdirs.insert(lowerdirs.begin() + first, merged);
 }
 
 } // namespace TransactionalUpdate
@@ -8,6 +8,7 @@
 #ifndef T_U_OVERLAY_H
 #define T_U_OVERLAY_H
 
+#include "Manifest.hpp"
 #include "Mount.hpp"
 #include "SnapshotManager.hpp"
 #include <memory>
@@ -18,12 +19,24 @@ namespace TransactionalUpdate {
 
 class Overlay {
 public:
+    // Mounted /etc of the previous snapshot and its differences to the base snapshot's /etc
+    struct PreparedSync {
+        std::string base;
+        std::unique_ptr<Mount> previousEtc;
+        std::filesystem::path source;
+        std::vector<Manifest::Entry> changes;
+    };
     Overlay(std::string snapshot);
     virtual ~Overlay() = default;
-    void create(std::string base, std::string snapshot, std::filesystem::path snapRoot);
+    void create(std::string base, std::string snapshot, std::filesystem::path snapRoot,
+                std::unique_ptr<PreparedSync> prepared = nullptr);
     std::string getPreviousSnapshotOvlId();
     bool references(std::string snapshot);
-    void sync(std::string base, std::filesystem::path snapRoot);
+    // Determine the changes `sync` has to apply to a new snapshot of base before the snapshot
+    // exists, comparing with base's own /etc instead; returns nullptr if the new overlay will
+    // be stacked and doesn't need a synchronization at all
+    static std::unique_ptr<PreparedSync> prepareSync(std::string base);
+    void sync(std::string base, std::filesystem::path snapRoot, std::unique_ptr<PreparedSync> prepared = nullptr);
     void setMountOptions(std::unique_ptr<Mount>& mount);
     void setMountOptionsForMount(std::unique_ptr<Mount>& mount);
 
@@ -32,6 +45,9 @@ public:
     std::filesystem::path workdir;
 private:
     static std::string getIdOfOverlayDir(const std::string dir);
+    static std::unique_ptr<PreparedSync> mountPrevious(SnapshotManager &mgr, const std::string &base);
+    void compact(const std::string &snapshot, const std::string &current);
+    void squash(size_t first, size_t last, const std::filesystem::path &merged);
     std::unique_ptr<SnapshotManager> snapMgr;
 };
 
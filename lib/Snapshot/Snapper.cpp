@@ -6,34 +6,69 @@
  */
 
 #include "Snapper.hpp"
+#include "Btrfs.hpp"
 #include "Exceptions.hpp"
 #include "Log.hpp"
 #include "Util.hpp"
-#include <regex>
+#include <sstream>
+#include <vector>
 
 namespace TransactionalUpdate {
 
+// Splits a line of snapper's CSV output; fields containing separators are quoted, with
+// quotes being escaped by doubling them
+static std::vector<std::string> splitCsvLine(const std::string &line) {
+    std::vector<std::string> fields;
+    std::string field;
+    bool quoted = false;
+    for (size_t i = 0; i < line.length(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.length() && line[i + 1] == '"') {
+                field += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return fields;
+}
+
 std::unique_ptr<Snapshot> Snapper::create(std::string base) {
     if (! std::filesystem::exists("/.snapshots/" + base + "/snapshot"))
         throw std::invalid_argument{"Base snapshot '" + base + "' does not exist."};
-    snapshotId = callSnapper("create --from " + base + " --read-write --print-number --description 'Snapshot Update of #" + base + "' --userdata 'transactional-update-in-progress=yes'");
+    snapshotId = callSnapper({"create", "--from", base, "--read-write", "--print-number", "--description", "Snapshot Update of #" + base, "--userdata", "transactional-update-in-progress=yes"});
     Util::rtrim(snapshotId);
-    return std::make_unique<Snapper>(snapshotId);
+    invalidateIndex();
+    return std::make_unique<Snapper>(snapshotId, index);
 }
 
 std::unique_ptr<Snapshot> Snapper::open(std::string id) {
     snapshotId = id;
     if (! std::filesystem::exists(getRoot()))
         throw std::invalid_argument{"Snapshot " + id + " does not exist."};
-    return std::make_unique<Snapper>(snapshotId);
+    return std::make_unique<Snapper>(snapshotId, index);
 }
 
 void Snapper::close() {
-    callSnapper("modify -u 'transactional-update-in-progress=' " + snapshotId);
+    callSnapper({"modify", "-u", "transactional-update-in-progress=", snapshotId});
+    invalidateIndex();
 }
 
 void Snapper::abort() {
-    callSnapper("delete " + snapshotId);
+    callSnapper({"delete", snapshotId});
+    invalidateIndex();
 }
 
 std::filesystem::path Snapper::getRoot() {
@@ -41,59 +76,128 @@ std::filesystem::path Snapper::getRoot() {
 }
 
 std::string Snapper::getCurrent() {
-    std::string id = callSnapper("--csvout list --columns active,number");
-    std::smatch match;
-    bool found = std::regex_search(id, match, std::regex("yes,([0-9]+)"));
-    if (!found)
-        throw std::runtime_error{"Couldn't determine current snapshot number"};
-    return match[1].str();
+    for (auto &[id, info] : getIndex()) {
+        if (info.active)
+            return id;
+    }
+    throw std::runtime_error{"Couldn't determine current snapshot number"};
 }
 
 std::string Snapper::getDefault() {
-    std::string id = callSnapper("--csvout list --columns default,number");
-    std::smatch match;
-    bool found = std::regex_search(id, match, std::regex("yes,([0-9]+)"));
-    if (!found)
-        throw std::runtime_error{"Couldn't determine default snapshot number"};
-    return match[1].str();
+    for (auto &[id, info] : getIndex()) {
+        if (info.isDefault)
+            return id;
+    }
+    throw std::runtime_error{"Couldn't determine default snapshot number"};
 }
 
 bool Snapper::isInProgress() {
-    std::string desc = callSnapper("--csvout list --columns number,userdata");
-    std::smatch match;
-    return std::regex_search(desc, match, std::regex("(^|\n)" + snapshotId + ",.*transactional-update-in-progress=yes"));
+    auto snap = getIndex().find(snapshotId);
+    return snap != getIndex().end() && snap->second.inProgress;
+}
+
+SnapshotIndex Snapper::list() {
+    return getIndex();
+}
+
+// snapper accepts several snapshot numbers, so all snapshots are handled by one call
+void Snapper::remove(const std::vector<std::string> &ids) {
+    if (ids.empty())
+        return;
+    std::vector<std::string> opts{"delete"};
+    opts.insert(opts.end(), ids.begin(), ids.end());
+    callSnapper(opts);
+    invalidateIndex();
+}
+
+void Snapper::modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) {
+    if (ids.empty())
+        return;
+    std::vector<std::string> opts{"modify", "--cleanup-algorithm", cleanup};
+    if (!userdata.empty()) {
+        std::string data;
+        for (auto &[key, value] : userdata) {
+            if (!data.empty())
+                data += ",";
+            data += key + "=" + value;
+        }
+        opts.push_back("--userdata");
+        opts.push_back(data);
+    }
+    opts.insert(opts.end(), ids.begin(), ids.end());
+    callSnapper(opts);
+    invalidateIndex();
+}
+
+const SnapshotIndex& Snapper::getIndex() {
+    if (!index->has_value())
+        *index = readIndex();
+    return index->value();
+}
+
+void Snapper::invalidateIndex() {
+    index->reset();
+}
+
+SnapshotIndex Snapper::readIndex() {
+    SnapshotIndex snapshots;
+    std::stringstream csv{callSnapper({"--csvout", "list", "--columns", "number,active,default,cleanup,description,userdata"})};
+    std::string line;
+    // Skip header
+    getline(csv, line);
+    while (getline(csv, line)) {
+        std::vector<std::string> fields = splitCsvLine(line);
+        if (fields.size() != 6)
+            throw std::runtime_error{"Couldn't parse snapshot list entry '" + line + "'"};
+        SnapshotInfo info;
+        info.active = fields[1] == "yes";
+        info.isDefault = fields[2] == "yes";
+        info.cleanup = fields[3];
+        info.description = fields[4];
+        // Userdata is a comma separated list of key=value pairs
+        std::stringstream userdata{fields[5]};
+        std::string pair;
+        while (getline(userdata, pair, ',')) {
+            Util::trim(pair);
+            size_t pos = pair.find('=');
+            if (pos == std::string::npos)
+                continue;
+            info.userdata[pair.substr(0, pos)] = pair.substr(pos + 1);
+        }
+        auto inProgress = info.userdata.find("transactional-update-in-progress");
+        info.inProgress = inProgress != info.userdata.end() && inProgress->second == "yes";
+        snapshots[fields[0]] = info;
+    }
+    return snapshots;
 }
 
 bool Snapper::isReadOnly() {
-    std::string ro = Util::exec("btrfs property get " + std::string(getRoot()) + " ro");
-    Util::rtrim(ro);
-    if (ro == "ro=true")
-        return true;
-    else
-        return false;
+    return Btrfs::isReadOnly(getRoot());
 }
 
 void Snapper::setDefault() {
-    Util::exec("btrfs subvolume set-default " + std::string(getRoot()));
+    Btrfs::setDefault(getRoot());
+    invalidateIndex();
 }
 
 void Snapper::setReadOnly(bool readonly) {
-    std::string boolstr = "true";
-    if (readonly == false)
-        boolstr = "false";
-    Util::exec("btrfs property set " + std::string(getRoot()) + " ro " + boolstr);
+    Btrfs::setReadOnly(getRoot(), readonly);
 }
 
-std::string Snapper::callSnapper(std::string opts) {
+std::string Snapper::callSnapper(std::vector<std::string> opts) {
     if (snapperNoDbus == false) {
         try {
-            return Util::exec("snapper " + opts);
+            std::vector<std::string> args{"snapper"};
+            args.insert(args.end(), opts.begin(), opts.end());
+            return Util::spawn(args);
         } catch (const ExecutionException &e) {
             snapperNoDbus = true;
         }
     }
     if (snapperNoDbus == true) {
-        return Util::exec("snapper --no-dbus " + opts);
+        std::vector<std::string> args{"snapper", "--no-dbus"};
+        args.insert(args.end(), opts.begin(), opts.end());
+        return Util::spawn(args);
     }
     return "false ";
 }
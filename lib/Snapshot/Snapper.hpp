@@ -10,16 +10,24 @@
 
 #include "SnapshotManager.hpp"
 #include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace TransactionalUpdate {
 
+// The snapshot index is shared between a manager and all snapshots opened or created by it;
+// it is read on first use and has to be invalidated on every modification
+using SnapshotIndexCache = std::shared_ptr<std::optional<SnapshotIndex>>;
+
 class Snapper: public SnapshotManager, public Snapshot {
 public:
     ~Snapper() = default;
 
     // Snapshot
-    Snapper(std::string snap): Snapshot(snap) {};
+    Snapper(std::string snap, SnapshotIndexCache index): Snapshot(snap), index{index} {};
     void close() override;
     void abort() override;
     std::filesystem::path getRoot() override;
@@ -29,13 +37,21 @@ public:
     void setReadOnly(bool readonly) override;
 
     // SnapshotManager
-    Snapper(): Snapshot("") {};
+    Snapper(): Snapshot(""), index{std::make_shared<std::optional<SnapshotIndex>>()} {};
     std::unique_ptr<Snapshot> create(std::string base) override;
     virtual std::unique_ptr<Snapshot> open(std::string id) override;
     std::string getCurrent() override;
     std::string getDefault() override;
+    SnapshotIndex list() override;
+    void remove(const std::vector<std::string> &ids) override;
+    void modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) override;
+protected:
+    const SnapshotIndex& getIndex();
+    void invalidateIndex();
+    virtual SnapshotIndex readIndex();
+    SnapshotIndexCache index;
 private:
-    std::string callSnapper(std::string);
+    std::string callSnapper(std::vector<std::string> opts);
     inline static bool snapperNoDbus;
 };
 
@@ -0,0 +1,343 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Snapper backend talking to snapperd via D-Bus directly instead of calling
+  the snapper command line tool; everything not handled by snapperd itself
+  is inherited from the command line backend
+ */
+
+#include "SnapperDbus.hpp"
+#include "Log.hpp"
+#include <cstring>
+#include <systemd/sd-bus.h>
+
+namespace TransactionalUpdate {
+
+static const char* snapperService = "org.opensuse.Snapper";
+static const char* snapperPath = "/org/opensuse/Snapper";
+static const char* snapperInterface = "org.opensuse.Snapper";
+static const char* snapperConfig = "root";
+static const char* inProgressKey = "transactional-update-in-progress";
+
+// Methods introduced in later snapper versions may not be available yet
+class UnknownMethodException : public std::runtime_error {
+public:
+    UnknownMethodException(const std::string& what) : std::runtime_error(what) {}
+};
+
+// Reuses the thread's default system bus connection, so opening further managers or
+// snapshots doesn't require a new connection handshake
+static sd_bus* openBus() {
+    sd_bus* bus = nullptr;
+    int rc = sd_bus_default_system(&bus);
+    if (rc < 0)
+        throw std::runtime_error{"Connecting to system bus failed: " + std::string(strerror(-rc))};
+    return bus;
+}
+
+SnapperDbus::SnapperDbus(): Snapper(), bus{openBus()} {
+}
+
+SnapperDbus::SnapperDbus(std::string snap, SnapshotIndexCache index): Snapper(snap, index), bus{openBus()} {
+}
+
+SnapperDbus::~SnapperDbus() {
+    sd_bus_unref(bus);
+}
+
+bool SnapperDbus::isAvailable() {
+    static thread_local int available = -1;
+    if (available >= 0)
+        return available;
+
+    sd_bus* bus = nullptr;
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = nullptr;
+    available = 0;
+    if (sd_bus_default_system(&bus) >= 0) {
+        if (sd_bus_call_method(bus, snapperService, snapperPath, snapperInterface, "GetConfig",
+                &error, &reply, "s", snapperConfig) >= 0) {
+            available = 1;
+        } else {
+            tulog.debug("snapperd not reachable via D-Bus: ", error.message ? error.message : "unknown error");
+        }
+    }
+    sd_bus_message_unref(reply);
+    sd_bus_error_free(&error);
+    sd_bus_unref(bus);
+    return available;
+}
+
+sd_bus_message* SnapperDbus::newMethodCall(const std::string &method) {
+    sd_bus_message* m = nullptr;
+    int rc = sd_bus_message_new_method_call(bus, &m, snapperService, snapperPath, snapperInterface, method.c_str());
+    if (rc < 0)
+        throw std::runtime_error{"Creating D-Bus call " + method + " failed: " + std::string(strerror(-rc))};
+    rc = sd_bus_message_append(m, "s", snapperConfig);
+    if (rc < 0) {
+        sd_bus_message_unref(m);
+        throw std::runtime_error{"Creating D-Bus call " + method + " failed: " + std::string(strerror(-rc))};
+    }
+    return m;
+}
+
+// Sends the given message and returns the reply; takes ownership of m
+sd_bus_message* SnapperDbus::call(sd_bus_message* m, const std::string &method, bool mayBeUnknown) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message* reply = nullptr;
+    tulog.debug("Calling snapperd method ", method, "...");
+    int rc = sd_bus_call(bus, m, 0, &error, &reply);
+    sd_bus_message_unref(m);
+    if (rc < 0) {
+        std::string msg = "snapperd method " + method + " failed: " + (error.message ? error.message : strerror(-rc));
+        bool unknown = sd_bus_error_has_name(&error, "org.freedesktop.DBus.Error.UnknownMethod");
+        sd_bus_error_free(&error);
+        if (mayBeUnknown && unknown)
+            throw UnknownMethodException{msg};
+        throw std::runtime_error{msg};
+    }
+    sd_bus_error_free(&error);
+    return reply;
+}
+
+static uint32_t toNumber(const std::string &id) {
+    try {
+        return std::stoul(id);
+    } catch (const std::exception &e) {
+        throw std::invalid_argument{"Invalid snapshot number '" + id + "'."};
+    }
+}
+
+uint32_t SnapperDbus::getNumber() {
+    return toNumber(snapshotId);
+}
+
+SnapperDbus::SnapshotData SnapperDbus::getSnapshotData() {
+    sd_bus_message* m = newMethodCall("GetSnapshot");
+    int rc = sd_bus_message_append(m, "u", getNumber());
+    if (rc < 0) {
+        sd_bus_message_unref(m);
+        throw std::runtime_error{"Creating D-Bus call GetSnapshot failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message* reply = call(m, "GetSnapshot");
+
+    SnapshotData data;
+    const char* description;
+    const char* cleanup;
+    // (number, type, pre number, date, uid, description, cleanup, userdata)
+    rc = sd_bus_message_enter_container(reply, 'r', "uquxussa{ss}");
+    if (rc >= 0)
+        rc = sd_bus_message_skip(reply, "uquxu");
+    if (rc >= 0)
+        rc = sd_bus_message_read(reply, "ss", &description, &cleanup);
+    if (rc >= 0) {
+        data.description = description;
+        data.cleanup = cleanup;
+        rc = sd_bus_message_enter_container(reply, 'a', "{ss}");
+    }
+    while (rc >= 0) {
+        const char* key;
+        const char* value;
+        if ((rc = sd_bus_message_read(reply, "{ss}", &key, &value)) <= 0)
+            break;
+        data.userdata[key] = value;
+    }
+    if (rc >= 0)
+        rc = sd_bus_message_exit_container(reply);
+    if (rc >= 0)
+        rc = sd_bus_message_exit_container(reply);
+    sd_bus_message_unref(reply);
+    if (rc < 0)
+        throw std::runtime_error{"Parsing snapperd data of snapshot " + snapshotId + " failed: " + std::string(strerror(-rc))};
+    return data;
+}
+
+std::unique_ptr<Snapshot> SnapperDbus::create(std::string base) {
+    if (! std::filesystem::exists("/.snapshots/" + base + "/snapshot"))
+        throw std::invalid_argument{"Base snapshot '" + base + "' does not exist."};
+
+    uint32_t parent;
+    try {
+        parent = std::stoul(base);
+    } catch (const std::exception &e) {
+        throw std::invalid_argument{"Invalid base snapshot '" + base + "'."};
+    }
+    std::string description = "Snapshot Update of #" + base;
+
+    sd_bus_message* m = newMethodCall("CreateSingleSnapshotV2");
+    int rc = sd_bus_message_append(m, "ubss", parent, 0, description.c_str(), "");
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(m, 'a', "{ss}");
+    if (rc >= 0)
+        rc = sd_bus_message_append(m, "{ss}", inProgressKey, "yes");
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    if (rc < 0) {
+        sd_bus_message_unref(m);
+        throw std::runtime_error{"Creating D-Bus call CreateSingleSnapshotV2 failed: " + std::string(strerror(-rc))};
+    }
+
+    sd_bus_message* reply;
+    try {
+        reply = call(m, "CreateSingleSnapshotV2", true);
+    } catch (const UnknownMethodException &e) {
+        tulog.debug(e.what(), " - falling back to snapper command line tool");
+        std::unique_ptr<Snapshot> snap = Snapper::create(base);
+        return std::make_unique<SnapperDbus>(snap->getUid(), index);
+    }
+    uint32_t number;
+    rc = sd_bus_message_read(reply, "u", &number);
+    sd_bus_message_unref(reply);
+    if (rc < 0)
+        throw std::runtime_error{"Reading new snapshot number failed: " + std::string(strerror(-rc))};
+    snapshotId = std::to_string(number);
+    invalidateIndex();
+    return std::make_unique<SnapperDbus>(snapshotId, index);
+}
+
+std::unique_ptr<Snapshot> SnapperDbus::open(std::string id) {
+    snapshotId = id;
+    if (! std::filesystem::exists(getRoot()))
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    return std::make_unique<SnapperDbus>(snapshotId, index);
+}
+
+void SnapperDbus::setSnapshotData(const SnapshotData &data) {
+    sd_bus_message* m = newMethodCall("SetSnapshot");
+    int rc = sd_bus_message_append(m, "uss", getNumber(), data.description.c_str(), data.cleanup.c_str());
+    if (rc >= 0)
+        rc = sd_bus_message_open_container(m, 'a', "{ss}");
+    for (auto it = data.userdata.begin(); rc >= 0 && it != data.userdata.end(); ++it)
+        rc = sd_bus_message_append(m, "{ss}", it->first.c_str(), it->second.c_str());
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    if (rc < 0) {
+        sd_bus_message_unref(m);
+        throw std::runtime_error{"Creating D-Bus call SetSnapshot failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message_unref(call(m, "SetSnapshot"));
+    invalidateIndex();
+}
+
+void SnapperDbus::close() {
+    SnapshotData data = getSnapshotData();
+    data.userdata.erase(inProgressKey);
+    setSnapshotData(data);
+}
+
+void SnapperDbus::abort() {
+    sd_bus_message* m = newMethodCall("DeleteSnapshots");
+    int rc = sd_bus_message_append(m, "au", 1, getNumber());
+    if (rc < 0) {
+        sd_bus_message_unref(m);
+        throw std::runtime_error{"Creating D-Bus call DeleteSnapshots failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message_unref(call(m, "DeleteSnapshots"));
+    invalidateIndex();
+}
+
+// All snapshots are deleted by a single call; snapperd doesn't wait for btrfs to
+// commit the deletion
+void SnapperDbus::remove(const std::vector<std::string> &ids) {
+    if (ids.empty())
+        return;
+    sd_bus_message* m = newMethodCall("DeleteSnapshots");
+    int rc = sd_bus_message_open_container(m, 'a', "u");
+    try {
+        for (auto it = ids.begin(); rc >= 0 && it != ids.end(); ++it)
+            rc = sd_bus_message_append(m, "u", toNumber(*it));
+    } catch (...) {
+        sd_bus_message_unref(m);
+        throw;
+    }
+    if (rc >= 0)
+        rc = sd_bus_message_close_container(m);
+    if (rc < 0) {
+        sd_bus_message_unref(m);
+        throw std::runtime_error{"Creating D-Bus call DeleteSnapshots failed: " + std::string(strerror(-rc))};
+    }
+    sd_bus_message_unref(call(m, "DeleteSnapshots"));
+    invalidateIndex();
+}
+
+// snapperd can only modify one snapshot per call, but at least no process has to
+// be spawned for each of them
+void SnapperDbus::modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) {
+    for (auto &id : ids) {
+        SnapperDbus snap{id, index};
+        SnapshotData data = snap.getSnapshotData();
+        data.cleanup = cleanup;
+        for (auto &[key, value] : userdata) {
+            data.userdata[key] = value;
+        }
+        snap.setSnapshotData(data);
+    }
+}
+
+// GetActiveSnapshot / GetDefaultSnapshot return (valid, number)
+std::string SnapperDbus::callSnapshotQuery(const std::string &method) {
+    sd_bus_message* reply = call(newMethodCall(method), method, true);
+    int valid = 0;
+    uint32_t number = 0;
+    int rc = sd_bus_message_read(reply, "bu", &valid, &number);
+    sd_bus_message_unref(reply);
+    if (rc < 0)
+        throw std::runtime_error{"Reading reply of snapperd method " + method + " failed: " + std::string(strerror(-rc))};
+    return valid ? std::to_string(number) : "";
+}
+
+SnapshotIndex SnapperDbus::readIndex() {
+    std::string active, defaultSnap;
+    try {
+        active = callSnapshotQuery("GetActiveSnapshot");
+        defaultSnap = callSnapshotQuery("GetDefaultSnapshot");
+    } catch (const UnknownMethodException &e) {
+        tulog.debug(e.what(), " - falling back to snapper command line tool");
+        return Snapper::readIndex();
+    }
+
+    sd_bus_message* reply = call(newMethodCall("ListSnapshots"), "ListSnapshots");
+    SnapshotIndex snapshots;
+    // Array of (number, type, pre number, date, uid, description, cleanup, userdata)
+    int rc = sd_bus_message_enter_container(reply, 'a', "(uquxussa{ss})");
+    while (rc >= 0) {
+        if ((rc = sd_bus_message_enter_container(reply, 'r', "uquxussa{ss}")) <= 0)
+            break;
+        uint32_t number;
+        const char* description;
+        const char* cleanup;
+        SnapshotInfo info;
+        if ((rc = sd_bus_message_read(reply, "u", &number)) < 0)
+            break;
+        if ((rc = sd_bus_message_skip(reply, "quxu")) < 0)
+            break;
+        if ((rc = sd_bus_message_read(reply, "ss", &description, &cleanup)) < 0)
+            break;
+        info.description = description;
+        info.cleanup = cleanup;
+        if ((rc = sd_bus_message_enter_container(reply, 'a', "{ss}")) < 0)
+            break;
+        const char* key;
+        const char* value;
+        while ((rc = sd_bus_message_read(reply, "{ss}", &key, &value)) > 0)
+            info.userdata[key] = value;
+        if (rc < 0 || (rc = sd_bus_message_exit_container(reply)) < 0 || (rc = sd_bus_message_exit_container(reply)) < 0)
+            break;
+
+        std::string id = std::to_string(number);
+        auto inProgress = info.userdata.find(inProgressKey);
+        info.inProgress = inProgress != info.userdata.end() && inProgress->second == "yes";
+        info.active = id == active;
+        info.isDefault = id == defaultSnap;
+        snapshots[id] = info;
+    }
+    if (rc >= 0)
+        rc = sd_bus_message_exit_container(reply);
+    sd_bus_message_unref(reply);
+    if (rc < 0)
+        throw std::runtime_error{"Parsing snapperd snapshot list failed: " + std::string(strerror(-rc))};
+    return snapshots;
+}
+
+} // namespace TransactionalUpdate
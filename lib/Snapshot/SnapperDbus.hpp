@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Snapper backend talking to snapperd via D-Bus directly instead of calling
+  the snapper command line tool; everything not handled by snapperd itself
+  is inherited from the command line backend
+ */
+
+#ifndef T_U_SNAPPERDBUS_H
+#define T_U_SNAPPERDBUS_H
+
+#include "Snapper.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+typedef struct sd_bus sd_bus;
+typedef struct sd_bus_message sd_bus_message;
+
+namespace TransactionalUpdate {
+
+class SnapperDbus: public Snapper {
+public:
+    ~SnapperDbus();
+    static bool isAvailable();
+
+    // Snapshot
+    SnapperDbus(std::string snap, SnapshotIndexCache index);
+    void close() override;
+    void abort() override;
+
+    // SnapshotManager
+    SnapperDbus();
+    std::unique_ptr<Snapshot> create(std::string base) override;
+    std::unique_ptr<Snapshot> open(std::string id) override;
+    void remove(const std::vector<std::string> &ids) override;
+    void modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) override;
+protected:
+    SnapshotIndex readIndex() override;
+private:
+    struct SnapshotData {
+        std::string description;
+        std::string cleanup;
+        std::map<std::string, std::string> userdata;
+    };
+    sd_bus_message* newMethodCall(const std::string &method);
+    sd_bus_message* call(sd_bus_message* m, const std::string &method, bool mayBeUnknown = false);
+    std::string callSnapshotQuery(const std::string &method);
+    SnapshotData getSnapshotData();
+    void setSnapshotData(const SnapshotData &data);
+    uint32_t getNumber();
+    sd_bus* bus = nullptr;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SNAPPERDBUS_H
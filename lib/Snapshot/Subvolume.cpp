@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Snapshot backend working on plain btrfs subvolumes without snapper
+ */
+
+#include "Subvolume.hpp"
+#include "Btrfs.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <sys/stat.h>
+
+namespace TransactionalUpdate {
+
+static const std::string inProgressKey = "transactional-update-in-progress";
+
+static bool isSnapshotId(const std::string &name) {
+    return !name.empty() && name.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// Replace the file atomically, so readers never see partial contents
+static void writeFile(const std::filesystem::path &file, const std::string &contents) {
+    std::filesystem::path tmp = file.string() + ".tmp";
+    std::ofstream output(tmp);
+    output << contents;
+    output.close();
+    if (!output)
+        throw std::runtime_error{"Writing " + tmp.string() + " failed."};
+    if (rename(tmp.c_str(), file.c_str()) != 0)
+        throw std::runtime_error{"Renaming " + tmp.string() + " failed: " + std::string(strerror(errno))};
+}
+
+static std::string readFile(const std::filesystem::path &file) {
+    std::ifstream input(file);
+    std::string contents;
+    if (!input || !getline(input, contents))
+        throw std::runtime_error{"Reading " + file.string() + " failed."};
+    Util::trim(contents);
+    return contents;
+}
+
+Subvolume::Subvolume(): Snapshot(""), dir{config.get("SUBVOLUME_DIR")} {
+}
+
+std::unique_ptr<Snapshot> Subvolume::create(std::string base) {
+    std::filesystem::path baseRoot = dir / base / "snapshot";
+    if (!isSnapshotId(base) || !std::filesystem::exists(baseRoot))
+        throw std::invalid_argument{"Base snapshot '" + base + "' does not exist."};
+
+    // Creating the directory reserves the ID; retry if another instance was faster
+    unsigned long next = 1;
+    for (auto &[id, info] : list()) {
+        next = std::max(next, std::stoul(id) + 1);
+    }
+    while (mkdir((dir / std::to_string(next)).c_str(), 0755) != 0) {
+        if (errno != EEXIST)
+            throw std::runtime_error{"Creating snapshot directory in " + dir.string() + " failed: " + std::string(strerror(errno))};
+        next++;
+    }
+    std::string id = std::to_string(next);
+    try {
+        writeInfo(id, {{"description", "Snapshot Update of #" + base}, {inProgressKey, "yes"}});
+        Btrfs::createSnapshot(baseRoot, dir / id / "snapshot");
+    } catch (...) {
+        std::filesystem::remove_all(dir / id);
+        throw;
+    }
+    tulog.debug("Created subvolume snapshot ", id, " of ", base, ".");
+    return std::make_unique<Subvolume>(id, dir);
+}
+
+std::unique_ptr<Snapshot> Subvolume::open(std::string id) {
+    if (!isSnapshotId(id) || !std::filesystem::exists(dir / id / "snapshot"))
+        throw std::invalid_argument{"Snapshot " + id + " does not exist."};
+    return std::make_unique<Subvolume>(id, dir);
+}
+
+void Subvolume::close() {
+    std::map<std::string, std::string> info = readInfo(snapshotId);
+    info.erase(inProgressKey);
+    writeInfo(snapshotId, info);
+}
+
+void Subvolume::abort() {
+    Btrfs::deleteSubvolume(getRoot());
+    std::filesystem::remove_all(dir / snapshotId);
+}
+
+std::filesystem::path Subvolume::getRoot() {
+    return dir / snapshotId / "snapshot";
+}
+
+bool Subvolume::isInProgress() {
+    std::map<std::string, std::string> info = readInfo(snapshotId);
+    auto inProgress = info.find(inProgressKey);
+    return inProgress != info.end() && inProgress->second == "yes";
+}
+
+bool Subvolume::isReadOnly() {
+    return Btrfs::isReadOnly(getRoot());
+}
+
+void Subvolume::setDefault() {
+    Btrfs::setDefault(getRoot());
+    writeFile(dir / "default", snapshotId + "\n");
+}
+
+void Subvolume::setReadOnly(bool readonly) {
+    Btrfs::setReadOnly(getRoot(), readonly);
+}
+
+// The running system is only one of the snapshots if the root file system
+// is part of the same btrfs file system; otherwise (e.g. for a loopback image)
+// the default snapshot is used
+std::string Subvolume::getCurrent() {
+    try {
+        if (Btrfs::isBtrfs("/")) {
+            uint64_t root = Btrfs::getSubvolumeId("/");
+            struct stat rootSt, dirSt;
+            if (stat("/", &rootSt) == 0 && stat(dir.c_str(), &dirSt) == 0 && rootSt.st_dev == dirSt.st_dev) {
+                for (auto &[id, info] : list()) {
+                    if (Btrfs::getSubvolumeId(dir / id / "snapshot") == root)
+                        return id;
+                }
+            }
+        }
+    } catch (const std::exception &e) {
+        tulog.debug("Couldn't determine current subvolume: ", e.what());
+    }
+    return getDefault();
+}
+
+std::string Subvolume::getDefault() {
+    return readFile(dir / "default");
+}
+
+SnapshotIndex Subvolume::list() {
+    SnapshotIndex snapshots;
+    std::string defaultId;
+    if (std::filesystem::exists(dir / "default"))
+        defaultId = getDefault();
+    for (auto &entry : std::filesystem::directory_iterator(dir)) {
+        std::string id = entry.path().filename();
+        if (!isSnapshotId(id) || !std::filesystem::exists(entry.path() / "snapshot"))
+            continue;
+        SnapshotInfo info;
+        info.userdata = readInfo(id);
+        info.description = info.userdata["description"];
+        info.cleanup = info.userdata["cleanup"];
+        info.userdata.erase("description");
+        info.userdata.erase("cleanup");
+        auto inProgress = info.userdata.find(inProgressKey);
+        info.inProgress = inProgress != info.userdata.end() && inProgress->second == "yes";
+        info.isDefault = id == defaultId;
+        snapshots[id] = info;
+    }
+    return snapshots;
+}
+
+// Deleting a subvolume only unlinks it, the space is reclaimed by the btrfs
+// cleaner thread in the background
+void Subvolume::remove(const std::vector<std::string> &ids) {
+    for (auto &id : ids) {
+        open(id)->abort();
+    }
+}
+
+void Subvolume::modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) {
+    for (auto &id : ids) {
+        std::map<std::string, std::string> info = readInfo(id);
+        info["cleanup"] = cleanup;
+        for (auto &[key, value] : userdata) {
+            info[key] = value;
+        }
+        writeInfo(id, info);
+    }
+}
+
+std::map<std::string, std::string> Subvolume::readInfo(const std::string &id) {
+    std::map<std::string, std::string> info;
+    std::ifstream input(dir / id / "info");
+    std::string line;
+    while (getline(input, line)) {
+        size_t pos = line.find('=');
+        if (pos == std::string::npos)
+            continue;
+        info[line.substr(0, pos)] = line.substr(pos + 1);
+    }
+    return info;
+}
+
+void Subvolume::writeInfo(const std::string &id, const std::map<std::string, std::string> &info) {
+    std::string contents;
+    for (auto &[key, value] : info) {
+        contents += key + "=" + value + "\n";
+    }
+    writeFile(dir / id / "info", contents);
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Snapshot backend working on plain btrfs subvolumes without snapper, e.g. for
+  benchmarks on a loopback image; snapshots use snapper's layout
+  (<SUBVOLUME_DIR>/<ID>/snapshot), metadata is kept in an "info" file next to
+  each snapshot and the default snapshot's ID in <SUBVOLUME_DIR>/default.
+ */
+
+#ifndef T_U_SUBVOLUME_H
+#define T_U_SUBVOLUME_H
+
+#include "SnapshotManager.hpp"
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class Subvolume: public SnapshotManager, public Snapshot {
+public:
+    ~Subvolume() = default;
+
+    // Snapshot
+    Subvolume(std::string snap, std::filesystem::path dir): Snapshot(snap), dir{std::move(dir)} {};
+    void close() override;
+    void abort() override;
+    std::filesystem::path getRoot() override;
+    bool isInProgress() override;
+    bool isReadOnly() override;
+    void setDefault() override;
+    void setReadOnly(bool readonly) override;
+
+    // SnapshotManager
+    Subvolume();
+    std::unique_ptr<Snapshot> create(std::string base) override;
+    std::unique_ptr<Snapshot> open(std::string id) override;
+    std::string getCurrent() override;
+    std::string getDefault() override;
+    SnapshotIndex list() override;
+    void remove(const std::vector<std::string> &ids) override;
+    void modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) override;
+private:
+    std::map<std::string, std::string> readInfo(const std::string &id);
+    void writeInfo(const std::string &id, const std::map<std::string, std::string> &info);
+    std::filesystem::path dir;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SUBVOLUME_H
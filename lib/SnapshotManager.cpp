@@ -6,14 +6,25 @@
   implementations can be found in the "Snapshot" directory
  */
 
+#include "Configuration.hpp"
 #include "Snapshot/Snapper.hpp"
+#include "Snapshot/SnapperDbus.hpp"
+#include "Snapshot/Subvolume.hpp"
 using namespace std;
 
 namespace TransactionalUpdate {
 
-// TODO: Make configurable to be able to force a certain implementation
 unique_ptr<SnapshotManager> SnapshotFactory::get() {
+    string manager = config.get("SNAPSHOT_MANAGER");
+    if (manager == "subvolume")
+        return make_unique<Subvolume>();
+    if (manager != "auto" && manager != "snapper")
+        throw invalid_argument{"Invalid SNAPSHOT_MANAGER '" + manager + "'."};
     if (filesystem::exists("/usr/bin/snapper")) {
+        // Prefer talking to snapperd directly; the command line tool remains as a fallback
+        // for environments without a (working) system bus
+        if (SnapperDbus::isAvailable())
+            return make_unique<SnapperDbus>();
         return make_unique<Snapper>();
     } else {
         throw runtime_error{"No supported environment found."};
@@ -13,10 +13,25 @@
 #define T_U_SNAPSHOTMANAGER_H
 
 #include <Snapshot.hpp>
+#include <map>
 #include <string>
+#include <vector>
 
 namespace TransactionalUpdate {
 
+struct SnapshotInfo {
+    bool active = false;
+    bool isDefault = false;
+    bool inProgress = false;
+    std::string description;
+    // Cleanup algorithm of the snapshot, empty if it is kept forever
+    std::string cleanup;
+    std::map<std::string, std::string> userdata;
+};
+
+// Snapshot metadata, indexed by snapshot ID
+using SnapshotIndex = std::map<std::string, SnapshotInfo>;
+
 class SnapshotManager
 {
 public:
@@ -26,6 +41,11 @@ public:
     virtual std::unique_ptr<Snapshot> open(std::string id) = 0;
     virtual std::string getCurrent() = 0;
     virtual std::string getDefault() = 0;
+    virtual SnapshotIndex list() = 0;
+    // Batch operations on several snapshots at once; the given userdata is
+    // added to the existing userdata
+    virtual void remove(const std::vector<std::string> &ids) = 0;
+    virtual void modify(const std::vector<std::string> &ids, const std::string &cleanup, const std::map<std::string, std::string> &userdata) = 0;
 };
 
 class SnapshotFactory {
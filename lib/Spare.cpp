@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Spare snapshot which is prepared in advance
+ */
+
+#include "Spare.hpp"
+#include "Configuration.hpp"
+#include "Log.hpp"
+#include "Mount.hpp"
+#include "Overlay.hpp"
+#include <fstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace TransactionalUpdate {
+
+static const std::string flagFile = "spareSnapshot";
+
+bool Spare::isEnabled() {
+    return config.get("SPARE_SNAPSHOT") == "yes";
+}
+
+bool Spare::isSpare(Snapshot &snapshot) {
+    return fs::exists(snapshot.getRoot() / flagFile);
+}
+
+void Spare::mark(Snapshot &snapshot, const std::string &base) {
+    std::ofstream flag(snapshot.getRoot() / flagFile);
+    flag << base << "\n" << fingerprint(base) << "\n";
+    flag.close();
+    if (!flag)
+        throw std::runtime_error{"Writing " + (snapshot.getRoot() / flagFile).string() + " failed."};
+}
+
+std::unique_ptr<Snapshot> Spare::claim(SnapshotManager &mgr, const std::string &base, std::unique_ptr<Lock> &lock) {
+    for (auto &[id, info] : mgr.list()) {
+        if (!info.inProgress)
+            continue;
+        std::unique_ptr<Snapshot> snapshot = mgr.open(id);
+        fs::path flag = snapshot->getRoot() / flagFile;
+        if (!fs::exists(flag))
+            continue;
+
+        // Spares which are still being prepared or claimed by another instance are locked
+        std::unique_ptr<Lock> snapshotLock;
+        try {
+            snapshotLock = std::make_unique<Lock>(Lock::getSnapshot(id), Lock::Mode::Exclusive, false);
+        } catch (const std::runtime_error &e) {
+            continue;
+        }
+        std::ifstream input(flag);
+        std::string spareBase, spareFingerprint;
+        if (!std::getline(input, spareBase) || !std::getline(input, spareFingerprint))
+            continue;
+        input.close();
+
+        if (spareBase == base && spareFingerprint == fingerprint(base)) {
+            fs::remove(flag);
+            tulog.info("Using spare snapshot ", id, ".");
+            lock = std::move(snapshotLock);
+            return snapshot;
+        }
+        tulog.info("Discarding outdated spare snapshot ", id, ".");
+        snapshot->abort();
+        snapshotLock->removeOnRelease();
+    }
+    return nullptr;
+}
+
+void Spare::discard(SnapshotManager &mgr) {
+    for (auto &[id, info] : mgr.list()) {
+        if (!info.inProgress)
+            continue;
+        std::unique_ptr<Snapshot> snapshot = mgr.open(id);
+        if (!isSpare(*snapshot))
+            continue;
+        try {
+            Lock snapshotLock{Lock::getSnapshot(id), Lock::Mode::Exclusive, false};
+            tulog.info("Discarding spare snapshot ", id, ".");
+            snapshot->abort();
+            snapshotLock.removeOnRelease();
+        } catch (const std::runtime_error &e) {
+            tulog.debug("Not discarding spare snapshot ", id, ": ", e.what());
+        }
+    }
+}
+
+// The spare's /etc was assembled from the upper directories of the base's
+// overlay stack (which may still be modified in the running system), so any
+// change there makes the spare outdated. The upper directories only contain
+// modified files, so walking them is cheap.
+std::string Spare::fingerprint(const std::string &base) {
+    Mount mntEtc{"/etc"};
+    if (!mntEtc.isMount() || mntEtc.getFilesystem() != "overlay")
+        return "-";
+
+    Overlay overlay{base};
+    std::vector<fs::path> layers = overlay.lowerdirs;
+    layers.insert(layers.begin(), overlay.upperdir);
+    fs::path overlayDir = config.get("OVERLAY_DIR");
+
+    unsigned long entries = 0;
+    struct timespec latest = {0, 0};
+    auto account = [&](const fs::path &path) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+            return;
+        entries++;
+        if (st.st_ctim.tv_sec > latest.tv_sec || (st.st_ctim.tv_sec == latest.tv_sec && st.st_ctim.tv_nsec > latest.tv_nsec))
+            latest = st.st_ctim;
+    };
+    for (auto &layer : layers) {
+        if (layer.string().compare(0, overlayDir.string().length(), overlayDir.string()) != 0 || !fs::is_directory(layer))
+            continue;
+        account(layer);
+        for (auto &entry : fs::recursive_directory_iterator(layer, fs::directory_options::skip_permission_denied)) {
+            account(entry.path());
+        }
+    }
+    return std::to_string(entries) + ":" + std::to_string(latest.tv_sec) + "." + std::to_string(latest.tv_nsec);
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Spare snapshot which is prepared in advance (snapshot and /etc overlay), so
+  opening a new transaction based on the default snapshot only has to claim it.
+ */
+
+#ifndef T_U_SPARE_H
+#define T_U_SPARE_H
+
+#include "Lock.hpp"
+#include "Snapshot.hpp"
+#include "SnapshotManager.hpp"
+#include <memory>
+#include <string>
+
+namespace TransactionalUpdate {
+
+struct Spare {
+    // SPARE_SNAPSHOT in tukit.conf
+    static bool isEnabled();
+    static bool isSpare(Snapshot &snapshot);
+    // Flag a prepared snapshot as spare for transactions based on base
+    static void mark(Snapshot &snapshot, const std::string &base);
+    // Take the spare for base if it is still up to date, discarding outdated spares;
+    // returns nullptr if there is no usable spare, otherwise lock holds the snapshot's lock
+    static std::unique_ptr<Snapshot> claim(SnapshotManager &mgr, const std::string &base, std::unique_ptr<Lock> &lock);
+    // Delete all spares which aren't in use
+    static void discard(SnapshotManager &mgr);
+private:
+    // State of the /etc overlay layers the spare was created from
+    static std::string fingerprint(const std::string &base);
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_SPARE_H
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Timing and counters of the phases of a transaction
+ */
+
+#include "Stats.hpp"
+#include "Lock.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+static double toSeconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+TUStats::Timer::Timer(std::string phase)
+    : phase{std::move(phase)}, start{std::chrono::steady_clock::now()}
+{
+}
+
+TUStats::Timer::~Timer() {
+    tustats.addTime(phase, std::chrono::steady_clock::now() - start);
+}
+
+void TUStats::addTime(const std::string &phase, std::chrono::steady_clock::duration duration) {
+    Phase &p = phases[phase];
+    p.time += duration;
+    p.calls++;
+}
+
+void TUStats::count(const std::string &counter, unsigned long long value) {
+    counters[counter] += value;
+}
+
+void TUStats::reset() {
+    phases.clear();
+    counters.clear();
+}
+
+const std::map<std::string, TUStats::Phase>& TUStats::getPhases() const {
+    return phases;
+}
+
+const std::map<std::string, unsigned long long>& TUStats::getCounters() const {
+    return counters;
+}
+
+// Phase and counter names are identifiers, so they don't need escaping
+std::string TUStats::toJson() const {
+    std::ostringstream json;
+    json << "{\"phases\":{";
+    for (auto it = phases.begin(); it != phases.end(); it++) {
+        if (it != phases.begin())
+            json << ",";
+        json << "\"" << it->first << "\":{\"seconds\":" << toSeconds(it->second.time)
+             << ",\"calls\":" << it->second.calls << "}";
+    }
+    json << "},\"counters\":{";
+    for (auto it = counters.begin(); it != counters.end(); it++) {
+        if (it != counters.begin())
+            json << ",";
+        json << "\"" << it->first << "\":" << it->second;
+    }
+    json << "}}";
+    return json.str();
+}
+
+// Samples of other commands are taken over from the existing file, so the file
+// contains the last run of each command; concurrent tukit instances are
+// serialized with a lock file next to it.
+void TUStats::writeTextfile(const std::filesystem::path &file, const std::string &command) const {
+    static const std::vector<std::pair<std::string, std::string>> metrics = {
+        {"tukit_phase_seconds", "Time spent in each phase of the last run of each tukit command."},
+        {"tukit_phase_calls", "Number of times each phase was run in the last run of each tukit command."},
+        {"tukit_counter", "Counters of the last run of each tukit command."},
+        {"tukit_last_run_timestamp_seconds", "Time of the last run of each tukit command."}
+    };
+    std::string labels = "command=\"" + command + "\"";
+    std::map<std::string, std::vector<std::string>> samples;
+    for (auto &[name, phase] : phases) {
+        std::ostringstream line;
+        line << "tukit_phase_seconds{" << labels << ",phase=\"" << name << "\"} " << toSeconds(phase.time);
+        samples["tukit_phase_seconds"].push_back(line.str());
+        samples["tukit_phase_calls"].push_back("tukit_phase_calls{" + labels + ",phase=\"" + name + "\"} " + std::to_string(phase.calls));
+    }
+    for (auto &[name, value] : counters) {
+        samples["tukit_counter"].push_back("tukit_counter{" + labels + ",counter=\"" + name + "\"} " + std::to_string(value));
+    }
+    samples["tukit_last_run_timestamp_seconds"].push_back("tukit_last_run_timestamp_seconds{" + labels + "} " + std::to_string(std::time(nullptr)));
+
+    Lock lock{file.string() + ".lock", Lock::Mode::Exclusive};
+    std::ifstream input(file);
+    std::string line;
+    while (std::getline(input, line)) {
+        size_t end = line.find('{');
+        if (line.empty() || line[0] == '#' || end == std::string::npos)
+            continue;
+        std::string name = line.substr(0, end);
+        // Samples of unknown metrics and of this command's previous run are dropped
+        if (std::none_of(metrics.begin(), metrics.end(), [&](const auto &metric) { return metric.first == name; }))
+            continue;
+        if (line.compare(end + 1, labels.size() + 1, labels + ",") == 0 || line.compare(end + 1, labels.size() + 1, labels + "}") == 0)
+            continue;
+        samples[name].push_back(line);
+    }
+    input.close();
+
+    std::ostringstream out;
+    for (auto &[name, help] : metrics) {
+        out << "# HELP " << name << " " << help << "\n";
+        out << "# TYPE " << name << " gauge\n";
+        for (auto &sample : samples[name]) {
+            out << sample << "\n";
+        }
+    }
+
+    // The collector must never see a partially written file
+    std::string tmp = file.string() + ".XXXXXX";
+    int fd = mkstemp(tmp.data());
+    if (fd < 0)
+        throw std::runtime_error{"Creating a temporary file for " + file.string() + " failed: " + std::string(strerror(errno))};
+    std::string data = out.str();
+    bool ok = fchmod(fd, 0644) == 0;
+    for (size_t written = 0; ok && written < data.size();) {
+        ssize_t ret = write(fd, data.data() + written, data.size() - written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        ok = ret > 0;
+        written += ok ? ret : 0;
+    }
+    int err = errno;
+    if (close(fd) != 0 && ok) {
+        ok = false;
+        err = errno;
+    }
+    if (!ok) {
+        unlink(tmp.c_str());
+        throw std::runtime_error{"Writing " + tmp + " failed: " + std::string(strerror(err))};
+    }
+    if (rename(tmp.c_str(), file.c_str()) != 0) {
+        err = errno;
+        unlink(tmp.c_str());
+        throw std::runtime_error{"Renaming " + tmp + " failed: " + std::string(strerror(err))};
+    }
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Timing and counters of the phases of a transaction; collected per thread,
+  so concurrent transactions in different threads don't mix up their numbers
+ */
+
+#ifndef T_U_STATS_H
+#define T_U_STATS_H
+
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <string>
+
+namespace TransactionalUpdate {
+
+class TUStats {
+public:
+    // Measures the time until the end of the scope
+    class Timer {
+    public:
+        Timer(std::string phase);
+        ~Timer();
+        Timer(const Timer&) = delete;
+        void operator=(const Timer&) = delete;
+    private:
+        std::string phase;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    struct Phase {
+        std::chrono::steady_clock::duration time{0};
+        unsigned long calls = 0;
+    };
+
+    void addTime(const std::string &phase, std::chrono::steady_clock::duration duration);
+    void count(const std::string &counter, unsigned long long value = 1);
+    void reset();
+    const std::map<std::string, Phase>& getPhases() const;
+    const std::map<std::string, unsigned long long>& getCounters() const;
+    std::string toJson() const;
+    // Text file for the Prometheus node exporter's textfile collector
+    void writeTextfile(const std::filesystem::path &file, const std::string &command) const;
+private:
+    std::map<std::string, Phase> phases;
+    std::map<std::string, unsigned long long> counters;
+};
+
+inline thread_local TUStats tustats{};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_STATS_H
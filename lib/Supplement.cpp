@@ -8,13 +8,48 @@
 
 #include "Supplement.hpp"
 #include "Log.hpp"
+#include "TreeSync.hpp"
+#include <algorithm>
 #include <exception>
+#include <fstream>
+#include <linux/magic.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <sys/vfs.h>
 
 namespace TransactionalUpdate {
 
-Supplements::Supplements(fs::path snapshot):
-    snapshot{snapshot}
+// The manifest lists the paths relative to the snapshot root; it is kept
+// outside of the snapshot, so it is neither visible to the commands nor part
+// of the snapshot's contents
+Supplements::Supplements(fs::path snapshot, fs::path manifest):
+    snapshot{snapshot}, manifest{manifest}
 {
+    std::ifstream input{manifest};
+    std::string line;
+    while (std::getline(input, line)) {
+        if (! line.empty())
+            supplementalFiles.push_back(snapshot / line);
+    }
+}
+
+// Files on tmpfs (e.g. below /run) are gone as soon as the transaction's mounts
+// are unmounted, so there's no need to remember or remove them
+bool Supplements::isEphemeral(fs::path file) {
+    struct statfs sfs;
+    if (statfs(file.parent_path().c_str(), &sfs) != 0)
+        return false;
+    return sfs.f_type == TMPFS_MAGIC;
+}
+
+bool Supplements::isRecorded(fs::path file) {
+    return std::find(supplementalFiles.begin(), supplementalFiles.end(), file) != supplementalFiles.end();
+}
+
+void Supplements::record(fs::path file) {
+    if (isEphemeral(file) || isRecorded(file))
+        return;
+    supplementalFiles.push_back(std::move(file));
 }
 
 // Creates temporary directories that do not exist in the chroot environment and makes sure
@@ -25,7 +60,7 @@ void Supplements::createDirs(fs::path dir) {
         stump /= component;
         if (! fs::exists(stump)) {
             fs::create_directories(stump);
-            supplementalFiles.push_back(std::move(stump));
+            record(std::move(stump));
             break;
         }
     }
@@ -39,13 +74,29 @@ void Supplements::addDir(fs::path dir) {
     }
 }
 
+// Data of regular files is reflinked if source and snapshot are on the same
+// file system; bind mounts are not used, as they would have to be repeated for
+// every command and prevent tools from replacing the file via rename.
+// Only recorded files are skipped if unchanged; targets on tmpfs, such as the
+// files below /run, are copied again for every invocation.
 void Supplements::addFile(fs::path file) {
     if (fs::exists(file)) {
-        auto copyOptions = fs::copy_options::overwrite_existing | fs::copy_options::recursive;
         createDirs(file.parent_path());
         fs::path target = snapshot / file.relative_path();
-        fs::copy(file, target, copyOptions);
-        supplementalFiles.push_back(std::move(target));
+        if (fs::is_directory(file)) {
+            TreeSync dirSync{file, target};
+            dirSync.run();
+        } else {
+            fs::path source = fs::canonical(file);
+            struct stat sst, tst;
+            // Unchanged since a previous invocation of a resumed transaction
+            if (isRecorded(target) && stat(source.c_str(), &sst) == 0 && lstat(target.c_str(), &tst) == 0
+                    && sst.st_size == tst.st_size && sst.st_mtim.tv_sec == tst.st_mtim.tv_sec
+                    && sst.st_mtim.tv_nsec == tst.st_mtim.tv_nsec)
+                return;
+            TreeSync::copyFile(source, target);
+        }
+        record(std::move(target));
     }
 }
 
@@ -58,10 +109,27 @@ void Supplements::addLink(fs::path source, fs::path target) {
         } else {
             fs::create_symlink(source, target);
         }
-        supplementalFiles.push_back(std::move(target));
+        record(std::move(target));
     }
 }
 
+// Keep the supplements of a transaction which will be resumed later, so they
+// don't have to be created again; as the manifest lives in SESSION_DIR, the
+// supplements of a transaction resumed after a reboot stay in the snapshot
+void Supplements::persist() {
+    if (supplementalFiles.empty()) {
+        fs::remove(manifest);
+        return;
+    }
+    fs::create_directories(manifest.parent_path());
+    std::ofstream output(manifest, std::ios::trunc);
+    for (auto& file: supplementalFiles) {
+        output << file.lexically_relative(snapshot).string() << std::endl;
+    }
+    if (! output)
+        throw std::runtime_error{"Writing supplement manifest " + manifest.string() + " failed."};
+}
+
 void Supplements::cleanup() {
     for (auto it = supplementalFiles.rbegin(); it != supplementalFiles.rend(); ++it) {
         try {
@@ -71,6 +139,12 @@ void Supplements::cleanup() {
             tulog.error("ERROR: Removing supplemental file failed: ", e.what());
         }
     }
+    supplementalFiles.clear();
+    try {
+        fs::remove(manifest);
+    }  catch (const std::exception &e) {
+        tulog.error("ERROR: Removing supplement manifest failed: ", e.what());
+    }
 }
 
 } // namespace TransactionalUpdate
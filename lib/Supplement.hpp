@@ -22,15 +22,21 @@ class Supplements
 public:
     Supplements() = default;
     virtual ~Supplements() = default;
-    Supplements(fs::path snapshot);
+    // Supplements surviving a `keep` are listed in manifest
+    Supplements(fs::path snapshot, fs::path manifest);
     void addDir(fs::path dir);
     void addFile(fs::path file);
     void addLink(fs::path source, fs::path target);
     void cleanup();
+    void persist();
 protected:
     fs::path snapshot;
+    fs::path manifest;
     std::vector<fs::path> supplementalFiles;
     void createDirs(fs::path dir);
+    bool isEphemeral(fs::path file);
+    bool isRecorded(fs::path file);
+    void record(fs::path file);
 };
 
 } // namespace TransactionalUpdate
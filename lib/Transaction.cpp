@@ -8,67 +8,160 @@
  */
 
 #include "Transaction.hpp"
+#include "Btrfs.hpp"
+#include "ChangeDetector.hpp"
 #include "Configuration.hpp"
+#include "Export.hpp"
+#include "Lock.hpp"
 #include "Log.hpp"
+#include "Manifest.hpp"
 #include "Mount.hpp"
+#include "MountTree.hpp"
 #include "Overlay.hpp"
 #include "SnapshotManager.hpp"
+#include "Spare.hpp"
+#include "Stats.hpp"
 #include "Supplement.hpp"
-#include "Util.hpp"
+#include "TreeSync.hpp"
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <fstream>
-#include <ftw.h>
-#include <limits.h>
-#include <poll.h>
+#include <functional>
+#include <future>
+#include <limits>
 #include <sched.h>
+#include <set>
 #include <signal.h>
-#include <sys/inotify.h>
+#include <spawn.h>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <utime.h>
 using namespace TransactionalUpdate;
 namespace fs = std::filesystem;
 
-static int inotifyFd;
-std::vector<std::filesystem::path> inotifyExcludes;
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+
+static int tu_pidfd_open(pid_t pid, unsigned int flags) {
+    return syscall(__NR_pidfd_open, pid, flags);
+}
+
+static int tu_pidfd_send_signal(int pidfd, int sig, siginfo_t *info, unsigned int flags) {
+    return syscall(__NR_pidfd_send_signal, pidfd, sig, info, flags);
+}
+
+// Time an application gets to terminate after SIGTERM when it exceeded its deadline
+static const int killGracePeriod = 10;
 
 class Transaction::impl {
 public:
+    ~impl();
     void addSupplements();
-    void mount();
-    int runCommand(char* argv[], bool inChroot, std::string* buffer);
-    static int inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb);
-    int inotifyRead();
+    void flush();
+    void createEtcOverlay(const std::string &base, std::unique_ptr<Overlay::PreparedSync> prepared = nullptr);
+    void startPrefetch();
+    // With terminate the prefetch isn't needed any more, e.g. because init() failed
+    void waitPrefetch(bool terminate = false);
+    void prepareSpare();
+    void mount(bool usePlan = false);
+    void planMounts();
+    bool loadMountPlan();
+    void saveMountPlan();
+    std::string getMountFingerprint();
+    fs::path getMountPlanFile();
+    fs::path getSupplementsFile();
+    void umount();
+    bool unmountAll();
+    void releaseMounts();
+    bool joinSession();
+    void pinSession();
+    void endSession();
+    void runInHostNamespace(const std::function<void()> &func);
+    fs::path getSessionFile();
+    pid_t startCommand(char* argv[], bool inChroot, int outfd, int errfd);
+    int runCommand(char* argv[], bool inChroot, const OutputCallback &callback, bool separateStreams);
+    int startAsync(char* argv[], bool inChroot);
+    void reapAsync();
+    void closePidFd();
     std::unique_ptr<SnapshotManager> snapshotMgr;
+    // Held as long as this instance works on the snapshot
+    std::unique_ptr<Lock> snapshotLock;
     std::unique_ptr<Snapshot> snapshot;
+    std::unique_ptr<ChangeDetector> changeDetector;
+    // Keep the parsed mount tables alive for all Mount instances of this transaction
+    std::shared_ptr<MountTableCache> mountTables = MountTableCache::get();
     std::vector<std::unique_ptr<Mount>> dirsToMount;
+    std::unique_ptr<MountTree> mountTree;
     Supplements supplements;
-    pid_t pidCmd;
+    pid_t pidCmd = 0;
+    // pidfd of pidCmd, -1 if not supported by the kernel
+    int pidFd = -1;
+    // PREFETCH_COMMAND running concurrently to init()
+    pid_t pidPrefetch = 0;
+    // Output of a command started with executeAsync() / callExtAsync()
+    int outputFd = -1;
+    std::chrono::steady_clock::time_point asyncStart;
+    // Deadline for commands in seconds, 0 for no deadline
+    unsigned int timeout = 0;
     bool discardIfNoChange = false;
+    // Mount namespace of the caller, needed to (un)pin session namespaces
+    int hostNs = -1;
+    bool inSession = false;
 };
 
+Transaction::impl::~impl() {
+    reapAsync();
+    waitPrefetch(true);
+    if (hostNs >= 0)
+        close(hostNs);
+}
+
 Transaction::Transaction() : pImpl{std::make_unique<impl>()} {
     tulog.debug("Constructor Transaction");
     if (getenv("TRANSACTIONAL_UPDATE") != NULL) {
         throw std::runtime_error{"Cannot open a new transaction from within a running transaction."};
     }
     pImpl->snapshotMgr = SnapshotFactory::get();
+    std::string timeout = config.get("COMMAND_TIMEOUT");
+    errno = 0;
+    unsigned long seconds = strtoul(timeout.c_str(), nullptr, 10);
+    if (timeout.empty() || timeout.find_first_not_of("0123456789") != std::string::npos
+            || errno == ERANGE || seconds > std::numeric_limits<unsigned int>::max())
+        throw std::invalid_argument{"Invalid COMMAND_TIMEOUT '" + timeout + "', expected a number of seconds."};
+    pImpl->timeout = seconds;
 }
 
 Transaction::~Transaction() {
     tulog.debug("Destructor Transaction");
 
-    if (inotifyFd != 0)
-        close(inotifyFd);
-
-    pImpl->dirsToMount.clear();
+    pImpl->reapAsync();
+    pImpl->changeDetector.reset();
+    pImpl->umount();
     try {
         if (isInitialized() && !getSnapshot().empty() && fs::exists(getRoot())) {
             tulog.info("Discarding snapshot ", pImpl->snapshot->getUid(), ".");
             pImpl->snapshot->abort();
+            fs::remove(pImpl->getMountPlanFile());
+            fs::remove(pImpl->getSupplementsFile());
+            if (pImpl->snapshotLock)
+                pImpl->snapshotLock->removeOnRelease();
         }
     }  catch (const std::exception &e) {
         tulog.error("ERROR: ", e.what());
@@ -87,17 +180,9 @@ fs::path Transaction::getRoot() {
     return pImpl->snapshot->getRoot();
 }
 
-void Transaction::impl::mount() {
-    if (unshare(CLONE_NEWNS) < 0) {
-        throw std::runtime_error{"Creating new mount namespace failed: " + std::string(strerror(errno))};
-    }
-
-    // GRUB needs to have an actual mount point for the root partition, so
-    // mount the snapshot directory on a temporary mount point
-    std::unique_ptr<BindMount> mntBind{new BindMount{snapshot->getRoot(), MS_UNBINDABLE}};
-    mntBind->setSource(snapshot->getRoot());
-    mntBind->mount();
-
+// Collect the file systems to mount into the snapshot from the running system
+void Transaction::impl::planMounts() {
+    TUStats::Timer timer{"mount-plan"};
     dirsToMount.push_back(std::make_unique<PropagatedBindMount>("/dev"));
     dirsToMount.push_back(std::make_unique<BindMount>("/var/log"));
 
@@ -160,7 +245,165 @@ void Transaction::impl::mount() {
         dirsToMount.push_back(std::make_unique<BindMount>("/boot/writable"));
 
     dirsToMount.push_back(std::make_unique<BindMount>("/.snapshots"));
+}
+
+fs::path Transaction::impl::getMountPlanFile() {
+    return getSessionFile().string() + ".mounts";
+}
+
+fs::path Transaction::impl::getSupplementsFile() {
+    return getSessionFile().string() + ".supplements";
+}
+
+// Stat data of every path planMounts() probes and the mount table it checks
+// them against; if anything changed the plan is made again
+std::string Transaction::impl::getMountFingerprint() {
+    const fs::path confDirs[] = {fs::path{PREFIX} / fs::path{CONFDIR}.relative_path(), fs::path{CONFDIR}};
+    std::vector<fs::path> files = {"/etc/fstab", snapshot->getRoot() / "etc" / "fstab", "/boot/grub2",
+                                   "/var/lib/zypp", "/var/lib/alternatives", "/var/lib/selinux"};
+    for (auto &dir: confDirs) {
+        files.push_back(dir / "tukit.conf");
+        files.push_back(dir / "tukit.conf.d");
+        std::error_code ec;
+        for (auto &entry: fs::directory_iterator(dir / "tukit.conf.d", ec))
+            files.push_back(entry.path());
+    }
+    std::string data;
+    for (auto &file: files) {
+        struct stat st;
+        data += file.string() + ":";
+        if (stat(file.c_str(), &st) == 0)
+            data += std::to_string(st.st_ino) + ":" + std::to_string(st.st_size) + ":"
+                    + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+        data += "\n";
+    }
+    // Mount and peer group IDs differ between mount namespaces, so only use the
+    // fields from the device onwards, leaving out the optional fields
+    std::ifstream mountinfo{"/proc/self/mountinfo"};
+    std::string line;
+    while (std::getline(mountinfo, line)) {
+        std::stringstream ss{line};
+        std::string field;
+        for (int i = 0; ss >> field; i++) {
+            if (i >= 2 && i < 6)
+                data += field + " ";
+            else if (i >= 6 && field == "-")
+                break;
+        }
+        std::getline(ss, field);
+        data += field + "\n";
+    }
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016zx", std::hash<std::string>{}(data));
+    return hash;
+}
+
+/*
+ * The mount plan is a text file with the fingerprint in the first line,
+ * followed by one line per mount with tab separated fields:
+ *   bind <target>
+ *   rbind <target>  (recursive bind mount propagating from the host)
+ *   fs <target> <type> <source> <options>
+ */
+void Transaction::impl::saveMountPlan() {
+    fs::path file = getMountPlanFile();
+    fs::path tmp = file.string() + ".tmp";
+    fs::create_directories(file.parent_path());
+    std::ofstream out(tmp, std::ios::trunc);
+    out << getMountFingerprint() << "\n";
+    for (auto &mount: dirsToMount) {
+        if (dynamic_cast<PropagatedBindMount*>(mount.get()))
+            out << "rbind\t" << mount->getMountpoint() << "\n";
+        else if (dynamic_cast<BindMount*>(mount.get()))
+            out << "bind\t" << mount->getMountpoint() << "\n";
+        else
+            out << "fs\t" << mount->getMountpoint() << "\t" << mount->getFilesystem() << "\t"
+                << mount->getSource() << "\t" << mount->getOptions() << "\n";
+    }
+    out.close();
+    if (!out)
+        throw std::runtime_error{"Writing mount plan " + tmp.string() + " failed."};
+    fs::rename(tmp, file);
+}
+
+bool Transaction::impl::loadMountPlan() {
+    std::ifstream in(getMountPlanFile());
+    std::string line;
+    if (!std::getline(in, line))
+        return false;
+    if (line != getMountFingerprint()) {
+        tulog.debug("Mount plan of snapshot ", snapshot->getUid(), " is outdated.");
+        return false;
+    }
+    std::vector<std::unique_ptr<Mount>> mounts;
+    while (std::getline(in, line)) {
+        std::vector<std::string> fields;
+        std::stringstream ss{line};
+        std::string field;
+        while (std::getline(ss, field, '\t'))
+            fields.push_back(field);
+        if (fields.size() == 2 && fields[0] == "bind") {
+            mounts.push_back(std::make_unique<BindMount>(fields[1]));
+        } else if (fields.size() == 2 && fields[0] == "rbind") {
+            mounts.push_back(std::make_unique<PropagatedBindMount>(fields[1]));
+        } else if (fields.size() >= 4 && fields[0] == "fs") {
+            std::unique_ptr<Mount> mount{new Mount{fields[1]}};
+            mount->setType(fields[2]);
+            mount->setSource(fields[3]);
+            mount->setOptions(fields.size() > 4 ? fields[4] : "");
+            mounts.push_back(std::move(mount));
+        } else {
+            tulog.info("Ignoring invalid mount plan of snapshot ", snapshot->getUid(), ".");
+            return false;
+        }
+    }
+    dirsToMount = std::move(mounts);
+    tulog.debug("Replaying mount plan of snapshot ", snapshot->getUid(), ".");
+    return true;
+}
+
+// With usePlan the mounts are taken from the plan saved by an earlier call for
+// the same snapshot instead of probing the running system again
+void Transaction::impl::mount(bool usePlan) {
+    TUStats::Timer timer{"mount"};
+    if (hostNs < 0)
+        hostNs = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    if (unshare(CLONE_NEWNS) < 0) {
+        throw std::runtime_error{"Creating new mount namespace failed: " + std::string(strerror(errno))};
+    }
+
+    // GRUB needs to have an actual mount point for the root partition, so
+    // mount the snapshot directory on a temporary mount point
+    std::unique_ptr<BindMount> mntBind{new BindMount{snapshot->getRoot(), MS_UNBINDABLE}};
+    mntBind->setSource(snapshot->getRoot());
+
+    if (!usePlan || !loadMountPlan()) {
+        planMounts();
+        try {
+            saveMountPlan();
+        } catch (const std::exception &e) {
+            tulog.info("Could not save mount plan: ", e.what());
+        }
+    }
+
+    // Prefer building the whole tree detached and attaching it in one step;
+    // if anything goes wrong the detached tree is just thrown away again and
+    // the mounts are done one by one via libmount.
+    if (MountTree::isSupported()) {
+        try {
+            std::unique_ptr<MountTree> tree{new MountTree{snapshot->getRoot(), MS_UNBINDABLE}};
+            for (auto it = dirsToMount.begin(); it != dirsToMount.end(); ++it) {
+                tree->add(*it->get());
+            }
+            tree->attach();
+            mountTree = std::move(tree);
+            return;
+        } catch (const std::exception &e) {
+            tulog.debug("Building mount tree failed, falling back to libmount: ", e.what());
+        }
+    }
 
+    mntBind->mount();
     for (auto it = dirsToMount.begin(); it != dirsToMount.end(); ++it) {
         it->get()->mount(snapshot->getRoot());
     }
@@ -168,8 +411,224 @@ void Transaction::impl::mount() {
     dirsToMount.push_back(std::move(mntBind));
 }
 
+// Unmount everything below the snapshot root in a single pass: Unmounting
+// each Mount on its own would have to look up the mount table once per entry.
+void Transaction::impl::umount() {
+    TUStats::Timer timer{"umount"};
+    if (inSession) {
+        endSession();
+        return;
+    }
+    if (mountTree) {
+        mountTree.reset();
+        dirsToMount.clear();
+        return;
+    }
+    if (dirsToMount.empty())
+        return;
+
+    if (!unmountAll()) {
+        // Let the Mount instances clean up themselves
+        dirsToMount.clear();
+        return;
+    }
+    for (auto &mount : dirsToMount) {
+        mount->setUnmounted();
+    }
+    dirsToMount.clear();
+}
+
+bool Transaction::impl::unmountAll() {
+    std::vector<std::string> targets;
+    try {
+        const std::string root = snapshot->getRoot();
+        mountTables->invalidateMtab();
+        struct libmnt_table* table = mountTables->getMtab();
+        struct libmnt_iter* iter = mnt_new_iter(MNT_ITER_FORWARD);
+        struct libmnt_fs* fs;
+        while (mnt_table_next_fs(table, iter, &fs) == 0) {
+            const char* target = mnt_fs_get_target(fs);
+            if (target == nullptr)
+                continue;
+            std::string t{target};
+            if (t == root || t.compare(0, root.length() + 1, root + "/") == 0)
+                targets.push_back(t);
+        }
+        mnt_free_iter(iter);
+    } catch (const std::exception &e) {
+        tulog.error("ERROR: ", e.what());
+        return false;
+    }
+
+    // Mounts stacked on the same directory have to be unmounted in reverse
+    // order, and children always before their parents
+    std::reverse(targets.begin(), targets.end());
+    std::stable_sort(targets.begin(), targets.end(), [](const std::string &a, const std::string &b) {
+        return std::count(a.begin(), a.end(), '/') > std::count(b.begin(), b.end(), '/');
+    });
+
+    std::string errors;
+    for (auto &target : targets) {
+        tulog.debug("Unmounting ", target, "...");
+        if (umount2(target.c_str(), UMOUNT_NOFOLLOW) != 0)
+            errors.append("\n  " + target + ": " + strerror(errno));
+    }
+    mountTables->invalidateMtab();
+
+    if (!errors.empty())
+        tulog.error("Error unmounting file systems:", errors);
+    return true;
+}
+
+// The mounts of this process stay in use by the pinned session namespace
+void Transaction::impl::releaseMounts() {
+    if (mountTree) {
+        mountTree->release();
+        mountTree.reset();
+    }
+    for (auto &mount : dirsToMount) {
+        mount->release();
+    }
+    dirsToMount.clear();
+}
+
+fs::path Transaction::impl::getSessionFile() {
+    return fs::path{config.get("SESSION_DIR")} / snapshot->getUid();
+}
+
+// Pinning and unpinning a session namespace has to be done in the caller's
+// namespace, so that other processes can see and use it
+void Transaction::impl::runInHostNamespace(const std::function<void()> &func) {
+    if (hostNs < 0)
+        throw std::runtime_error{"Mount namespace of caller is unknown."};
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error{"fork() failed: " + std::string(strerror(errno))};
+    } else if (pid == 0) {
+        try {
+            if (setns(hostNs, CLONE_NEWNS) < 0)
+                throw std::runtime_error{"Joining mount namespace of caller failed: " + std::string(strerror(errno))};
+            func();
+        } catch (const std::exception &e) {
+            tulog.error("ERROR: ", e.what());
+            _exit(1);
+        }
+        _exit(0);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            throw std::runtime_error{"waitpid() failed: " + std::string(strerror(errno))};
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error{"Changing session of snapshot " + snapshot->getUid() + " failed."};
+}
+
+// Bind mount this thread's mount namespace into the session directory, keeping
+// it alive after this process has exited
+void Transaction::impl::pinSession() {
+    const fs::path sessionFile = getSessionFile();
+    const fs::path sessionDir = sessionFile.parent_path();
+    const std::string nsPath = "/proc/" + std::to_string(getpid()) + "/task/" + std::to_string(gettid()) + "/ns/mnt";
+
+    // Mount points created for this transaction have to be removed again when the session ends
+    fs::create_directories(sessionDir);
+    std::ofstream dirs(sessionFile.string() + ".dirs", std::ios::trunc);
+    if (mountTree) {
+        for (auto &dir : mountTree->getDirectoriesCreated())
+            dirs << dir.string() << std::endl;
+    }
+    for (auto &mount : dirsToMount) {
+        if (!mount->getDirectoryCreated().empty())
+            dirs << mount->getDirectoryCreated() << std::endl;
+    }
+    dirs.close();
+
+    runInHostNamespace([&]() {
+        fs::create_directories(sessionDir);
+        // The session directory must not propagate, otherwise the namespace would be
+        // mounted into itself
+        if (::mount(nullptr, sessionDir.c_str(), nullptr, MS_PRIVATE, nullptr) < 0) {
+            if (errno != EINVAL
+                    || ::mount(sessionDir.c_str(), sessionDir.c_str(), nullptr, MS_BIND, nullptr) < 0
+                    || ::mount(nullptr, sessionDir.c_str(), nullptr, MS_PRIVATE, nullptr) < 0)
+                throw std::runtime_error{"Making " + sessionDir.string() + " a private mount failed: " + std::string(strerror(errno))};
+        }
+        std::ofstream{sessionFile};
+        if (::mount(nsPath.c_str(), sessionFile.c_str(), nullptr, MS_BIND, nullptr) < 0)
+            throw std::runtime_error{"Pinning mount namespace to " + sessionFile.string() + " failed: " + std::string(strerror(errno))};
+    });
+    inSession = true;
+    tulog.info("Opened session for snapshot ", snapshot->getUid(), ".");
+}
+
+// Enter the mount namespace of an open session instead of mounting everything again
+bool Transaction::impl::joinSession() {
+    const fs::path sessionFile = getSessionFile();
+    if (!fs::exists(sessionFile))
+        return false;
+
+    int nsFd = open(sessionFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (nsFd < 0) {
+        tulog.info("Could not open session ", sessionFile, ": ", strerror(errno));
+        return false;
+    }
+    if (hostNs < 0)
+        hostNs = open("/proc/self/ns/mnt", O_RDONLY | O_CLOEXEC);
+    // Joining a mount namespace is not possible while the file system
+    // information is shared with other threads
+    int ret = unshare(CLONE_FS);
+    if (ret == 0)
+        ret = setns(nsFd, CLONE_NEWNS);
+    int err = errno;
+    close(nsFd);
+    if (ret < 0) {
+        tulog.info("Could not join session ", sessionFile, ": ", strerror(err));
+        return false;
+    }
+    tulog.debug("Joined session ", sessionFile, ".");
+    inSession = true;
+    return true;
+}
+
+void Transaction::impl::endSession() {
+    tulog.info("Closing session for snapshot ", snapshot->getUid(), ".");
+    const fs::path sessionFile = getSessionFile();
+    releaseMounts();
+    unmountAll();
+
+    std::ifstream dirs(sessionFile.string() + ".dirs");
+    std::vector<fs::path> createdDirs;
+    std::string line;
+    while (std::getline(dirs, line)) {
+        if (!line.empty())
+            createdDirs.push_back(line);
+    }
+    for (auto it = createdDirs.rbegin(); it != createdDirs.rend(); ++it) {
+        try {
+            fs::remove_all(*it);
+        }  catch (const std::exception &e) {
+            tulog.error("ERROR: ", e.what());
+        }
+    }
+
+    inSession = false;
+    try {
+        runInHostNamespace([&]() {
+            if (umount2(sessionFile.c_str(), MNT_DETACH) < 0 && errno != EINVAL)
+                throw std::runtime_error{"Unpinning " + sessionFile.string() + " failed: " + std::string(strerror(errno))};
+            fs::remove(sessionFile);
+            fs::remove(sessionFile.string() + ".dirs");
+        });
+    } catch (const std::exception &e) {
+        tulog.error("ERROR: ", e.what());
+    }
+}
+
 void Transaction::impl::addSupplements() {
-    supplements = Supplements(snapshot->getRoot());
+    TUStats::Timer timer{"supplements"};
+    supplements = Supplements(snapshot->getRoot(), getSupplementsFile());
 
     Mount mntVar{"/var"};
     if (mntVar.isMount()) {
@@ -183,66 +642,271 @@ void Transaction::impl::addSupplements() {
     supplements.addDir(fs::path{"/var/spool"});
 }
 
-// Callback function for nftw to register all directories for inotify
-int Transaction::impl::inotifyAdd(const char *pathname, const struct stat *sbuf, int type, struct FTW *ftwb) {
-    if (!(type == FTW_D))
-        return 0;
-    std::vector<std::filesystem::path>::iterator it;
-    for (it = inotifyExcludes.begin(); it != inotifyExcludes.end(); it++) {
-        if (std::string(pathname).find(*it) == 0)
-            return 0;
-    }
-    int num;
-    if ((num = inotify_add_watch(inotifyFd, pathname, IN_MODIFY | IN_MOVE | IN_CREATE | IN_DELETE | IN_ATTRIB | IN_ONESHOT | IN_ONLYDIR | IN_DONT_FOLLOW)) == -1)
-        tulog.info("WARNING: Cannot register inotify watch for ", pathname);
-    else
-        tulog.debug("Watching ", pathname, " with descriptor number ", num);
-    return 0;
-}
-
-void Transaction::init(std::string base) {
-    if (base == "active")
-        base = pImpl->snapshotMgr->getCurrent();
-    else if (base == "default")
-        base = pImpl->snapshotMgr->getDefault();
-    pImpl->snapshot = pImpl->snapshotMgr->create(base);
-
-    tulog.info("Using snapshot " + base + " as base for new snapshot " + pImpl->snapshot->getUid() + ".");
-
-    // Create /etc overlay
+void Transaction::impl::createEtcOverlay(const std::string &base, std::unique_ptr<Overlay::PreparedSync> prepared) {
     std::unique_ptr<Mount> mntEtc{new Mount{"/etc"}};
     if (mntEtc->isMount() && mntEtc->getFilesystem() == "overlay") {
-        Overlay overlay = Overlay{pImpl->snapshot->getUid()};
-        overlay.create(base, pImpl->snapshot->getUid(), getRoot());
+        fs::path root = snapshot->getRoot();
+        Overlay overlay = Overlay{snapshot->getUid()};
+        overlay.create(base, snapshot->getUid(), root, std::move(prepared));
         overlay.setMountOptions(mntEtc);
         // Copy current fstab into root in case the user modified it
         if (fs::exists(fs::path{overlay.lowerdirs[0] / "fstab"})) {
-            fs::copy(fs::path{overlay.lowerdirs[0] / "fstab"}, fs::path{getRoot() / "etc"}, fs::copy_options::overwrite_existing);
+            fs::copy(fs::path{overlay.lowerdirs[0] / "fstab"}, fs::path{root / "etc"}, fs::copy_options::overwrite_existing);
         }
 
-        mntEtc->persist(getRoot() / "etc" / "fstab");
+        mntEtc->persist(root / "etc" / "fstab");
 
         // Make sure both the snapshot and the overlay contain all relevant fstab data, i.e.
         // user modifications from the overlay are present in the root fs and the /etc
         // overlay is visible in the overlay
-        fs::copy(fs::path{getRoot() / "etc" / "fstab"}, overlay.upperdir, fs::copy_options::overwrite_existing);
+        fs::copy(fs::path{root / "etc" / "fstab"}, overlay.upperdir, fs::copy_options::overwrite_existing);
+    }
+}
+
+void Transaction::impl::prepareSpare() {
+    Spare::discard(*snapshotMgr);
+
+    std::string base;
+    {
+        Lock defaultLock{Lock::getGlobal(), Lock::Mode::Shared};
+        base = snapshotMgr->getDefault();
+        TUStats::Timer timer{"snapshot-create"};
+        snapshot = snapshotMgr->create(base);
     }
+    snapshotLock = std::make_unique<Lock>(Lock::getSnapshot(snapshot->getUid()), Lock::Mode::Exclusive, false);
+    try {
+        createEtcOverlay(base);
+        Spare::mark(*snapshot, base);
+    } catch (const std::exception &e) {
+        snapshot->abort();
+        snapshotLock->removeOnRelease();
+        snapshot.reset();
+        snapshotLock.reset();
+        throw;
+    }
+    tulog.info("Prepared spare snapshot ", snapshot->getUid(), " based on snapshot ", base, ".");
+    snapshot.reset();
+    snapshotLock.reset();
+}
+
+// Run PREFETCH_COMMAND in the running system while the snapshot is prepared, e.g. to
+// download packages into /var/cache, which is shared with the snapshot
+void Transaction::impl::startPrefetch() {
+    std::string cmd = config.get("PREFETCH_COMMAND");
+    if (cmd.empty())
+        return;
+    tulog.info("Starting prefetch `", cmd, "`.");
+    tulog.flush();
+    const char* argv[] = {"/bin/sh", "-c", cmd.c_str(), nullptr};
+    // Only the transaction's ID may be written to stdout
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, STDERR_FILENO, STDOUT_FILENO);
+    // Own process group, so all processes of the command can be terminated at once
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    int rc = posix_spawn(&pidPrefetch, argv[0], &actions, &attr, const_cast<char* const*>(argv), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        pidPrefetch = 0;
+        tulog.error("Starting prefetch `", cmd, "` failed: ", strerror(rc));
+        return;
+    }
+    tustats.count("spawns");
+}
+
+// A failing prefetch only costs time later, so it doesn't fail the transaction
+void Transaction::impl::waitPrefetch(bool terminate) {
+    if (pidPrefetch == 0)
+        return;
+    if (terminate) {
+        tulog.info("Terminating prefetch.");
+        if (kill(-pidPrefetch, SIGTERM) < 0)
+            tulog.error("Terminating prefetch failed: ", strerror(errno));
+    }
+    TUStats::Timer timer{"prefetch-wait"};
+    int status;
+    pid_t ret;
+    while ((ret = waitpid(pidPrefetch, &status, 0)) < 0 && errno == EINTR);
+    pidPrefetch = 0;
+    if (ret < 0)
+        tulog.error("Waiting for prefetch failed: ", strerror(errno));
+    else if (!terminate && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+        tulog.info("Warning: Prefetch command failed.");
+}
 
-    pImpl->mount();
+void Transaction::init(std::string base) {
+    tulog.setPhase("init");
+    pImpl->startPrefetch();
+    bool claimed = false;
+    // Compare the /etc trees while the snapshot is being created
+    std::future<std::unique_ptr<Overlay::PreparedSync>> etcSync;
+    {
+        // The default snapshot must not be switched while it is used as a base
+        Lock defaultLock{Lock::getGlobal(), Lock::Mode::Shared};
+        if (base == "active")
+            base = pImpl->snapshotMgr->getCurrent();
+        else if (base == "default")
+            base = pImpl->snapshotMgr->getDefault();
+        if (Spare::isEnabled()) {
+            try {
+                pImpl->snapshot = Spare::claim(*pImpl->snapshotMgr, base, pImpl->snapshotLock);
+                claimed = pImpl->snapshot != nullptr;
+            } catch (const std::exception &e) {
+                tulog.info("Could not use spare snapshot: ", e.what());
+                pImpl->snapshot.reset();
+                pImpl->snapshotLock.reset();
+            }
+        }
+        if (!claimed) {
+            Mount mntEtc{"/etc"};
+            if (config.get("PIPELINED_INIT") == "yes" && mntEtc.isMount() && mntEtc.getFilesystem() == "overlay")
+                etcSync = std::async(std::launch::async, Overlay::prepareSync, base);
+            TUStats::Timer timer{"snapshot-create"};
+            pImpl->snapshot = pImpl->snapshotMgr->create(base);
+        }
+    }
+    if (!claimed)
+        pImpl->snapshotLock = std::make_unique<Lock>(Lock::getSnapshot(pImpl->snapshot->getUid()), Lock::Mode::Exclusive, false);
+
+    tulog.setField("TUKIT_SNAPSHOT", pImpl->snapshot->getUid());
+    tulog.info("Using snapshot " + base + " as base for new snapshot " + pImpl->snapshot->getUid() + ".");
+    // Removed again by keep() and finalize(); tells cleanup that the snapshot is left over
+    // by an instance which was interrupted before handing the transaction over
+    std::ofstream{getRoot() / "transactionIncomplete"};
+
+    // Create /etc overlay; a spare snapshot has it already
+    if (!claimed) {
+        std::unique_ptr<Overlay::PreparedSync> prepared;
+        if (etcSync.valid()) {
+            TUStats::Timer timer{"overlay-sync-wait"};
+            try {
+                prepared = etcSync.get();
+            } catch (const std::exception &e) {
+                tulog.info("Preparing /etc synchronization failed, synchronizing completely: ", e.what());
+            }
+        }
+        pImpl->createEtcOverlay(base, std::move(prepared));
+    }
+
+    pImpl->mount(false);
     pImpl->addSupplements();
     if (pImpl->discardIfNoChange) {
         // Flag file to indicate this snapshot was initialized with discard flag
         std::ofstream output(getRoot() / "discardIfNoChange");
     }
+    pImpl->waitPrefetch();
+}
+
+void Transaction::import(int fd, std::string base) {
+    tulog.setPhase("import");
+    Export::Reader reader{fd};
+    const std::string exportedId = reader.getMetadata().count("id") ? reader.getMetadata().at("id") : "?";
+    {
+        Lock defaultLock{Lock::getGlobal(), Lock::Mode::Shared};
+        if (base == "active")
+            base = pImpl->snapshotMgr->getCurrent();
+        else if (base == "default")
+            base = pImpl->snapshotMgr->getDefault();
+        TUStats::Timer timer{"snapshot-create"};
+        pImpl->snapshot = pImpl->snapshotMgr->create(base);
+    }
+    pImpl->snapshotLock = std::make_unique<Lock>(Lock::getSnapshot(pImpl->snapshot->getUid()), Lock::Mode::Exclusive, false);
+    tulog.setField("TUKIT_SNAPSHOT", pImpl->snapshot->getUid());
+    tulog.info("Importing exported snapshot ", exportedId, " as new snapshot ", pImpl->snapshot->getUid(),
+               " based on snapshot ", base, ".");
+
+    // Replace the snapshot's subvolume by the received one; it is received into a
+    // temporary directory first, so the snapshot keeps its subvolume on errors
+    fs::path root = getRoot();
+    {
+        TUStats::Timer timer{"receive"};
+        fs::path tmpDir = root.parent_path() / "import";
+        fs::path received = tmpDir / root.filename();
+        if (fs::exists(received))
+            Btrfs::deleteSubvolume(received);
+        fs::create_directories(tmpDir);
+        int in;
+        pid_t pid = Export::start({"btrfs", "receive", tmpDir}, in, true);
+        try {
+            try {
+                reader.copySection("send", in);
+            } catch (const std::exception &e) {
+                close(in);
+                kill(pid, SIGTERM);
+                waitpid(pid, nullptr, 0);
+                throw;
+            }
+            close(in);
+            Export::finish(pid, "btrfs receive");
+            if (!fs::is_directory(received))
+                throw std::runtime_error{"Export stream did not contain a snapshot named " + root.filename().string() + "."};
+            Btrfs::deleteSubvolume(root);
+            fs::rename(received, root);
+        } catch (const std::exception &e) {
+            if (fs::exists(received))
+                Btrfs::deleteSubvolume(received);
+            fs::remove(tmpDir);
+            throw;
+        }
+        fs::remove(tmpDir);
+        // The received UUID would make btrfs consider the modified subvolume identical to
+        // the sent one, e.g. when used as parent for incremental streams
+        Btrfs::setReadOnly(root, false);
+        Btrfs::clearReceivedUuid(root);
+    }
+    // Flag files of the exporting transaction
+    fs::remove(root / "discardIfNoChange");
+    std::ofstream{root / "transactionIncomplete"};
+
+    pImpl->createEtcOverlay(base);
+    if (reader.peek() == "etc") {
+        std::unique_ptr<Mount> mntEtc{new Mount{"/etc"}};
+        fs::path target = root / "etc";
+        if (mntEtc->isMount() && mntEtc->getFilesystem() == "overlay")
+            target = Overlay{pImpl->snapshot->getUid()}.upperdir;
+        // The fstab refers to the exporting system's overlay directories
+        int in;
+        pid_t pid = Export::start({"tar", "--extract", "--file=-", "--xattrs", "--xattrs-include=*", "--acls",
+                                   "--numeric-owner", "--exclude=./fstab", "--directory", target}, in, true);
+        try {
+            reader.copySection("etc", in);
+        } catch (const std::exception &e) {
+            close(in);
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+            throw;
+        }
+        close(in);
+        Export::finish(pid, "tar --extract");
+    }
+    if (reader.peek() != "end")
+        throw std::runtime_error{"Unexpected " + reader.peek() + " data in export stream."};
+
+    pImpl->mount(false);
+    pImpl->addSupplements();
 }
 
 void Transaction::resume(std::string id) {
+    tulog.setPhase("resume");
+    tulog.setField("TUKIT_SNAPSHOT", id);
+    pImpl->snapshotLock = std::make_unique<Lock>(Lock::getSnapshot(id), Lock::Mode::Exclusive, false);
     pImpl->snapshot = pImpl->snapshotMgr->open(id);
     if (! pImpl->snapshot->isInProgress()) {
         pImpl->snapshot.reset();
+        pImpl->snapshotLock.reset();
         throw std::invalid_argument{"Snapshot " + id + " is not an open transaction."};
     }
-    pImpl->mount();
+    if (Spare::isSpare(*pImpl->snapshot)) {
+        pImpl->snapshot.reset();
+        pImpl->snapshotLock.reset();
+        throw std::invalid_argument{"Snapshot " + id + " is a spare snapshot reserved for new transactions."};
+    }
+    if (!pImpl->joinSession())
+        pImpl->mount(true);
     pImpl->addSupplements();
     if (fs::exists(getRoot() / "discardIfNoChange")) {
         pImpl->discardIfNoChange = true;
@@ -253,169 +917,585 @@ void Transaction::setDiscardIfUnchanged(bool discard) {
     pImpl->discardIfNoChange = discard;
 }
 
-int Transaction::impl::inotifyRead() {
-    size_t bufLen = sizeof(struct inotify_event) + NAME_MAX + 1;
-    char buf[bufLen] __attribute__((aligned(8)));
-    ssize_t numRead;
-    int ret;
+void Transaction::openSession() {
+    if (!isInitialized())
+        throw std::logic_error{"Cannot open a session without a transaction."};
+    if (pImpl->inSession)
+        return;
+    pImpl->pinSession();
+}
+
+void Transaction::closeSession() {
+    if (pImpl->inSession)
+        pImpl->endSession();
+}
 
-    struct pollfd pfd = {inotifyFd, POLLIN, 0};
-    ret = (poll(&pfd, 1, 500));
-    if (ret == -1) {
-        throw std::runtime_error{"Polling inotify file descriptior failed: " + std::string(strerror(errno))};
-    } else if (ret > 0) {
-        numRead = read(inotifyFd, buf, bufLen);
-        if (numRead == 0)
-            throw std::runtime_error{"Read() from inotify fd returned 0!"};
-        if (numRead == -1)
-            throw std::runtime_error{"Reading from inotify fd failed: " + std::string(strerror(errno))};
-        tulog.debug("inotify: Exiting after event on descriptor number ", ((struct inotify_event *)buf)->wd, " in ", ((struct inotify_event *)buf)->name);
+static int exitStatus(int status) {
+    int ret = -1;
+    if (WIFEXITED(status)) {
+        ret = WEXITSTATUS(status);
+        tulog.info("Application returned with exit status ", ret, ".");
+    }
+    if (WIFSIGNALED(status)) {
+        ret = WTERMSIG(status);
+        tulog.info("Application was terminated by signal ", ret, ".");
     }
     return ret;
 }
 
-int Transaction::impl::runCommand(char* argv[], bool inChroot, std::string* output) {
-    if (discardIfNoChange) {
-        inotifyFd = inotify_init();
-        if (inotifyFd == -1)
-            throw std::runtime_error{"Couldn't initialize inotify."};
+// Replace any occurrence of '{}' in argv with the snapshot's mount directory; the
+// returned argument list points to the substituted arguments stored in args
+static std::vector<char*> substituteRoot(char* argv[], const fs::path &root, std::vector<std::string> &args) {
+    for (int i=0; argv[i] != nullptr; i++) {
+        std::string s = std::string(argv[i]);
+        std::string from = "{}";
+        // replacing all {} by bindDir
+        for(size_t pos = 0;
+           (pos = s.find(from, pos)) != std::string::npos;
+           pos += root.string().length())
+            s.replace(pos, from.size(), root);
+        args.push_back(std::move(s));
+    }
+    std::vector<char*> substituted;
+    for (auto &arg : args) {
+        substituted.push_back(arg.data());
+    }
+    substituted.push_back(nullptr);
+    return substituted;
+}
+
+// Between fork() and exec() only async-signal-safe functions may be used, as
+// other threads (e.g. in tukitd) may have held locks such as tulog's mutex
+// when the process was forked; so report directly to (the redirected) stderr
+static void childError(const char *message, int err) {
+    const char *reason = strerror(err);
+    struct iovec iov[] = {
+        {const_cast<char*>(message), strlen(message)}, {const_cast<char*>(": "), 2},
+        {const_cast<char*>(reason), strlen(reason)}, {const_cast<char*>("\n"), 1}
+    };
+    while (writev(STDERR_FILENO, iov, 4) < 0 && errno == EINTR);
+}
+
+// Fork the application; if outfd / errfd are not -1 the child's stdout / stderr
+// are redirected to them
+pid_t Transaction::impl::startCommand(char* argv[], bool inChroot, int outfd, int errfd) {
+    if (pidCmd != 0)
+        throw std::logic_error{"Another command of this transaction is still running."};
 
-        // Recursively register all directories of the root file system
-        inotifyExcludes = MountList::getList(snapshot->getRoot());
-        nftw(snapshot->getRoot().c_str(), inotifyAdd, 20, FTW_MOUNT | FTW_PHYS);
+    // Changes are accumulated over all commands of this Transaction instance
+    if (discardIfNoChange && !changeDetector) {
+        TUStats::Timer timer{"change-detector"};
+        changeDetector = ChangeDetectorFactory::get(snapshot->getRoot());
     }
 
-    std::string opts = "Executing `";
+    std::string cmdline;
     int i = 0;
     while (argv[i]) {
         if (i > 0)
-            opts.append(" ");
-        opts.append(argv[i]);
+            cmdline.append(" ");
+        cmdline.append(argv[i]);
         i++;
     }
-    opts.append("`:");
-    tulog.info(opts);
+    tulog.setPhase("execute");
+    tulog.setField("TUKIT_COMMAND", cmdline);
+    tulog.info("Executing `", cmdline, "`:");
+    // The application's output must not be mixed up with buffered messages
+    tulog.flush();
 
-    int status = 1;
-    int ret;
-    int pipefd[2];
-
-    ret = pipe(pipefd);
-    if (ret < 0) {
-        throw std::runtime_error{"Error opening pipe for command output: " + std::string(strerror(errno))};
+    // Everything the child needs is prepared before forking
+    const std::string root = snapshot->getRoot();
+    const std::string chrootError = "ERROR: Chrooting to " + root + " failed";
+    const std::string execError = "ERROR: Calling " + std::string(argv[0]) + " failed";
+    // Set indicator for RPM pre/post sections to detect whether we run in a
+    // transactional update
+    static const char envIndicator[] = "TRANSACTIONAL_UPDATE=";
+    std::vector<char*> envp;
+    for (char **env = environ; *env; env++) {
+        if (strncmp(*env, envIndicator, strlen(envIndicator)) != 0)
+            envp.push_back(*env);
     }
+    envp.push_back(const_cast<char*>("TRANSACTIONAL_UPDATE=true"));
+    envp.push_back(nullptr);
 
+    int ret;
     pid_t pid = fork();
     if (pid < 0) {
         throw std::runtime_error{"fork() failed: " + std::string(strerror(errno))};
     } else if (pid == 0) {
-        if (output != nullptr) {
-            ret = dup2(pipefd[1], STDOUT_FILENO);
+        if (outfd >= 0) {
+            ret = dup2(outfd, STDOUT_FILENO);
             if (ret < 0) {
-                throw std::runtime_error{"Redirecting stdout failed: " + std::string(strerror(errno))};
+                childError("ERROR: Redirecting stdout failed", errno);
+                _exit(1);
             }
-            ret = dup2(pipefd[1], STDERR_FILENO);
-            if (ret < 0) {
-                throw std::runtime_error{"Redirecting stderr failed: " + std::string(strerror(errno))};
-            }
-            ret = close(pipefd[0]);
+        }
+        if (errfd >= 0) {
+            ret = dup2(errfd, STDERR_FILENO);
             if (ret < 0) {
-                throw std::runtime_error{"Closing pipefd failed: " + std::string(strerror(errno))};
+                childError("ERROR: Redirecting stderr failed", errno);
+                _exit(1);
             }
         }
 
         if (inChroot) {
-            if (chdir(snapshot->getRoot().c_str()) < 0) {
-                tulog.info("Warning: Couldn't set working directory: ", std::string(strerror(errno)));
+            if (chdir(root.c_str()) < 0) {
+                childError("Warning: Couldn't set working directory", errno);
             }
-            if (chroot(snapshot->getRoot().c_str()) < 0) {
-                throw std::runtime_error{"Chrooting to " + std::string(snapshot->getRoot()) + " failed: " + std::string(strerror(errno))};
+            if (chroot(root.c_str()) < 0) {
+                childError(chrootError.c_str(), errno);
+                _exit(1);
             }
         }
 
-        // Set indicator for RPM pre/post sections to detect whether we run in a
-        // transactional update
-        setenv("TRANSACTIONAL_UPDATE", "true", 1);
-        if (execvp(argv[0], (char* const*)argv) < 0) {
-            throw std::runtime_error{"Calling " + std::string(argv[0]) + " failed: " + std::string(strerror(errno))};
+        execvpe(argv[0], (char* const*)argv, envp.data());
+        childError(execError.c_str(), errno);
+        _exit(127);
+    }
+    this->pidCmd = pid;
+    tustats.count("commands");
+    // The pidfd guarantees that signals never hit a different process which happens to
+    // reuse the PID; it's also used to wait for the application in an event loop
+    this->pidFd = tu_pidfd_open(pid, 0);
+    if (this->pidFd < 0)
+        tulog.debug("pidfd not available: ", strerror(errno));
+    return pid;
+}
+
+void Transaction::impl::closePidFd() {
+    if (pidFd >= 0)
+        close(pidFd);
+    pidFd = -1;
+}
+
+// Single event loop for the application's lifetime: passes on the output as soon
+// as it arrives (so only one chunk has to be kept in memory), reads change
+// detector events while the application is still running and enforces the
+// deadline. Without separateStreams stdout and stderr share one pipe, so their
+// output keeps its relative order and is passed on as STDOUT_FILENO.
+int Transaction::impl::runCommand(char* argv[], bool inChroot, const OutputCallback &callback, bool separateStreams) {
+    TUStats::Timer timer{"command"};
+    enum { evStdout, evStderr, evProcess, evDetector, evTimer };
+    int status = 1;
+    int ret;
+    int outfd[2] = {-1, -1};
+    int errfd[2] = {-1, -1};
+    int pipes[2] = {-1, -1};
+    int epfd = -1;
+    int timerfd = -1;
+
+    auto closeAll = [&]() {
+        for (int fd : {outfd[0], outfd[1], errfd[0], errfd[1], epfd, timerfd}) {
+            if (fd >= 0)
+                close(fd);
         }
-        ret = -1;
-    } else {
-        ret = close(pipefd[1]);
-        if (ret < 0) {
-            throw std::runtime_error{"Closing pipefd failed: " + std::string(strerror(errno))};
+    };
+    auto watch = [&](int fd, uint32_t tag) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u32 = tag;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            throw std::runtime_error{"Adding file descriptor to epoll failed: " + std::string(strerror(errno))};
+    };
+
+    if (callback) {
+        if (pipe2(outfd, O_CLOEXEC) < 0 || (separateStreams && pipe2(errfd, O_CLOEXEC) < 0)) {
+            closeAll();
+            throw std::runtime_error{"Error opening pipe for command output: " + std::string(strerror(errno))};
         }
-        if (output != nullptr) {
-            char buffer[2048];
-            ssize_t len;
-            while((len = read(pipefd[0], buffer, 2048)) > 0) {
-                output->append(buffer, len);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        closeAll();
+        throw std::runtime_error{"Creating epoll instance failed: " + std::string(strerror(errno))};
+    }
+
+    pid_t pid;
+    try {
+        pid = startCommand(argv, inChroot, outfd[1], separateStreams ? errfd[1] : outfd[1]);
+    } catch (...) {
+        closeAll();
+        throw;
+    }
+    const int streams[2] = {STDOUT_FILENO, STDERR_FILENO};
+    int open = 0;
+    bool waiting = false;
+    bool exited = false;
+    bool detecting = false;
+    int timeouts = 0;
+
+    try {
+        if (callback) {
+            close(outfd[1]);
+            outfd[1] = -1;
+            pipes[0] = outfd[0];
+            watch(pipes[0], evStdout);
+            open = 1;
+            if (separateStreams) {
+                close(errfd[1]);
+                errfd[1] = -1;
+                pipes[1] = errfd[0];
+                watch(pipes[1], evStderr);
+                open = 2;
             }
         }
+        // Without a pidfd the end of the application can only be detected via waitpid()
+        if (pidFd >= 0) {
+            watch(pidFd, evProcess);
+            waiting = true;
+        }
+        if (changeDetector && changeDetector->getFd() >= 0) {
+            watch(changeDetector->getFd(), evDetector);
+            detecting = true;
+        }
+        if (timeout > 0) {
+            timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+            struct itimerspec deadline = {};
+            deadline.it_value.tv_sec = timeout;
+            if (timerfd < 0 || timerfd_settime(timerfd, 0, &deadline, nullptr) < 0)
+                throw std::runtime_error{"Setting up command deadline failed: " + std::string(strerror(errno))};
+            watch(timerfd, evTimer);
+        }
 
-        this->pidCmd = pid;
-        ret = waitpid(pid, &status, 0);
-        this->pidCmd = 0;
-        if (ret < 0) {
-            throw std::runtime_error{"waitpid() failed: " + std::string(strerror(errno))};
-        } else {
-            if (WIFEXITED(status)) {
-                ret = WEXITSTATUS(status);
-                tulog.info("Application returned with exit status ", ret, ".");
+        char buffer[65536];
+        struct epoll_event events[8];
+        while (open > 0 || waiting) {
+            int n = epoll_wait(epfd, events, 8, -1);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error{"Waiting for command failed: " + std::string(strerror(errno))};
             }
-            if (WIFSIGNALED(status)) {
-                ret = WTERMSIG(status);
-                tulog.info("Application was terminated by signal ", ret, ".");
+            for (int e = 0; e < n; e++) {
+                uint32_t tag = events[e].data.u32;
+                if (tag == evStdout || tag == evStderr) {
+                    if (pipes[tag] < 0)
+                        continue;
+                    ssize_t len = read(pipes[tag], buffer, sizeof(buffer));
+                    if (len > 0) {
+                        callback(streams[tag], buffer, len);
+                    } else if (len == 0 || errno != EINTR) {
+                        close(pipes[tag]);
+                        pipes[tag] = -1;
+                        if (tag == evStdout)
+                            outfd[0] = -1;
+                        else
+                            errfd[0] = -1;
+                        open--;
+                    }
+                } else if (tag == evProcess) {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, pidFd, nullptr);
+                    waiting = false;
+                    exited = true;
+                } else if (tag == evDetector && detecting) {
+                    // The detector may close its descriptor once a change was found
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, changeDetector->getFd(), nullptr);
+                    if (changeDetector->hasChanged())
+                        detecting = false;
+                    else
+                        watch(changeDetector->getFd(), evDetector);
+                } else if (tag == evTimer) {
+                    uint64_t expirations;
+                    if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                        throw std::runtime_error{"Reading timer failed: " + std::string(strerror(errno))};
+                    if (exited) {
+                        // Only background processes still hold the output pipes
+                        tulog.info("Not waiting for further output after deadline.");
+                        open = 0;
+                        break;
+                    }
+                    int sig = timeouts++ == 0 ? SIGTERM : SIGKILL;
+                    tulog.error("Application exceeded its deadline of ", timeout, " seconds, sending signal ", sig, ".");
+                    if ((pidFd >= 0 ? tu_pidfd_send_signal(pidFd, sig, nullptr, 0) : kill(pid, sig)) < 0 && errno != ESRCH)
+                        throw std::runtime_error{"Could not send signal " + std::to_string(sig) + " to process " + std::to_string(pid) + ": " + std::string(strerror(errno))};
+                    struct itimerspec grace = {};
+                    grace.it_value.tv_sec = killGracePeriod;
+                    timerfd_settime(timerfd, 0, &grace, nullptr);
+                }
             }
         }
+    } catch (...) {
+        // Nobody is processing the application's output any more, and a stuck
+        // application would block the reaping below forever
+        if (!exited) {
+            tulog.info("Killing application ", pid, ".");
+            if (pidFd >= 0)
+                tu_pidfd_send_signal(pidFd, SIGKILL, nullptr, 0);
+            else
+                kill(pid, SIGKILL);
+        }
+        closeAll();
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+        this->pidCmd = 0;
+        closePidFd();
+        throw;
     }
-    return ret;
+    closeAll();
+
+    ret = waitpid(pid, &status, 0);
+    this->pidCmd = 0;
+    closePidFd();
+    if (ret < 0) {
+        throw std::runtime_error{"waitpid() failed: " + std::string(strerror(errno))};
+    }
+    return exitStatus(status);
+}
+
+int Transaction::impl::startAsync(char* argv[], bool inChroot) {
+    // The output is collected in an anonymous file instead of a pipe, so the
+    // application can't block on a full pipe while nobody is reading
+    int memfd = memfd_create("tukit-output", MFD_CLOEXEC);
+    if (memfd < 0)
+        throw std::runtime_error{"Creating output buffer failed: " + std::string(strerror(errno))};
+    pid_t pid;
+    try {
+        pid = startCommand(argv, inChroot, memfd, memfd);
+    } catch (...) {
+        close(memfd);
+        throw;
+    }
+    if (pidFd < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        pidCmd = 0;
+        close(memfd);
+        throw std::runtime_error{"Asynchronous execution requires pidfd support (Linux 5.3)."};
+    }
+    outputFd = memfd;
+    asyncStart = std::chrono::steady_clock::now();
+    return pidFd;
+}
+
+// A Transaction must not be destroyed while its application is still using
+// the mounts
+void Transaction::impl::reapAsync() {
+    if (outputFd < 0)
+        return;
+    tulog.info("Killing application ", pidCmd, " which is still running.");
+    tu_pidfd_send_signal(pidFd, SIGKILL, nullptr, 0);
+    waitpid(pidCmd, nullptr, 0);
+    pidCmd = 0;
+    closePidFd();
+    close(outputFd);
+    outputFd = -1;
+}
+
+// Collect all output of an application in the given buffer
+static Transaction::OutputCallback bufferOutput(std::string* output) {
+    if (output == nullptr)
+        return nullptr;
+    return [output](int, const char* data, size_t len) {
+        output->append(data, len);
+    };
 }
 
 int Transaction::execute(char* argv[], std::string* output) {
-    return this->pImpl->runCommand(argv, true, output);
+    return this->pImpl->runCommand(argv, true, bufferOutput(output), false);
+}
+
+int Transaction::executeStream(char* argv[], const OutputCallback &callback) {
+    return this->pImpl->runCommand(argv, true, callback, true);
 }
 
 int Transaction::callExt(char* argv[], std::string* output) {
-    for (int i=0; argv[i] != nullptr; i++) {
-        std::string s = std::string(argv[i]);
-        std::string from = "{}";
-        // replacing all {} by bindDir
-        for(size_t pos = 0;
-           (pos = s.find(from, pos)) != std::string::npos;
-           pos += getRoot().string().length())
-            s.replace(pos, from.size(), getRoot());
-        argv[i] = strdup(s.c_str());
+    std::vector<std::string> args;
+    std::vector<char*> substituted = substituteRoot(argv, getRoot(), args);
+    return this->pImpl->runCommand(substituted.data(), false, bufferOutput(output), false);
+}
+
+int Transaction::callExtStream(char* argv[], const OutputCallback &callback) {
+    std::vector<std::string> args;
+    std::vector<char*> substituted = substituteRoot(argv, getRoot(), args);
+    return this->pImpl->runCommand(substituted.data(), false, callback, true);
+}
+
+int Transaction::executeAsync(char* argv[]) {
+    return this->pImpl->startAsync(argv, true);
+}
+
+int Transaction::callExtAsync(char* argv[]) {
+    std::vector<std::string> args;
+    std::vector<char*> substituted = substituteRoot(argv, getRoot(), args);
+    return this->pImpl->startAsync(substituted.data(), false);
+}
+
+int Transaction::complete(std::string* output) {
+    if (pImpl->outputFd < 0)
+        throw std::logic_error{"No asynchronous command has been started."};
+
+    int status;
+    pid_t pid = pImpl->pidCmd;
+    int ret = waitpid(pid, &status, 0);
+    int err = errno;
+    pImpl->pidCmd = 0;
+    pImpl->closePidFd();
+    tustats.addTime("command", std::chrono::steady_clock::now() - pImpl->asyncStart);
+    int memfd = pImpl->outputFd;
+    pImpl->outputFd = -1;
+    if (ret < 0) {
+        close(memfd);
+        throw std::runtime_error{"waitpid() failed: " + std::string(strerror(err))};
+    }
+
+    if (output) {
+        struct stat st;
+        if (fstat(memfd, &st) < 0) {
+            close(memfd);
+            throw std::runtime_error{"Reading application output failed: " + std::string(strerror(errno))};
+        }
+        std::string buffer(st.st_size, '\0');
+        ssize_t len = pread(memfd, buffer.data(), buffer.size(), 0);
+        if (len < 0) {
+            close(memfd);
+            throw std::runtime_error{"Reading application output failed: " + std::string(strerror(errno))};
+        }
+        buffer.resize(len);
+        output->append(buffer);
+    }
+    close(memfd);
+    return exitStatus(status);
+}
+
+std::vector<Transaction::CommandResult> Transaction::executeMany(const std::vector<Command> &commands, bool stopOnError, bool captureOutput) {
+    std::vector<CommandResult> results;
+    for (auto &command : commands) {
+        if (command.argv.empty())
+            throw std::invalid_argument{"Empty command in command list."};
+        // The commands are only read, but take a C style argument list
+        std::vector<char*> argv;
+        for (auto &arg : command.argv) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        CommandResult result;
+        std::string* output = captureOutput ? &result.output : nullptr;
+        if (command.external)
+            result.status = callExt(argv.data(), output);
+        else
+            result.status = execute(argv.data(), output);
+        results.push_back(std::move(result));
+
+        if (stopOnError && results.back().status != 0)
+            break;
     }
-    return this->pImpl->runCommand(argv, false, output);
+    return results;
+}
+
+void Transaction::setTimeout(unsigned int seconds) {
+    pImpl->timeout = seconds;
 }
 
 void Transaction::sendSignal(int signal) {
     if (pImpl->pidCmd != 0) {
-        if (kill(pImpl->pidCmd, signal) < 0) {
+        int ret;
+        if (pImpl->pidFd >= 0)
+            ret = tu_pidfd_send_signal(pImpl->pidFd, signal, nullptr, 0);
+        else
+            ret = kill(pImpl->pidCmd, signal);
+        if (ret < 0) {
             throw std::runtime_error{"Could not send signal " + std::to_string(signal) + " to process " + std::to_string(pImpl->pidCmd) + ": " + std::string(strerror(errno))};
         }
     }
 }
 
+// Only the snapshot, its /etc overlay and the file systems mounted into the
+// snapshot (e.g. /boot/efi for bootloader updates) have to be persisted; a
+// global sync() would also wait for the write-back of all other file systems
+void Transaction::impl::flush() {
+    TUStats::Timer timer{"flush"};
+    std::string mode = config.get("FLUSH_MODE");
+    if (mode == "sync") {
+        sync();
+        return;
+    }
+    if (mode != "syncfs" && mode != "btrfs")
+        throw std::invalid_argument{"Invalid FLUSH_MODE '" + mode + "'."};
+
+    const std::string root = snapshot->getRoot();
+    std::vector<fs::path> targets = {root};
+    fs::path overlayDir = fs::path{config.get("OVERLAY_DIR")} / snapshot->getUid();
+    if (fs::is_directory(overlayDir))
+        targets.push_back(overlayDir);
+    // The mount table of the transaction's namespace also covers joined sessions and
+    // replayed mount plans; the recursive API file system mounts can be skipped
+    mountTables->invalidateMtab();
+    struct libmnt_table* table = mountTables->getMtab();
+    struct libmnt_iter* iter = mnt_new_iter(MNT_ITER_FORWARD);
+    struct libmnt_fs* mntFs;
+    while (mnt_table_next_fs(table, iter, &mntFs) == 0) {
+        const char* target = mnt_fs_get_target(mntFs);
+        if (target == nullptr || mnt_fs_is_pseudofs(mntFs))
+            continue;
+        std::string t{target};
+        if (t.compare(0, root.length() + 1, root + "/") != 0)
+            continue;
+        std::string rel = t.substr(root.length());
+        if (rel.compare(0, 5, "/dev/") == 0 || rel.compare(0, 6, "/proc/") == 0 || rel.compare(0, 5, "/sys/") == 0)
+            continue;
+        targets.push_back(t);
+    }
+    mnt_free_iter(iter);
+
+    std::set<dev_t> devices;
+    for (auto &target : targets) {
+        struct stat st;
+        if (stat(target.c_str(), &st) < 0)
+            throw std::runtime_error{"Cannot stat " + target.string() + ": " + std::string(strerror(errno))};
+        if (!devices.insert(st.st_dev).second)
+            continue;
+        if (mode == "btrfs" && Btrfs::isBtrfs(target)) {
+            Btrfs::sync(target);
+            continue;
+        }
+        // Bind mount targets may also be files
+        int fd = open(target.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error{"Opening " + target.string() + " failed: " + std::string(strerror(errno))};
+        int ret = syncfs(fd);
+        int err = errno;
+        close(fd);
+        if (ret < 0)
+            throw std::runtime_error{"Syncing file system of " + target.string() + " failed: " + std::string(strerror(err))};
+    }
+}
+
 void Transaction::finalize() {
-    sync();
+    tulog.setPhase("finalize");
+    tulog.setField("TUKIT_COMMAND", "");
+    pImpl->flush();
     if (pImpl->discardIfNoChange &&
-            ((inotifyFd != 0 && pImpl->inotifyRead() == 0) ||
-            (inotifyFd == 0 && fs::exists(getRoot() / "discardIfNoChange")))) {
+            ((pImpl->changeDetector && !pImpl->changeDetector->hasChanged()) ||
+            (!pImpl->changeDetector && fs::exists(getRoot() / "discardIfNoChange")))) {
         tulog.info("No changes to the root file system - discarding snapshot.");
 
         // Even if the snapshot itself did not contain any changes, /etc may do so. Changes
         // in /etc may be applied immediately, so merge them back into the running system.
         std::unique_ptr<Mount> mntEtc{new Mount{"/etc"}};
         if (mntEtc->isMount() && mntEtc->getFilesystem() == "overlay") {
-            Util::exec("rsync --archive --inplace --xattrs --acls --exclude 'fstab' --delete --quiet '" + std::string(getRoot()) + "/etc/' /etc");
+            TUStats::Timer timer{"etc-merge"};
+            Overlay overlay{pImpl->snapshot->getUid()};
+            Overlay current{pImpl->snapshotMgr->getCurrent()};
+            if (!overlay.lowerdirs.empty() && overlay.lowerdirs[0] == current.upperdir) {
+                // Stacked on top of the running system's /etc, so the transaction's upper
+                // layer contains everything that differs
+                std::vector<Manifest::Entry> changes = Manifest::forLayer(overlay.upperdir);
+                changes.erase(std::remove_if(changes.begin(), changes.end(),
+                        [](const Manifest::Entry &entry) { return entry.path == "fstab"; }), changes.end());
+                tulog.debug("Merging ", changes.size(), " changed entries of /etc into the running system.");
+                Manifest::apply(changes, getRoot() / "etc", "/etc");
+            } else {
+                TreeSync etcSync{getRoot() / "etc", "/etc"};
+                etcSync.addExclude("fstab");
+                etcSync.setDelete(true);
+                etcSync.run();
+            }
         }
         return;
     }
     if (fs::exists(getRoot() / "discardIfNoChange")) {
         fs::remove(getRoot() / "discardIfNoChange");
     }
+    fs::remove(getRoot() / "transactionIncomplete");
 
     // Update /usr timestamp to support system offline update mechanism
     if (utime((pImpl->snapshot->getRoot() / "usr").c_str(), nullptr) != 0)
@@ -423,23 +1503,55 @@ void Transaction::finalize() {
 
     pImpl->snapshot->close();
     pImpl->supplements.cleanup();
-    pImpl->dirsToMount.clear();
+    pImpl->umount();
+    fs::remove(pImpl->getMountPlanFile());
 
-    std::unique_ptr<Snapshot> defaultSnap = pImpl->snapshotMgr->open(pImpl->snapshotMgr->getDefault());
-    if (defaultSnap->isReadOnly())
-        pImpl->snapshot->setReadOnly(true);
-    pImpl->snapshot->setDefault();
+    {
+        Lock defaultLock{Lock::getGlobal(), Lock::Mode::Exclusive};
+        TUStats::Timer timer{"set-default"};
+        std::unique_ptr<Snapshot> defaultSnap = pImpl->snapshotMgr->open(pImpl->snapshotMgr->getDefault());
+        if (defaultSnap->isReadOnly())
+            pImpl->snapshot->setReadOnly(true);
+        pImpl->snapshot->setDefault();
+    }
     tulog.info("New default snapshot is #" + pImpl->snapshot->getUid() + " (" + std::string(pImpl->snapshot->getRoot()) + ").");
 
     pImpl->snapshot.reset();
+    pImpl->snapshotLock->removeOnRelease();
+    pImpl->snapshotLock.reset();
+
+    // The previous spare is based on the old default snapshot
+    if (Spare::isEnabled()) {
+        try {
+            pImpl->prepareSpare();
+        } catch (const std::exception &e) {
+            tulog.error("Preparing spare snapshot failed: ", e.what());
+        }
+    }
+}
+
+void Transaction::prepareSpare() {
+    if (isInitialized())
+        throw std::logic_error{"Cannot prepare a spare snapshot within a transaction."};
+    pImpl->prepareSpare();
 }
 
 void Transaction::keep() {
-    sync();
-    if (fs::exists(pImpl->snapshot->getRoot() / "discardIfNoChange") && (inotifyFd != 0 && pImpl->inotifyRead() > 0)) {
+    tulog.setPhase("keep");
+    tulog.setField("TUKIT_COMMAND", "");
+    if (fs::exists(pImpl->snapshot->getRoot() / "discardIfNoChange") && (pImpl->changeDetector && pImpl->changeDetector->hasChanged())) {
         tulog.debug("Snapshot was changed, removing discard flagfile.");
         fs::remove(pImpl->snapshot->getRoot() / "discardIfNoChange");
     }
-    pImpl->supplements.cleanup();
+    // The transaction is meant to be resumed later on; removed after the change
+    // detection, as it would count as a change otherwise
+    fs::remove(pImpl->snapshot->getRoot() / "transactionIncomplete");
+    pImpl->flush();
+    pImpl->supplements.persist();
+    if (pImpl->inSession) {
+        pImpl->releaseMounts();
+        pImpl->inSession = false;
+    }
     pImpl->snapshot.reset();
+    pImpl->snapshotLock.reset();
 }
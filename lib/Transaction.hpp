@@ -13,12 +13,43 @@
 #ifndef T_U_TRANSACTION_H
 #define T_U_TRANSACTION_H
 
+#include <cstddef>
 #include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
 
 namespace TransactionalUpdate {
 
 class Transaction {
 public:
+    /**
+     * @brief Receiver for the output of executed applications
+     * @param stream STDOUT_FILENO or STDERR_FILENO
+     * @param data Chunk of output (not null terminated)
+     * @param len Length of chunk
+     */
+    using OutputCallback = std::function<void(int stream, const char* data, size_t len)>;
+
+    /**
+     * @brief Command for executeMany()
+     *
+     * If @external is set the command is run like with callExt(), otherwise like with
+     * execute().
+     */
+    struct Command {
+        std::vector<std::string> argv;
+        bool external = false;
+    };
+
+    /**
+     * @brief Result of a command run by executeMany()
+     */
+    struct CommandResult {
+        int status;
+        std::string output;
+    };
+
     /**
      * @brief Constructor for a new Transaction object
      *
@@ -48,11 +79,23 @@ public:
      */
     void init(std::string base);
 
+    /**
+     * @brief Open a new transaction with the contents of an exported snapshot
+     * @param fd File descriptor to read the stream written by `tukit export` from
+     * @param base Snapshot ID, "active" or "default"
+     *
+     * Like init(), but the new snapshot's contents are received from the stream instead,
+     * including the changes to /etc. If the stream was exported incrementally, @base has to
+     * be a snapshot received from the same parent snapshot. The transaction can be handled
+     * like any other transaction afterwards, e.g. be closed with finalize().
+     */
+    void import(int fd, std::string base);
+
     /**
      * @brief Set flag to discard snapshots if no changes are detected
      * @param discard true or false
      *
-     * If discard is true, then an inotify watcher will be registered to listen for changes
+     * If discard is true, then a change detector will be registered to listen for changes
      * in the root file system during execute() and callExt() calls. In case no change is
      * detected the snapshot will be discarded when calling finalize().
      * If the snapshot will be discarded and if /etc is an overlay file system, then potentially
@@ -62,8 +105,10 @@ public:
      * mode is stored until the snapshot is finalized, i.e. resuming a snapshot will remember
      * whether the snapshot may be a candidate for discarding.
      *
-     * Be aware that inotify registration may fail, e.g. if a system has a lot of open inotify
-     * listeners already. Changes may not be detected correctly in this case.
+     * The detection mechanism can be selected with the CHANGE_DETECTOR option in tukit.conf;
+     * by default fanotify will be used, falling back to comparing the btrfs generation of the
+     * snapshot and finally to inotify. If changes cannot be ruled out (e.g. because the inotify
+     * watch limit has been reached) the snapshot will be kept.
      */
     void setDiscardIfUnchanged(bool discard);
 
@@ -75,6 +120,25 @@ public:
      */
     void resume(std::string id);
 
+    /**
+     * @brief Keep the prepared environment for later resume() calls
+     *
+     * Pins the mount namespace of the transaction (i.e. all mounts and supplements set
+     * up by init() or resume()) in the session directory (SESSION_DIR in tukit.conf). Later
+     * calls of resume() for the same snapshot - from any process - will join that namespace
+     * instead of mounting everything again. The session ends with closeSession(), finalize()
+     * or when the snapshot is discarded.
+     */
+    void openSession();
+
+    /**
+     * @brief End a session opened with openSession()
+     *
+     * Unmounts everything in the session's mount namespace and removes the pin; the
+     * transaction itself stays open. Does nothing if resume() didn't join a session.
+     */
+    void closeSession();
+
     /**
      * @brief Execute the given application in the new snapshot
      * @param argv
@@ -89,6 +153,19 @@ public:
      */
     int execute(char* argv[], std::string *output=nullptr);
 
+    /**
+     * @brief Execute the given application in the new snapshot, streaming its output
+     * @param argv
+     * @param callback Receiver for the application's output
+     * @return application's return code
+     *
+     * Like execute(), but the application's output is passed to @callback in chunks as soon
+     * as it is available instead of being collected in memory; stdout and stderr are passed
+     * separately, so the order of output is only kept within each stream. Use execute() to
+     * get both in the order they were written.
+     */
+    int executeStream(char* argv[], const OutputCallback &callback);
+
     /**
      * @brief Replace '{}' in argv with mount directory and execute command
      * @param argv
@@ -107,6 +184,61 @@ public:
      */
     int callExt(char* argv[], std::string *output=nullptr);
 
+    /**
+     * @brief Replace '{}' in argv with mount directory and execute command, streaming its output
+     * @param argv
+     * @param callback Receiver for the application's output
+     * @return application's return code
+     *
+     * Like callExt(), but the output is passed to @callback as described for executeStream().
+     */
+    int callExtStream(char* argv[], const OutputCallback &callback);
+
+    /**
+     * @brief Start the given application in the new snapshot without waiting for it
+     * @param argv
+     * @return file descriptor which becomes readable as soon as the application terminated
+     *
+     * Like execute(), but returns immediately after starting the application, so an event
+     * loop can wait for several transactions at once by polling the returned file
+     * descriptor (a pidfd). The application's stdout and stderr are collected in memory.
+     * The result has to be collected with complete(), which also closes the file descriptor;
+     * the application can be cancelled with sendSignal(). Only one application of a
+     * Transaction may be running at a time.
+     */
+    int executeAsync(char* argv[]);
+
+    /**
+     * @brief Replace '{}' in argv with mount directory and start command without waiting for it
+     * @param argv
+     * @return file descriptor which becomes readable as soon as the application terminated
+     *
+     * The asynchronous variant of callExt(); see executeAsync().
+     */
+    int callExtAsync(char* argv[]);
+
+    /**
+     * @brief Collect the result of an application started with executeAsync() or callExtAsync()
+     * @param output If set the application's output will be appended
+     * @return application's return code
+     *
+     * Blocks until the application terminated if the file descriptor isn't readable yet.
+     */
+    int complete(std::string *output=nullptr);
+
+    /**
+     * @brief Execute a list of commands in order
+     * @param commands List of commands
+     * @param stopOnError Don't execute further commands after a command failed
+     * @param captureOutput Store the commands' output in the results instead of printing it
+     * @return status (and output) of each command executed
+     *
+     * Runs all commands in the same environment, so the mounts and supplements of the
+     * transaction are only set up once. If @stopOnError is set, the result list ends with
+     * the failed command.
+     */
+    std::vector<CommandResult> executeMany(const std::vector<Command> &commands, bool stopOnError = false, bool captureOutput = false);
+
     /**
      * @brief Close a transaction and set it as the new default snapshot
      *
@@ -116,6 +248,20 @@ public:
      */
     void finalize();
 
+    /**
+     * @brief Prepare a spare snapshot for the next transaction
+     *
+     * Creates a snapshot of the current default snapshot including its /etc overlay in
+     * advance, so the next init() based on the default snapshot only has to claim it instead
+     * of creating a new one. A previously prepared spare will be replaced. The spare is
+     * discarded by init() if the default snapshot or /etc changed in the meantime.
+     *
+     * Requires SPARE_SNAPSHOT to be enabled in tukit.conf to be claimed; if enabled,
+     * finalize() will also prepare a new spare automatically. May not be called on an
+     * initialized transaction.
+     */
+    void prepareSpare();
+
     /**
      * @brief Don't discard transaction on destructor call
      *
@@ -128,6 +274,17 @@ public:
      */
     void keep();
 
+    /**
+     * @brief Set a deadline for executed applications
+     * @param seconds Maximum run time of each application, 0 for no deadline
+     *
+     * Applies to all following execute() and callExt() calls (not the asynchronous variants).
+     * An application exceeding the deadline will receive SIGTERM, followed by SIGKILL if it
+     * is still running 10 seconds later. The default is taken from COMMAND_TIMEOUT in
+     * tukit.conf.
+     */
+    void setTimeout(unsigned int seconds);
+
     /**
      * @brief Sends a signal to the executed process
      * @param int Signal number
@@ -0,0 +1,463 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Synchronization of directory trees
+ */
+
+#include "TreeSync.hpp"
+#include "Log.hpp"
+#include "Stats.hpp"
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+// <linux/fs.h> conflicts with <sys/mount.h> on newer systems
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+namespace fs = std::filesystem;
+
+namespace TransactionalUpdate {
+
+namespace {
+const std::string selinuxXattr = "security.selinux";
+
+struct Fd {
+    Fd(int fd) : fd{fd} {}
+    ~Fd() { if (fd >= 0) close(fd); }
+    int fd;
+};
+
+std::runtime_error syncError(const std::string &what, const fs::path &path) {
+    return std::runtime_error{what + " '" + path.string() + "' failed: " + std::string(strerror(errno))};
+}
+
+std::vector<std::string> listXattrs(const fs::path &path) {
+    std::vector<std::string> names;
+    ssize_t size = llistxattr(path.c_str(), nullptr, 0);
+    if (size < 0) {
+        if (errno == ENOTSUP)
+            return names;
+        throw syncError("Listing extended attributes of", path);
+    }
+    std::string buf(size, '\0');
+    size = llistxattr(path.c_str(), buf.data(), buf.size());
+    if (size < 0)
+        throw syncError("Listing extended attributes of", path);
+    buf.resize(size);
+    for (size_t pos = 0; pos < buf.size(); pos = buf.find('\0', pos) + 1) {
+        names.push_back(buf.c_str() + pos);
+    }
+    return names;
+}
+
+bool getXattr(const fs::path &path, const std::string &name, std::string &value) {
+    ssize_t size = lgetxattr(path.c_str(), name.c_str(), nullptr, 0);
+    if (size < 0) {
+        if (errno == ENODATA)
+            return false;
+        throw syncError("Reading extended attribute " + name + " of", path);
+    }
+    value.resize(size);
+    size = lgetxattr(path.c_str(), name.c_str(), value.data(), value.size());
+    if (size < 0)
+        throw syncError("Reading extended attribute " + name + " of", path);
+    value.resize(size);
+    return true;
+}
+
+std::string readLink(const fs::path &path) {
+    std::string buf(PATH_MAX, '\0');
+    ssize_t len = readlink(path.c_str(), buf.data(), buf.size());
+    if (len < 0)
+        throw syncError("Reading symlink", path);
+    buf.resize(len);
+    return buf;
+}
+} // anonymous namespace
+
+TreeSync::TreeSync(fs::path source, fs::path target)
+    : source{std::move(source)}, target{std::move(target)}
+{
+}
+
+void TreeSync::addExclude(std::string pattern) {
+    excludes.push_back(pattern);
+}
+
+void TreeSync::setDelete(bool del) {
+    deleteExtraneous = del;
+}
+
+void TreeSync::setDryRun(bool dry) {
+    dryRun = dry;
+}
+
+const TreeSync::Stats& TreeSync::getStats() {
+    return stats;
+}
+
+const std::vector<Manifest::Entry>& TreeSync::getChanges() {
+    return changes;
+}
+
+void TreeSync::run() {
+    tulog.debug("Synchronizing ", source, " to ", target, "...");
+
+    struct stat st;
+    if (lstat(source.c_str(), &st) != 0)
+        throw syncError("Reading", source);
+    if (!S_ISDIR(st.st_mode))
+        throw std::runtime_error{"Synchronization source '" + source.string() + "' is not a directory."};
+    struct stat old;
+    if (dryRun) {
+        bool exists = lstat(target.c_str(), &old) == 0;
+        if (!exists || !S_ISDIR(old.st_mode)) {
+            changes.push_back({"", Manifest::Change::Replaced});
+        } else {
+            if (metadataDiffers(source, target, st, old))
+                changes.push_back({"", Manifest::Change::Modified});
+            syncDirectory("");
+        }
+        tulog.debug("Found ", changes.size(), " differences in ", stats.entries, " entries.");
+        return;
+    }
+    if (lstat(target.c_str(), &old) != 0) {
+        fs::create_directories(target);
+        syncDirectory("");
+        copyMetadata(source, target, st, nullptr, &stats);
+    } else {
+        syncDirectory("");
+        copyMetadata(source, target, st, &old, &stats);
+    }
+
+    tulog.debug("Synchronized ", stats.entries, " entries: ", stats.copied, " files copied (",
+                stats.bytes, " bytes), ", stats.deleted, " deleted, ", stats.labelsSkipped, " SELinux labels skipped.");
+    tustats.count("sync_entries", stats.entries);
+    tustats.count("sync_files_copied", stats.copied);
+    tustats.count("sync_bytes", stats.bytes);
+}
+
+bool TreeSync::isExcluded(const fs::path &rel) {
+    for (auto &pattern : excludes) {
+        if (pattern.front() == '/') {
+            if ("/" + rel.generic_string() == pattern)
+                return true;
+        } else if (rel.filename() == pattern) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TreeSync::syncDirectory(const fs::path &rel) {
+    std::set<std::string> names;
+    for (auto &entry : fs::directory_iterator(source / rel)) {
+        fs::path child = rel / entry.path().filename();
+        if (isExcluded(child))
+            continue;
+        names.insert(entry.path().filename());
+
+        struct stat st;
+        if (lstat(entry.path().c_str(), &st) != 0)
+            throw syncError("Reading", entry.path());
+        syncEntry(child, st);
+    }
+
+    if (!deleteExtraneous)
+        return;
+    std::vector<fs::path> extraneous;
+    for (auto &entry : fs::directory_iterator(target / rel)) {
+        fs::path child = rel / entry.path().filename();
+        if (names.count(entry.path().filename()) == 0 && !isExcluded(child))
+            extraneous.push_back(entry.path());
+    }
+    if (dryRun) {
+        for (auto &path : extraneous) {
+            changes.push_back({rel / path.filename(), Manifest::Change::Deleted});
+            stats.deleted++;
+        }
+        return;
+    }
+    for (auto &path : extraneous) {
+        tulog.debug("Deleting ", path);
+        fs::remove_all(path);
+        stats.deleted++;
+    }
+}
+
+// The same decisions as in syncEntry, but only recorded
+void TreeSync::planEntry(const fs::path &rel, const struct stat &st) {
+    const fs::path src = source / rel;
+    const fs::path dst = target / rel;
+    stats.entries++;
+
+    struct stat old;
+    bool exists = lstat(dst.c_str(), &old) == 0;
+    if (S_ISDIR(st.st_mode)) {
+        if (!exists || !S_ISDIR(old.st_mode)) {
+            changes.push_back({rel, Manifest::Change::Replaced});
+            return;
+        }
+        if (metadataDiffers(src, dst, st, old))
+            changes.push_back({rel, Manifest::Change::Modified});
+        syncDirectory(rel);
+        return;
+    }
+
+    bool differs = !exists || (old.st_mode & S_IFMT) != (st.st_mode & S_IFMT);
+    if (!differs && S_ISREG(st.st_mode))
+        differs = old.st_size != st.st_size || old.st_mtim.tv_sec != st.st_mtim.tv_sec
+                || old.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+    else if (!differs && S_ISLNK(st.st_mode))
+        differs = readLink(src) != readLink(dst);
+    else if (!differs)
+        differs = old.st_rdev != st.st_rdev;
+    if (differs && S_ISREG(st.st_mode)) {
+        stats.bytes += st.st_size;
+        stats.copied++;
+    }
+    if (differs || metadataDiffers(src, dst, st, old))
+        changes.push_back({rel, Manifest::Change::Modified});
+}
+
+void TreeSync::syncEntry(const fs::path &rel, const struct stat &st) {
+    if (dryRun) {
+        planEntry(rel, st);
+        return;
+    }
+    const fs::path src = source / rel;
+    const fs::path dst = target / rel;
+    stats.entries++;
+
+    struct stat old;
+    bool exists = lstat(dst.c_str(), &old) == 0;
+    if (exists && (old.st_mode & S_IFMT) != (st.st_mode & S_IFMT)) {
+        fs::remove_all(dst);
+        stats.deleted++;
+        exists = false;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (!exists && mkdir(dst.c_str(), 0700) != 0)
+            throw syncError("Creating directory", dst);
+        syncDirectory(rel);
+    } else if (S_ISREG(st.st_mode)) {
+        // Quick check: files with same size and modification time are considered unchanged
+        if (!exists || old.st_size != st.st_size || old.st_mtim.tv_sec != st.st_mtim.tv_sec
+                || old.st_mtim.tv_nsec != st.st_mtim.tv_nsec) {
+            stats.bytes += copyData(src, dst);
+            stats.copied++;
+            // Rewriting the data updated the modification time, so the old stat data is
+            // stale and all metadata has to be applied again
+            exists = false;
+        }
+    } else if (S_ISLNK(st.st_mode)) {
+        std::string link = readLink(src);
+        if (exists && readLink(dst) != link) {
+            if (unlink(dst.c_str()) != 0)
+                throw syncError("Removing", dst);
+            exists = false;
+        }
+        if (!exists && symlink(link.c_str(), dst.c_str()) != 0)
+            throw syncError("Creating symlink", dst);
+    } else {
+        if (exists && old.st_rdev != st.st_rdev) {
+            if (unlink(dst.c_str()) != 0)
+                throw syncError("Removing", dst);
+            exists = false;
+        }
+        if (!exists && mknod(dst.c_str(), st.st_mode, st.st_rdev) != 0)
+            throw syncError("Creating special file", dst);
+    }
+
+    copyMetadata(src, dst, st, exists ? &old : nullptr, &stats);
+}
+
+void TreeSync::copyFile(const fs::path &source, const fs::path &target) {
+    struct stat st;
+    if (lstat(source.c_str(), &st) != 0)
+        throw syncError("Reading", source);
+    if (!S_ISREG(st.st_mode))
+        throw std::runtime_error{"'" + source.string() + "' is not a regular file."};
+    copyData(source, target);
+    copyMetadata(source, target, st, nullptr, nullptr);
+}
+
+void TreeSync::copyEntry(const fs::path &source, const fs::path &target) {
+    struct stat st;
+    if (lstat(source.c_str(), &st) != 0)
+        throw syncError("Reading", source);
+    struct stat old;
+    bool exists = lstat(target.c_str(), &old) == 0;
+    if (exists && (!S_ISDIR(st.st_mode) || !S_ISDIR(old.st_mode))) {
+        fs::remove_all(target);
+        exists = false;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        if (!exists && mkdir(target.c_str(), 0700) != 0)
+            throw syncError("Creating directory", target);
+    } else if (S_ISREG(st.st_mode)) {
+        copyData(source, target);
+    } else if (S_ISLNK(st.st_mode)) {
+        if (symlink(readLink(source).c_str(), target.c_str()) != 0)
+            throw syncError("Creating symlink", target);
+    } else if (mknod(target.c_str(), st.st_mode, st.st_rdev) != 0) {
+        throw syncError("Creating special file", target);
+    }
+    copyMetadata(source, target, st, exists ? &old : nullptr, nullptr);
+}
+
+// Overwrite the target in place; try to share the data extents first, then
+// let the kernel copy the data, and only read and write it ourselves if
+// neither is supported by the file systems
+unsigned long long TreeSync::copyData(const fs::path &source, const fs::path &target) {
+    Fd in{open(source.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC)};
+    if (in.fd < 0)
+        throw syncError("Opening", source);
+    Fd out{open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600)};
+    if (out.fd < 0)
+        throw syncError("Opening", target);
+
+    struct stat st;
+    if (fstat(in.fd, &st) != 0)
+        throw syncError("Reading", source);
+    if (ioctl(out.fd, FICLONE, in.fd) == 0)
+        return st.st_size;
+
+    unsigned long long copied = 0;
+    bool useCopyRange = true;
+    while (useCopyRange) {
+        ssize_t len = copy_file_range(in.fd, nullptr, out.fd, nullptr, 1024 * 1024 * 1024, 0);
+        if (len == 0)
+            return copied;
+        if (len > 0) {
+            copied += len;
+            continue;
+        }
+        if (copied == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            useCopyRange = false;
+        else
+            throw syncError("Copying data to", target);
+    }
+
+    char buf[128 * 1024];
+    ssize_t len;
+    while ((len = read(in.fd, buf, sizeof(buf))) != 0) {
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            throw syncError("Reading", source);
+        }
+        for (ssize_t written = 0; written < len;) {
+            ssize_t w = write(out.fd, buf + written, len - written);
+            if (w < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw syncError("Writing", target);
+            }
+            written += w;
+        }
+        copied += len;
+    }
+    return copied;
+}
+
+void TreeSync::copyMetadata(const fs::path &source, const fs::path &target,
+                            const struct stat &st, const struct stat* old, Stats* stats) {
+    if (!old || old->st_uid != st.st_uid || old->st_gid != st.st_gid) {
+        if (lchown(target.c_str(), st.st_uid, st.st_gid) != 0)
+            throw syncError("Changing owner of", target);
+        // Changing the owner may have dropped the setuid / setgid bits
+        old = nullptr;
+    }
+    if (!S_ISLNK(st.st_mode) && (!old || (old->st_mode & 07777) != (st.st_mode & 07777))) {
+        if (chmod(target.c_str(), st.st_mode & 07777) != 0)
+            throw syncError("Changing permissions of", target);
+    }
+    // ACLs are stored as system.posix_acl_* attributes and copied here as well
+    copyXattrs(source, target, stats);
+
+    if (!old || old->st_mtim.tv_sec != st.st_mtim.tv_sec || old->st_mtim.tv_nsec != st.st_mtim.tv_nsec
+            || S_ISDIR(st.st_mode)) {
+        const struct timespec times[2] = {{0, UTIME_OMIT}, st.st_mtim};
+        if (utimensat(AT_FDCWD, target.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+            throw syncError("Setting modification time of", target);
+    }
+}
+
+// Whether copyMetadata would change anything
+bool TreeSync::metadataDiffers(const fs::path &source, const fs::path &target,
+                               const struct stat &st, const struct stat &old) {
+    if (old.st_uid != st.st_uid || old.st_gid != st.st_gid)
+        return true;
+    if (!S_ISLNK(st.st_mode) && (old.st_mode & 07777) != (st.st_mode & 07777))
+        return true;
+    if (old.st_mtim.tv_sec != st.st_mtim.tv_sec || old.st_mtim.tv_nsec != st.st_mtim.tv_nsec)
+        return true;
+
+    std::map<std::string, std::string> attrs;
+    for (auto &name : listXattrs(source)) {
+        std::string value;
+        if (getXattr(source, name, value))
+            attrs[name] = value;
+    }
+    for (auto &name : listXattrs(target)) {
+        if (!attrs.count(name) && name != selinuxXattr)
+            return true;
+    }
+    for (auto &[name, value] : attrs) {
+        std::string current;
+        if (!getXattr(target, name, current) || current != value)
+            return true;
+    }
+    return false;
+}
+
+void TreeSync::copyXattrs(const fs::path &source, const fs::path &target, Stats* stats) {
+    std::map<std::string, std::string> attrs;
+    for (auto &name : listXattrs(source)) {
+        std::string value;
+        if (getXattr(source, name, value))
+            attrs[name] = value;
+    }
+
+    for (auto &name : listXattrs(target)) {
+        // A missing label on the source (e.g. a snapshot created before
+        // SELinux was enabled) must not remove the label of the target
+        if (attrs.count(name) || name == selinuxXattr)
+            continue;
+        if (lremovexattr(target.c_str(), name.c_str()) != 0 && errno != ENODATA)
+            throw syncError("Removing extended attribute " + name + " of", target);
+    }
+
+    for (auto &[name, value] : attrs) {
+        std::string current;
+        if (getXattr(target, name, current) && current == value)
+            continue;
+        if (lsetxattr(target.c_str(), name.c_str(), value.data(), value.size(), 0) == 0)
+            continue;
+        // The policy may not know the label of the source file; keep the target's
+        // label instead of failing the whole synchronization
+        if (name == selinuxXattr) {
+            tulog.debug("Could not set SELinux label of ", target, ": ", strerror(errno));
+            if (stats)
+                stats->labelsSkipped++;
+            continue;
+        }
+        throw syncError("Setting extended attribute " + name + " of", target);
+    }
+}
+
+} // namespace TransactionalUpdate
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/* SPDX-FileCopyrightText: 2022 SUSE LLC */
+
+/*
+  Synchronization of directory trees, similar to
+  `rsync --archive --inplace --xattrs --acls [--delete]`
+ */
+
+#ifndef T_U_TREESYNC_H
+#define T_U_TREESYNC_H
+
+#include "Manifest.hpp"
+#include <filesystem>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace TransactionalUpdate {
+
+class TreeSync
+{
+public:
+    struct Stats {
+        unsigned long entries = 0;
+        unsigned long copied = 0;
+        unsigned long long bytes = 0;
+        unsigned long deleted = 0;
+        unsigned long labelsSkipped = 0;
+    };
+    TreeSync(std::filesystem::path source, std::filesystem::path target);
+    // Patterns starting with "/" are anchored at the source directory,
+    // all other patterns match the name of an entry in any directory
+    void addExclude(std::string pattern);
+    void setDelete(bool del);
+    // Don't modify the target, only record how it differs from the source; applying the
+    // recorded changes with Manifest::apply has the same result as a regular run
+    void setDryRun(bool dryRun);
+    void run();
+    const Stats& getStats();
+    const std::vector<Manifest::Entry>& getChanges();
+    // Copy contents (reflinking if possible) and metadata of a single file
+    static void copyFile(const std::filesystem::path &source, const std::filesystem::path &target);
+    // Copy a single entry of any type including its metadata, replacing an existing target
+    // of a different type; directories are created (or updated) without their contents
+    static void copyEntry(const std::filesystem::path &source, const std::filesystem::path &target);
+private:
+    void syncDirectory(const std::filesystem::path &rel);
+    void syncEntry(const std::filesystem::path &rel, const struct stat &st);
+    void planEntry(const std::filesystem::path &rel, const struct stat &st);
+    bool isExcluded(const std::filesystem::path &rel);
+    static unsigned long long copyData(const std::filesystem::path &source, const std::filesystem::path &target);
+    static void copyMetadata(const std::filesystem::path &source, const std::filesystem::path &target,
+                             const struct stat &st, const struct stat* old, Stats* stats);
+    static void copyXattrs(const std::filesystem::path &source, const std::filesystem::path &target, Stats* stats);
+    static bool metadataDiffers(const std::filesystem::path &source, const std::filesystem::path &target,
+                                const struct stat &st, const struct stat &old);
+    std::filesystem::path source;
+    std::filesystem::path target;
+    std::vector<std::string> excludes;
+    bool deleteExtraneous = false;
+    bool dryRun = false;
+    Stats stats;
+    std::vector<Manifest::Entry> changes;
+};
+
+} // namespace TransactionalUpdate
+
+#endif // T_U_TREESYNC_H
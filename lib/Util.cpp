@@ -6,38 +6,127 @@
  */
 
 #include "Log.hpp"
+#include "Stats.hpp"
 #include "Util.hpp"
 #include "Exceptions.hpp"
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace TransactionalUpdate {
 
 using namespace std;
 
-string Util::exec(const string cmd) {
-    array<char, 128> buffer;
-    string result;
-
+// Runs the given command directly (without a shell) in a clean environment and
+// returns its output on stdout; stderr is passed through.
+string Util::spawn(const vector<string> &args) {
+    if (args.empty())
+        throw logic_error{"No command given to spawn."};
+
+    string cmd;
+    for (auto &arg: args) {
+        if (!cmd.empty())
+            cmd += " ";
+        cmd += arg;
+    }
     tulog.debug("Executing `", cmd, "`:");
 
     // Ensure there is a sane path set
-    const string cmd_pathenv = "PATH='/usr/bin:/usr/sbin:/bin:/sbin' " + cmd;
-
-    auto pipe = popen(cmd_pathenv.c_str(), "r");
-
-    if (!pipe)
-        throw runtime_error{"popen() failed!"};
-
-    while (!feof(pipe)) {
-        if (fgets(buffer.data(), 128, pipe) != nullptr)
-            result += buffer.data();
+    static const string searchPath = "/usr/bin:/usr/sbin:/bin:/sbin";
+    string file = args[0];
+    if (file.find('/') == string::npos) {
+        stringstream dirs{searchPath};
+        string dir;
+        while (getline(dirs, dir, ':')) {
+            string candidate = dir + "/" + file;
+            if (access(candidate.c_str(), X_OK) == 0) {
+                file = candidate;
+                break;
+            }
+        }
+        if (file == args[0])
+            throw runtime_error{"Could not find '" + args[0] + "' in " + searchPath + "."};
     }
 
-    int rc = pclose(pipe);
+    vector<char*> argv;
+    for (auto &arg: args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    string pathEnv = "PATH=" + searchPath;
+    char* envp[] = {const_cast<char*>(pathEnv.c_str()), const_cast<char*>("LC_ALL=C"), nullptr};
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0)
+        throw runtime_error{"Creating pipe for `" + cmd + "` failed: " + string(strerror(errno))};
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t sigmask, sigdefault;
+    sigemptyset(&sigmask);
+    sigemptyset(&sigdefault);
+    sigaddset(&sigdefault, SIGPIPE);
+    posix_spawnattr_setsigmask(&attr, &sigmask);
+    posix_spawnattr_setsigdefault(&attr, &sigdefault);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    // stderr is passed through, so write pending messages first
+    tulog.flush();
+    pid_t pid;
+    int rc = posix_spawn(&pid, file.c_str(), &actions, &attr, argv.data(), envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pipefd[1]);
+    if (rc != 0) {
+        close(pipefd[0]);
+        throw runtime_error{"Executing `" + cmd + "` failed: " + string(strerror(rc))};
+    }
+    tustats.count("spawns");
 
-    tulog.debug("◸", result, "◿");
-    if (rc != EXIT_SUCCESS) {
-        throw ExecutionException{"`" + cmd + "` returned with error code " + to_string(rc%255) + ".", rc};
+    // Read in large, growing chunks, as the output (e.g. of `snapper list`) may be huge
+    string result;
+    size_t chunk = 64 * 1024;
+    ssize_t len;
+    do {
+        size_t used = result.size();
+        result.resize(used + chunk);
+        len = read(pipefd[0], result.data() + used, chunk);
+        result.resize(used + (len > 0 ? len : 0));
+        if (len < 0 && errno == EINTR)
+            len = 1;
+        else if (len > 0 && chunk < 1024 * 1024)
+            chunk *= 2;
+    } while (len > 0);
+    int readErrno = errno;
+    close(pipefd[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            throw runtime_error{"Waiting for `" + cmd + "` failed: " + string(strerror(errno))};
+    }
+    if (len < 0)
+        throw runtime_error{"Reading output of `" + cmd + "` failed: " + string(strerror(readErrno))};
+
+    // Only the beginning of huge outputs is interesting for debugging
+    if (result.size() > 4096)
+        tulog.debug("◸", result.substr(0, 4096), "◿ (", result.size() - 4096, " more bytes)");
+    else
+        tulog.debug("◸", result, "◿");
+    if (WIFSIGNALED(status)) {
+        throw ExecutionException{"`" + cmd + "` was terminated by signal " + to_string(WTERMSIG(status)) + ".", 128 + WTERMSIG(status)};
+    }
+    if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+        throw ExecutionException{"`" + cmd + "` returned with error code " + to_string(WEXITSTATUS(status)) + ".", WEXITSTATUS(status)};
     }
 
     return result;
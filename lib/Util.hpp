@@ -11,13 +11,14 @@
 #include <string>
 #include <array>
 #include <iostream>
+#include <vector>
 
 namespace TransactionalUpdate {
 
 struct Util {
-    static std::string exec(const std::string cmd);
     static void ltrim(std::string &s);
     static void rtrim(std::string &s);
+    static std::string spawn(const std::vector<std::string> &args);
     static void stub(std::string option);
     static void trim(std::string &s);
 };
@@ -17,11 +17,18 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
@@ -58,46 +65,56 @@ print_error (void)
 }
 
 
-/* Quicksort code to sort the directories before creating them. Else we could run into the case,
-   that we have to create sub-directories and the parents don't exist yet. */
+/* All directories below /var and /srv known to the rpmdb. The list is sorted
+   before use, so duplicates (directories owned by several packages) can be
+   dropped, and parents are created before their sub-directories. */
+
+#define CACHE_DIR "/var/lib/create-dirs-from-rpmdb"
+#define CACHE_FILE CACHE_DIR "/manifest"
 
 struct node
 {
-  const char *dirname;
+  char *dirname;
   rpm_mode_t fmode;
-  uid_t user_id;
-  gid_t group_id;
+  char *user;
+  char *group;
   time_t fmtime;
 };
 
 struct node *dir_list = NULL;
 size_t dir_list_size = 0, dir_list_capacity = 0;
 
-/* A utility function to insert a node at the beginning of linked list */
+/* Append a directory to the (yet unsorted) list */
 void
 insert_node (const char *dirname, rpm_mode_t fmode,
-	     uid_t user_id, gid_t group_id, time_t fmtime)
+	     const char *user, const char *group, time_t fmtime)
 {
-  /* allocate space for the new node */
-  dir_list_size += 1;
-  size_t new_capacity = dir_list_capacity ? dir_list_capacity : 1;
-  while (new_capacity < dir_list_size)
-      new_capacity *= 2;
-
-  if (new_capacity != dir_list_capacity)
+  if (dir_list_size == dir_list_capacity)
     {
-      dir_list = realloc(dir_list, new_capacity * sizeof(struct node));
+      size_t new_capacity = dir_list_capacity ? dir_list_capacity * 2 : 1024;
+      struct node *new_list = realloc (dir_list, new_capacity * sizeof(struct node));
+      if (new_list == NULL)
+	{
+	  fprintf (stderr, "Out of memory\n");
+	  exit (1);
+	}
+      dir_list = new_list;
       dir_list_capacity = new_capacity;
     }
 
-  struct node *new_node = &dir_list[dir_list_size - 1];
+  struct node *new_node = &dir_list[dir_list_size++];
 
   /* put in the data  */
   new_node->dirname  = strdup (dirname);
   new_node->fmode = fmode;
-  new_node->user_id = user_id;
-  new_node->group_id = group_id;
+  new_node->user = strdup (user);
+  new_node->group = strdup (group);
   new_node->fmtime = fmtime;
+  if (new_node->dirname == NULL || new_node->user == NULL || new_node->group == NULL)
+    {
+      fprintf (stderr, "Out of memory\n");
+      exit (1);
+    }
 }
 
 int
@@ -106,6 +123,46 @@ nodecmp (const void *p1, const void *p2)
     return strcmp(((const struct node*)p1)->dirname, ((const struct node*)p2)->dirname);
 }
 
+static void
+free_node (struct node *node)
+{
+  free (node->dirname);
+  free (node->user);
+  free (node->group);
+}
+
+/* Sort the list and remove duplicates, keeping the first entry */
+static void
+sort_dir_list (void)
+{
+  size_t i, n = 0;
+
+  if (dir_list_size == 0)
+    return;
+
+  qsort (dir_list, dir_list_size, sizeof(struct node), nodecmp);
+  for (i = 1; i < dir_list_size; i++)
+    {
+      if (strcmp (dir_list[n].dirname, dir_list[i].dirname) == 0)
+	free_node (&dir_list[i]);
+      else
+	dir_list[++n] = dir_list[i];
+    }
+  dir_list_size = n + 1;
+}
+
+static void
+free_dir_list (void)
+{
+  size_t i;
+
+  for (i = 0; i < dir_list_size; i++)
+    free_node (&dir_list[i]);
+  free (dir_list);
+  dir_list = NULL;
+  dir_list_size = dir_list_capacity = 0;
+}
+
 static char *
 fmode2str (int mode)
 {
@@ -161,7 +218,6 @@ fmode2str (int mode)
 int
 check_package (rpmts ts, Header h)
 {
-  int ec = 0;
   rpmfi fi = NULL;
   rpmfiFlags fiflags =  (RPMFI_NOHEADER | RPMFI_FLAGS_QUERY);
 
@@ -184,53 +240,16 @@ check_package (rpmts ts, Header h)
 	  for (i = 0; i < sizeof (prefixes)/sizeof(char *); i++)
 	    {
 	      if (!(fflags & RPMFILE_GHOST) &&
-		  strncmp (prefixes[i], fn, strlen (prefixes[i]))== 0 &&
-		  access (fn, F_OK) == -1)
+		  strncmp (prefixes[i], fn, strlen (prefixes[i]))== 0)
 		{
-		  struct tm * tm;
-		  char timefield[100];
 		  rpm_time_t fmtime = rpmfiFMtime(fi);
 		  time_t mtime = fmtime;  /* important if sizeof(int32_t) ! sizeof(time_t) */
+
 		  const char *fuser = rpmfiFUser(fi);
 		  const char *fgroup = rpmfiFGroup(fi);
-		  uid_t user_id;
-		  gid_t group_id;
-		  struct passwd *pwd;
-		  struct group *grp;
-
-		  if (debug_flag)
-		    {
-		      char *perms =  fmode2str (fmode);
-
-		      /* Convert file mtime to display format */
-		      tm = localtime(&mtime);
-		      timefield[0] = '\0';
-		      if (tm != NULL)
-			{
-			  const char *fmt = "%F,%H:%M";
-			  (void)strftime(timefield, sizeof(timefield) - 1, fmt, tm);
-			}
-
-		      printf ("Missing %s (%s,%s,%s,%s)\n",  fn, perms, fuser,
-			      fgroup, timefield);
-		      free (perms);
-		    }
-
-		  pwd = getpwnam (fuser);
-		  grp = getgrnam (fgroup);
-
-		  if (pwd == NULL || grp == NULL)
-		    {
-	              fprintf (stderr, "Failed to resolve %s/%s\n", 
-	                       fuser, fgroup);
-		      ec = 1;
-		      goto exit;
-		    }
-
-		  user_id = pwd->pw_uid;
-		  group_id = grp->gr_gid;
-
-		  insert_node (fn, fmode, user_id, group_id, fmtime);
+
+		  /* Unknown owners will fail to resolve when creating the directory */
+		  insert_node (fn, fmode, fuser ? fuser : "-", fgroup ? fgroup : "-", mtime);
 		}
 	    }
 	}
@@ -239,7 +258,95 @@ check_package (rpmts ts, Header h)
  exit:
   rpmfiFree(fi);
 
-  return ec;
+  return 0;
+}
+
+/* Open parent directories, indexed by their path; as the list is sorted, all
+   sub-directories of a directory follow it directly, so a stack is enough. */
+struct dirfd_entry
+{
+  char *path;
+  int fd;
+};
+
+static struct dirfd_entry dirfd_stack[PATH_MAX / 2];
+static size_t dirfd_depth = 0;
+
+static void
+pop_dirfd (void)
+{
+  dirfd_depth--;
+  close (dirfd_stack[dirfd_depth].fd);
+  free (dirfd_stack[dirfd_depth].path);
+}
+
+static void
+push_dirfd (const char *path, int fd)
+{
+  if (dirfd_depth == sizeof (dirfd_stack) / sizeof (dirfd_stack[0]))
+    {
+      close (fd);
+      return;
+    }
+  dirfd_stack[dirfd_depth].path = strdup (path);
+  if (dirfd_stack[dirfd_depth].path == NULL)
+    {
+      fprintf (stderr, "Out of memory\n");
+      exit (1);
+    }
+  dirfd_stack[dirfd_depth++].fd = fd;
+}
+
+/* Returns a descriptor of the parent directory of the given (absolute) path */
+static int
+get_parent_fd (const char *dirname)
+{
+  const char *slash = strrchr (dirname, '/');
+  size_t len = slash - dirname;
+  char *parent;
+  int fd;
+
+  /* Drop the descriptors of directories which aren't ancestors any more */
+  while (dirfd_depth > 0 &&
+	 !(strncmp (dirfd_stack[dirfd_depth - 1].path, dirname, strlen (dirfd_stack[dirfd_depth - 1].path)) == 0 &&
+	   dirname[strlen (dirfd_stack[dirfd_depth - 1].path)] == '/'))
+    pop_dirfd ();
+
+  if (dirfd_depth > 0 && strlen (dirfd_stack[dirfd_depth - 1].path) == len)
+    return dirfd_stack[dirfd_depth - 1].fd;
+
+  parent = strndup (dirname, len);
+  if (parent == NULL)
+    {
+      fprintf (stderr, "Out of memory\n");
+      exit (1);
+    }
+  fd = open (len ? parent : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    push_dirfd (parent, fd);
+  free (parent);
+  return fd;
+}
+
+static void
+print_missing (struct node *node)
+{
+  char *perms = fmode2str (node->fmode);
+  struct tm *tm;
+  char timefield[100];
+
+  /* Convert file mtime to display format */
+  tm = localtime(&node->fmtime);
+  timefield[0] = '\0';
+  if (tm != NULL)
+    {
+      const char *fmt = "%F,%H:%M";
+      (void)strftime(timefield, sizeof(timefield) - 1, fmt, tm);
+    }
+
+  printf ("Missing %s (%s,%s,%s,%s)\n", node->dirname, perms, node->user,
+	  node->group, timefield);
+  free (perms);
 }
 
 int
@@ -250,77 +357,186 @@ create_dirs (struct node *node, size_t size)
 
   for(i = 0; i < size; ++i, ++node)
     {
-      struct timeval stamps[2] = {
-	{ .tv_sec = node->fmtime, .tv_usec = 0 },
-	{ .tv_sec = node->fmtime, .tv_usec = 0 }};
+      const char *name = strrchr (node->dirname, '/') + 1;
+      struct timespec stamps[2] = {
+	{ .tv_sec = node->fmtime, .tv_nsec = 0 },
+	{ .tv_sec = node->fmtime, .tv_nsec = 0 }};
+      struct passwd *pwd;
+      struct group *grp;
+      int parentfd, fd;
+
+      if (access (node->dirname, F_OK) == 0)
+	continue;
+
+      if (debug_flag)
+	print_missing (node);
+
+      pwd = getpwnam (node->user);
+      grp = getgrnam (node->group);
+      if (pwd == NULL || grp == NULL)
+	{
+	  fprintf (stderr, "Failed to resolve %s/%s\n",
+		   node->user, node->group);
+	  rc = 1;
+	  continue;
+	}
+
+      parentfd = get_parent_fd (node->dirname);
+      if (parentfd < 0)
+	{
+	  fprintf (stderr, "Failed to create directory '%s': %m\n", node->dirname);
+	  rc = 1;
+	  continue;
+	}
 
       if (verbose_flag)
 	printf ("Create %s\n", node->dirname);
 
-      rc = mkdir (node->dirname, node->fmode);
-      if (rc < 0)
+      if (mkdirat (parentfd, name, node->fmode) < 0)
 	{
 	  fprintf (stderr, "Failed to create directory '%s': %m\n", node->dirname);
 	  rc = 1;
 	  continue;
 	}
 
-      rc = chown (node->dirname, node->user_id, node->group_id);
-      if (rc < 0)
+      if (fchownat (parentfd, name, pwd->pw_uid, grp->gr_gid, AT_SYMLINK_NOFOLLOW) < 0)
 	{
 	  fprintf (stderr, "Failed to set owner/group for '%s': %m\n", node->dirname);
 	  /* wrong permissions are bad, remove dir and continue */
-	  rmdir (node->dirname);
+	  unlinkat (parentfd, name, AT_REMOVEDIR);
 	  rc = 1;
 	  continue;
 	}
       /* ignore errors here, time stamps are not critical */
-      utimes (node->dirname, stamps);
+      utimensat (parentfd, name, stamps, AT_SYMLINK_NOFOLLOW);
+
+      /* The directory may be the parent of the next entries */
+      fd = openat (parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (fd >= 0)
+	push_dirfd (node->dirname, fd);
     }
 
+  while (dirfd_depth > 0)
+    pop_dirfd ();
+
   return rc;
 }
 
-int
-rpmCookieUnchanged (const char *rpmdb_cookie)
+/* Key identifying the state of the rpmdb: the rpmdb cookie if available,
+   the modification times and sizes of the database files otherwise. */
+static char *
+get_cache_key (rpmts ts)
 {
-  int unchanged = 0;
-  size_t size = 0;
-  char *oldcookie = NULL;
-  FILE *cookiefile = fopen("/var/lib/create-dirs-from-rpmdb/cookie", "rb");
+  char *key = NULL;
 
-  if (!cookiefile || fseek(cookiefile, 0, SEEK_END) != 0 || (size = ftell(cookiefile)) < 1 || fseek(cookiefile, 0, SEEK_SET) != 0)
-    goto end;
-
-  if (size == strlen(rpmdb_cookie))
+#ifdef HAVE_RPMDBCOOKIE
+  rpmtsOpenDB (ts, O_RDONLY);
+  rpmdbOpenAll (rpmtsGetRdb (ts));
+  const char *cookie = rpmdbCookie (rpmtsGetRdb (ts));
+  if (cookie && asprintf (&key, "cookie %s", cookie) < 0)
+    key = NULL;
+  rpmtsCloseDB (ts);
+#else
+  char *dbpath = rpmGetPath (rpmtsRootDir (ts), "/%{_dbpath}", NULL);
+  DIR *dir = opendir (dbpath);
+  struct timespec latest = { 0, 0 };
+  unsigned long long size = 0;
+  struct dirent *entry;
+
+  if (dir != NULL)
     {
-      oldcookie = malloc(size);
-      if (oldcookie && fread(oldcookie, size, 1, cookiefile) == 1)
-        unchanged = (strncmp(rpmdb_cookie, oldcookie, size) == 0);
+      while ((entry = readdir (dir)) != NULL)
+	{
+	  struct stat st;
+	  if (fstatat (dirfd (dir), entry->d_name, &st, 0) != 0 || !S_ISREG (st.st_mode))
+	    continue;
+	  size += st.st_size;
+	  if (st.st_mtim.tv_sec > latest.tv_sec ||
+	      (st.st_mtim.tv_sec == latest.tv_sec && st.st_mtim.tv_nsec > latest.tv_nsec))
+	    latest = st.st_mtim;
+	}
+      closedir (dir);
+      if (asprintf (&key, "mtime %lld.%09ld %llu", (long long) latest.tv_sec,
+		    latest.tv_nsec, size) < 0)
+	key = NULL;
     }
+  free (dbpath);
+#endif
 
-  end:
+  return key;
+}
 
-  if (oldcookie)
-    free (oldcookie);
+/* Read the directory list of the last run; returns 1 if the cache was created
+   for the given key. Format: key line, then one line per directory
+   "<mode> <mtime> <user> <group> <path>" */
+static int
+read_cache (const char *key)
+{
+  FILE *cache = fopen (CACHE_FILE, "re");
+  char *line = NULL;
+  size_t len = 0;
+  ssize_t n;
+  int valid = 0;
 
-  if (cookiefile)
-    fclose(cookiefile);
+  if (cache == NULL)
+    return 0;
 
-  return unchanged;
+  if ((n = getline (&line, &len, cache)) <= 0 || line[n - 1] != '\n')
+    goto end;
+  line[n - 1] = '\0';
+  if (strcmp (line, key) != 0)
+    goto end;
+
+  valid = 1;
+  while ((n = getline (&line, &len, cache)) > 0)
+    {
+      unsigned int mode;
+      long long mtime;
+      char user[256], group[256];
+      int pos;
+
+      if (line[n - 1] == '\n')
+	line[n - 1] = '\0';
+      if (sscanf (line, "%o %lld %255s %255s %n", &mode, &mtime, user, group, &pos) != 4 ||
+	  line[pos] != '/')
+	{
+	  valid = 0;
+	  break;
+	}
+      insert_node (&line[pos], mode, user, group, mtime);
+    }
+  if (!valid)
+    free_dir_list ();
+
+ end:
+  free (line);
+  fclose (cache);
+  return valid;
 }
 
-void
-rpmCookieWrite (const char *rpmdb_cookie)
+/* Can't do anything if this fails anyway. */
+static void
+write_cache (const char *key)
 {
-  mkdir("/var/lib", 0755);
-  mkdir("/var/lib/create-dirs-from-rpmdb", 0755);
-  FILE *cookief = fopen("/var/lib/create-dirs-from-rpmdb/cookie", "w");
-  if(!cookief)
-      return;
+  FILE *cache;
+  size_t i;
 
-  fwrite(rpmdb_cookie, strlen(rpmdb_cookie), 1, cookief);
-  fclose(cookief);
+  mkdir ("/var/lib", 0755);
+  mkdir (CACHE_DIR, 0755);
+  cache = fopen (CACHE_FILE ".new", "we");
+  if (cache == NULL)
+    return;
+
+  fprintf (cache, "%s\n", key);
+  for (i = 0; i < dir_list_size; i++)
+    fprintf (cache, "%o %lld %s %s %s\n", (unsigned int) dir_list[i].fmode,
+	     (long long) dir_list[i].fmtime, dir_list[i].user,
+	     dir_list[i].group, dir_list[i].dirname);
+
+  if (fclose (cache) != 0 || rename (CACHE_FILE ".new", CACHE_FILE) != 0)
+    unlink (CACHE_FILE ".new");
+  /* Cookie file of older versions */
+  unlink (CACHE_DIR "/cookie");
 }
 
 
@@ -330,7 +546,7 @@ main (int argc, char *argv[])
   Header h;
   rpmts ts = NULL;
   int ec = 0;
-  const char *rpmdb_cookie = NULL;
+  char *cache_key = NULL;
 
 
   while (1)
@@ -390,47 +606,46 @@ main (int argc, char *argv[])
   ts = rpmtsCreate ();
   rpmtsSetRootDir (ts, rpmcliRootDir);
 
-#ifdef HAVE_RPMDBCOOKIE
-  rpmtsOpenDB (ts, O_RDONLY);
-  rpmdbOpenAll (rpmtsGetRdb (ts));
-  rpmdb_cookie = rpmdbCookie (rpmtsGetRdb (ts));
-  rpmtsCloseDB (ts);
-#endif
-  if (rpmdb_cookie && rpmCookieUnchanged(rpmdb_cookie))
+  /* The rpmdb only has to be read if it changed since the last run; the
+     directories are checked in every case, as /var may have been reset. */
+  cache_key = get_cache_key (ts);
+  if (cache_key && read_cache (cache_key))
     {
       if (verbose_flag)
-        puts("RPM cookie unchanged, not doing anything");
-      rpmtsFree (ts);
-      return 0;
+        puts("RPM database unchanged, using cached directory list");
     }
+  else
+    {
+      rpmdbMatchIterator mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
+      if (mi == NULL)
+	{
+	  rpmtsFree (ts);
+	  return 1;
+	}
 
-  rpmdbMatchIterator mi = rpmtsInitIterator (ts, RPMDBI_PACKAGES, NULL, 0);
-  if (mi == NULL)
-    return 1;
+      while ((h = rpmdbNextIterator (mi)) != NULL)
+	{
+	  int rc;
+	  /* rpmsqPoll (); */
+	  if ((rc = check_package (ts, h)) != 0)
+	    ec = rc;
+	}
+      rpmdbFreeIterator (mi);
 
-  while ((h = rpmdbNextIterator (mi)) != NULL)
-    {
-      int rc;
-      /* rpmsqPoll (); */
-      if ((rc = check_package (ts, h)) != 0)
-	ec = rc;
+      sort_dir_list ();
+      if (cache_key)
+	write_cache (cache_key);
     }
 
   if (dir_list != NULL)
     {
       int rc;
-      qsort (dir_list, dir_list_size, sizeof(struct node), nodecmp);
       if ((rc = create_dirs (dir_list, dir_list_size)) != 0)
 	ec = rc;
     }
 
-  /* XXX missing: free list */
-
-  /* Can't do anything if this fails anyway. */
-  if (rpmdb_cookie)
-    rpmCookieWrite(rpmdb_cookie);
-
-  rpmdbFreeIterator (mi);
+  free_dir_list ();
+  free (cache_key);
   rpmtsFree (ts);
 
   return ec;
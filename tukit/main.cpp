@@ -6,6 +6,7 @@
  */
 
 #include "tukit.hpp"
+#include "Log.hpp"
 #include <exception>
 #include <iostream>
 using namespace std;
@@ -16,6 +17,7 @@ int main(int argc, char *argv[]) {
     } catch (int e) {
 	    return e;
     } catch (const exception &e) {
+        tulog.flush();
         cerr << "ERROR: " << e.what() << endl;
         return 1;
     }
@@ -6,18 +6,24 @@
  */
 
 #include "tukit.hpp"
+#include "Cleanup.hpp"
 #include "Configuration.hpp"
+#include "Export.hpp"
+#include "Stats.hpp"
 #include "Transaction.hpp"
 #include "Log.hpp"
+#include "Manifest.hpp"
+#include "SnapshotManager.hpp"
 #include <fcntl.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <csignal>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <vector>
 
 using namespace std;
-using TransactionalUpdate::config;
 
 bool cancel;
 
@@ -43,6 +49,35 @@ void TUKit::displayHelp() {
     cout << "\tenvironment, but instead runs in the current system, replacing '{}' with the\n";
     cout << "\tmount directory of the given snapshot; returns the exit status of the given\n";
     cout << "\tcommand, but will not delete the snapshot in case of errors\n";
+    cout << "batch <ID> [-e] -f <file>\n";
+    cout << "\tResumes the transaction once and executes all commands listed in <file>\n";
+    cout << "\t('-' for stdin), one per line: 'call <command>' or 'callext <command>'\n";
+    cout << "\twith shell-like quoting, but without any expansion; with '-e' execution\n";
+    cout << "\tstops at the first failing command. Returns the exit status of the first\n";
+    cout << "\tfailing command.\n";
+    cout << "session-open <ID>\n";
+    cout << "\tPrepares the transaction's environment once and keeps it for subsequent\n";
+    cout << "\t'call' and 'callext' commands until 'session-close', 'close' or 'abort'\n";
+    cout << "session-close <ID>\n";
+    cout << "\tReleases the environment kept by 'session-open'; the transaction stays open\n";
+    cout << "prepare-spare\n";
+    cout << "\tPrepares a spare snapshot of the default snapshot for the next 'open' or\n";
+    cout << "\t'execute' (see SPARE_SNAPSHOT in tukit.conf)\n";
+    cout << "cleanup\n";
+    cout << "\tDeletes aborted transactions and unused /etc overlays and marks snapshots\n";
+    cout << "\tsuperseded by newer transactions for snapper's \"number\" cleanup\n";
+    cout << "diff <ID>\n";
+    cout << "\tLists the paths changed in the snapshot with the given ID since it was\n";
+    cout << "\tcreated, prefixed with 'M' (modified or created), 'D' (deleted) or 'R'\n";
+    cout << "\t(directory replaced); deletions are only listed for /etc\n";
+    cout << "export <ID> <file> [--parent <base ID>]\n";
+    cout << "\tWrites the closed transaction <ID> including its /etc changes to <file> as btrfs\n";
+    cout << "\tsend stream; with '--parent' only the differences to the read-only snapshot\n";
+    cout << "\t<base ID> are included, which has to exist on the importing system as well\n";
+    cout << "import <file> [--close]\n";
+    cout << "\tCreates a new transaction from a stream written by 'export' ('-' for stdin),\n";
+    cout << "\tbased on the --continue snapshot (the currently running system by default),\n";
+    cout << "\tand prints its ID; with '--close' it is closed immediately\n";
     cout << "close <ID>\n";
     cout << "\tCloses the given transaction and sets the snapshot as the new default snapshot\n";
     cout << "abort <ID>\n";
@@ -52,6 +87,8 @@ void TUKit::displayHelp() {
     cout << "--discard, -d                Discard snapshot if no files were changed in root\n";
     cout << "--help, -h                   Display this help and exit\n";
     cout << "--quiet, -q                  Decrease verbosity\n";
+    cout << "--timings                    Print timings and counters of the phases as JSON\n";
+    cout << "                             to stderr when done\n";
     cout << "--verbose, -v                Increase verbosity\n";
     cout << "--version, -V                Display version and exit\n" << endl;
 }
@@ -63,6 +100,7 @@ int TUKit::parseOptions(int argc, char *argv[]) {
         { "discard", no_argument, nullptr, 'd' },
         { "help", no_argument, nullptr, 'h' },
         { "quiet", no_argument, nullptr, 'q' },
+        { "timings", no_argument, nullptr, 't' },
         { "verbose", no_argument, nullptr, 'v' },
         { "version", no_argument, nullptr, 'V' },
         { 0, 0, 0, 0 }
@@ -88,6 +126,9 @@ int TUKit::parseOptions(int argc, char *argv[]) {
         case 'q':
             tulog.level = TULogLevel::Error;
             break;
+        case 't':
+            showTimings = true;
+            break;
         case 'v':
             tulog.level = TULogLevel::Debug;
             break;
@@ -103,6 +144,90 @@ int TUKit::parseOptions(int argc, char *argv[]) {
     return optind;
 }
 
+// Splits a line of a 'batch' command file into words following the shell's
+// quoting rules; unlike the shell no expansion of variables, '~' or globs is
+// done, as that would happen against the host instead of the snapshot
+static vector<string> splitWords(const string &line) {
+    vector<string> words;
+    string word;
+    bool inWord = false;
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (c == ' ' || c == '\t') {
+            if (inWord)
+                words.push_back(std::move(word));
+            word.clear();
+            inWord = false;
+            continue;
+        }
+        inWord = true;
+        if (c == '\'') {
+            size_t end = line.find('\'', i + 1);
+            if (end == string::npos)
+                throw invalid_argument{"Unterminated quote."};
+            word.append(line, i + 1, end - i - 1);
+            i = end;
+        } else if (c == '"') {
+            for (i++; i < line.size() && line[i] != '"'; i++) {
+                if (line[i] == '\\' && i + 1 < line.size() && string{"\"\\$`"}.find(line[i + 1]) != string::npos)
+                    i++;
+                word += line[i];
+            }
+            if (i == line.size())
+                throw invalid_argument{"Unterminated quote."};
+        } else if (c == '\\') {
+            if (++i == line.size())
+                throw invalid_argument{"Trailing backslash."};
+            word += line[i];
+        } else {
+            word += c;
+        }
+    }
+    if (inWord)
+        words.push_back(std::move(word));
+    return words;
+}
+
+// Reads a list of commands for 'batch'
+static vector<TransactionalUpdate::Transaction::Command> readCommands(const string &file) {
+    ifstream input;
+    if (file != "-") {
+        input.open(file);
+        if (!input)
+            throw runtime_error{"Could not open command file '" + file + "'."};
+    }
+    istream &in = (file == "-") ? cin : input;
+
+    vector<TransactionalUpdate::Transaction::Command> commands;
+    string line;
+    int lineno = 0;
+    while (getline(in, line)) {
+        lineno++;
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#')
+            continue;
+
+        vector<string> words;
+        try {
+            words = splitWords(line);
+        } catch (const invalid_argument &e) {
+            throw invalid_argument{file + ":" + to_string(lineno) + ": " + e.what()};
+        }
+        TransactionalUpdate::Transaction::Command command;
+        command.argv.assign(words.begin() + 1, words.end());
+        const string &type = words[0];
+
+        if (type == "callext")
+            command.external = true;
+        else if (type != "call")
+            throw invalid_argument{file + ":" + to_string(lineno) + ": Unknown command type '" + type + "'."};
+        if (command.argv.empty())
+            throw invalid_argument{file + ":" + to_string(lineno) + ": Missing command."};
+        commands.push_back(std::move(command));
+    }
+    return commands;
+}
+
 int TUKit::processCommand(char *argv[]) {
     TransactionalUpdate::Transaction transaction{};
 
@@ -128,6 +253,7 @@ int TUKit::processCommand(char *argv[]) {
             transaction.setDiscardIfUnchanged(true);
         }
         transaction.init(baseSnapshot);
+        tulog.flush();
         cout << "ID: " << transaction.getSnapshot() << endl;
         transaction.keep();
         return 0;
@@ -152,6 +278,153 @@ int TUKit::processCommand(char *argv[]) {
         transaction.keep();
         return status;
     }
+    else if (arg == "batch") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'batch'"};
+        }
+        string file;
+        bool stopOnError = false;
+        for (int i = 2; argv[i] != nullptr; i++) {
+            string opt = argv[i];
+            if (opt == "-e") {
+                stopOnError = true;
+            } else if (opt == "-f" && argv[i + 1] != nullptr) {
+                file = argv[++i];
+            } else {
+                displayHelp();
+                throw invalid_argument{"Unknown argument '" + opt + "' for 'batch'"};
+            }
+        }
+        if (file.empty()) {
+            displayHelp();
+            throw invalid_argument{"Missing command file for 'batch'"};
+        }
+        vector<TransactionalUpdate::Transaction::Command> commands = readCommands(file);
+        transaction.resume(argv[1]);
+        auto results = transaction.executeMany(commands, stopOnError);
+        transaction.keep();
+        int status = 0;
+        for (size_t i = 0; i < results.size(); i++) {
+            if (results[i].status != 0) {
+                tulog.info("Command ", i + 1, " of ", commands.size(), " failed with exit status ", results[i].status, ".");
+                if (status == 0)
+                    status = results[i].status;
+            }
+        }
+        return status;
+    }
+    else if (arg == "session-open") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'session-open'"};
+        }
+        transaction.resume(argv[1]);
+        transaction.openSession();
+        transaction.keep();
+        return 0;
+    }
+    else if (arg == "session-close") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'session-close'"};
+        }
+        transaction.resume(argv[1]);
+        transaction.closeSession();
+        transaction.keep();
+        return 0;
+    }
+    else if (arg == "prepare-spare") {
+        transaction.prepareSpare();
+        return 0;
+    }
+    else if (arg == "cleanup") {
+        unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        TransactionalUpdate::Cleanup::snapshots(*snapshotMgr);
+        TransactionalUpdate::Cleanup::overlays(*snapshotMgr);
+        return 0;
+    }
+    else if (arg == "diff") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'diff'"};
+        }
+        unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+        unique_ptr<TransactionalUpdate::Snapshot> snapshot = snapshotMgr->open(argv[1]);
+        for (auto &entry: TransactionalUpdate::Manifest::forSnapshot(*snapshot))
+            cout << TransactionalUpdate::Manifest::getSymbol(entry.change) << " " << entry.path.string() << "\n";
+        cout << flush;
+        return 0;
+    }
+    else if (arg == "export") {
+        if (argv[1] == nullptr || argv[2] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'export'"};
+        }
+        string parent;
+        for (int i = 3; argv[i] != nullptr; i++) {
+            string opt = argv[i];
+            if (opt == "--parent" && argv[i + 1] != nullptr) {
+                parent = argv[++i];
+            } else {
+                displayHelp();
+                throw invalid_argument{"Unknown argument '" + opt + "' for 'export'"};
+            }
+        }
+        // stdout is used for messages
+        int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0)
+            throw runtime_error{"Could not open " + string(argv[2]) + ": " + string(strerror(errno))};
+        try {
+            unique_ptr<TransactionalUpdate::SnapshotManager> snapshotMgr = TransactionalUpdate::SnapshotFactory::get();
+            TransactionalUpdate::Export::write(*snapshotMgr, argv[1], parent, fd);
+        } catch (const exception &e) {
+            close(fd);
+            unlink(argv[2]);
+            throw;
+        }
+        if (close(fd) != 0)
+            throw runtime_error{"Writing " + string(argv[2]) + " failed: " + string(strerror(errno))};
+        return 0;
+    }
+    else if (arg == "import") {
+        if (argv[1] == nullptr) {
+            displayHelp();
+            throw invalid_argument{"Missing argument for 'import'"};
+        }
+        bool closeImported = false;
+        for (int i = 2; argv[i] != nullptr; i++) {
+            string opt = argv[i];
+            if (opt == "--close") {
+                closeImported = true;
+            } else {
+                displayHelp();
+                throw invalid_argument{"Unknown argument '" + opt + "' for 'import'"};
+            }
+        }
+        int fd = STDIN_FILENO;
+        if (string(argv[1]) != "-") {
+            fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                throw runtime_error{"Could not open " + string(argv[1]) + ": " + string(strerror(errno))};
+        }
+        try {
+            transaction.import(fd, baseSnapshot);
+        } catch (const exception &e) {
+            if (fd != STDIN_FILENO)
+                close(fd);
+            throw;
+        }
+        if (fd != STDIN_FILENO)
+            close(fd);
+        tulog.flush();
+        cout << "ID: " << transaction.getSnapshot() << endl;
+        if (closeImported)
+            transaction.finalize();
+        else
+            transaction.keep();
+        return 0;
+    }
     else if (arg == "close") {
         transaction.resume(argv[1]);
         transaction.finalize();
@@ -167,27 +440,6 @@ int TUKit::processCommand(char *argv[]) {
     }
 }
 
-class Lock {
-public:
-    Lock(){
-        lockfile = open(config.get("LOCKFILE").c_str(), O_CREAT|O_WRONLY, 0600);
-        if (lockfile < 0) {
-            throw runtime_error{"Could not create lock file '" + config.get("LOCKFILE") + "': " + strerror(errno)};
-        }
-        int status = lockf(lockfile, F_TLOCK, (off_t)10000);
-        if (status) {
-            throw runtime_error{"Another instance of tukit is already running: " + string(strerror(errno))};
-            remove(config.get("LOCKFILE").c_str());
-        }
-    }
-    ~Lock() {
-        close(lockfile);
-        remove(config.get("LOCKFILE").c_str());
-    }
-private:
-    int lockfile;
-};
-
 void interrupt(int signal) {
     //Nothing to do here - the child has been signalled already as it's part of the same
     // progress group. Maybe it may be worth killing the process when receiving multiple
@@ -195,6 +447,22 @@ void interrupt(int signal) {
     tulog.debug("tukit: Received signal ", signal);
 }
 
+// Failing to export the statistics must not fail the transaction
+void TUKit::reportStats(const string &command) {
+    if (showTimings) {
+        tulog.flush();
+        cerr << TransactionalUpdate::tustats.toJson() << endl;
+    }
+    string metricsFile = TransactionalUpdate::config.get("METRICS_FILE");
+    if (metricsFile.empty())
+        return;
+    try {
+        TransactionalUpdate::tustats.writeTextfile(metricsFile, command);
+    } catch (const exception &e) {
+        tulog.error("Writing metrics failed: ", e.what());
+    }
+}
+
 TUKit::TUKit(int argc, char *argv[]) {
     signal(SIGINT, interrupt);
     signal(SIGHUP, interrupt);
@@ -208,7 +476,6 @@ TUKit::TUKit(int argc, char *argv[]) {
         throw ret;
     }
 
-    Lock lock;
     tulog.info("tukit ", VERSION, " started");
 
     string optionsline = "Options: ";
@@ -216,7 +483,15 @@ TUKit::TUKit(int argc, char *argv[]) {
         optionsline.append(argv[i]).append(" ");
     tulog.info(optionsline);
 
-    ret = processCommand(&argv[ret]);
+    string command = argv[ret] ? argv[ret] : "";
+    try {
+        TransactionalUpdate::TUStats::Timer timer{"total"};
+        ret = processCommand(&argv[ret]);
+    } catch (...) {
+        reportStats(command);
+        throw;
+    }
+    reportStats(command);
     if (ret != 0) {
         throw ret;
     }
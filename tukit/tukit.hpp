@@ -19,8 +19,10 @@ public:
     int parseOptions(int argc, char *argv[]);
     int processCommand(char *argv[]);
 private:
+    void reportStats(const std::string &command);
     std::string baseSnapshot = "active";
     bool discardSnapshot = false;
+    bool showTimings = false;
 };
 
 #endif /* TRANSACTIONALUPDATE_H */